@@ -0,0 +1,25 @@
+# Copyright (c) BBP/EPFL 2018, Stefan.Eilemann@epfl.ch
+#
+# Find the Lightning Memory-Mapped Database (LMDB)
+#
+# Sets:
+#  LMDB_FOUND
+#  LMDB_INCLUDE_DIRS
+#  LMDB_LIBRARIES
+#
+# Hints: LMDB_ROOT, $ENV{LMDB_ROOT}
+
+find_path(LMDB_INCLUDE_DIR lmdb.h
+  HINTS ${LMDB_ROOT} $ENV{LMDB_ROOT} PATH_SUFFIXES include)
+find_library(LMDB_LIBRARY lmdb
+  HINTS ${LMDB_ROOT} $ENV{LMDB_ROOT} PATH_SUFFIXES lib lib64)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(LMDB DEFAULT_MSG
+  LMDB_LIBRARY LMDB_INCLUDE_DIR)
+
+if(LMDB_FOUND)
+  set(LMDB_INCLUDE_DIRS ${LMDB_INCLUDE_DIR})
+  set(LMDB_LIBRARIES ${LMDB_LIBRARY})
+endif()
+mark_as_advanced(LMDB_INCLUDE_DIR LMDB_LIBRARY)
@@ -0,0 +1,25 @@
+# Copyright (c) BBP/EPFL 2018, Stefan.Eilemann@epfl.ch
+#
+# Find the Zstandard compression library (zstd) with dictionary training
+#
+# Sets:
+#  ZSTD_FOUND
+#  ZSTD_INCLUDE_DIRS
+#  ZSTD_LIBRARIES
+#
+# Hints: ZSTD_ROOT, $ENV{ZSTD_ROOT}
+
+find_path(ZSTD_INCLUDE_DIR zdict.h
+  HINTS ${ZSTD_ROOT} $ENV{ZSTD_ROOT} PATH_SUFFIXES include)
+find_library(ZSTD_LIBRARY zstd
+  HINTS ${ZSTD_ROOT} $ENV{ZSTD_ROOT} PATH_SUFFIXES lib lib64)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(ZSTD DEFAULT_MSG
+  ZSTD_LIBRARY ZSTD_INCLUDE_DIR)
+
+if(ZSTD_FOUND)
+  set(ZSTD_INCLUDE_DIRS ${ZSTD_INCLUDE_DIR})
+  set(ZSTD_LIBRARIES ${ZSTD_LIBRARY})
+endif()
+mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARY)
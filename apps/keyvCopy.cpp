@@ -0,0 +1,398 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// keyv-copy: streams all keys and values from one keyv store to another.
+//
+// The source is enumerated in batches by the main thread. Worker threads fetch
+// the values of a batch and insert them into the destination. At most
+// 'queue' batches are in flight, which bounds the memory usage. Every second,
+// the destination is flushed and the last key of all completed batches is
+// saved to the checkpoint file, from which an interrupted copy resumes.
+// Snapshots for mmap:// are only written at the end and can't be resumed.
+
+#include <keyv/Map.h>
+#ifndef _WIN32
+#include <keyv/MmapWriter.h>
+#endif
+
+#include <lunchbox/clock.h>
+
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace po = boost::program_options;
+
+namespace
+{
+struct Batch
+{
+    size_t sequence;
+    keyv::Strings keys;
+};
+
+/** Destination store, either any Map or a snapshot for mmap:// URIs. */
+class Destination
+{
+public:
+    explicit Destination(const servus::URI& uri)
+    {
+#ifndef _WIN32
+        if (uri.getScheme() == "mmap")
+        {
+            _writer.reset(
+                new keyv::MmapWriter(uri.getHost() + uri.getPath()));
+            return;
+        }
+#endif
+        _map.reset(new keyv::Map(uri));
+    }
+
+    void insert(const keyv::Strings& keys, const keyv::Values& values)
+    {
+#ifndef _WIN32
+        if (_writer)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (size_t i = 0; i < values.size(); ++i)
+                if (values.isFound(i))
+                    _writer->insert(keys[i], values[i].data, values[i].size);
+            return;
+        }
+#endif
+        for (size_t i = 0; i < values.size(); ++i)
+            if (values.isFound(i) &&
+                !_map->insert(keys[i], values[i].data, values[i].size))
+            {
+                throw std::runtime_error("Insert of " + keys[i] + " failed");
+            }
+    }
+
+    bool flush()
+    {
+#ifndef _WIN32
+        if (_writer)
+        {
+            _writer->commit();
+            return true;
+        }
+#endif
+        return _map->flush();
+    }
+
+private:
+    std::unique_ptr<keyv::Map> _map;
+#ifndef _WIN32
+    std::mutex _mutex;
+    std::unique_ptr<keyv::MmapWriter> _writer;
+#endif
+};
+
+/** Tracks completed batches, and the last key before the first gap. */
+class Progress
+{
+public:
+    Progress(const std::string& checkpoint, const std::string& resumeKey)
+        : _checkpoint(checkpoint)
+        , _lastKey(resumeKey)
+        , _savedKey(resumeKey)
+    {
+    }
+
+    void completed(const Batch& batch, const keyv::Values& values)
+    {
+        size_t bytes = 0;
+        for (size_t i = 0; i < values.size(); ++i)
+            bytes += values[i].size;
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _numKeys += batch.keys.size();
+        _numValues += values.getNumValues();
+        _bytes += bytes;
+        _completed[batch.sequence] = batch.keys.back();
+
+        for (auto i = _completed.begin();
+             i != _completed.end() && i->first == _next;
+             i = _completed.erase(i))
+        {
+            _lastKey = i->second;
+            ++_next;
+        }
+    }
+
+    // Saves the last completed key once the destination has been flushed,
+    // at most once per second and by one thread at a time
+    void checkpoint(Destination& destination)
+    {
+        if (_checkpoint.empty())
+            return;
+        std::unique_lock<std::mutex> saving(_saveMutex, std::try_to_lock);
+        if (!saving.owns_lock())
+            return;
+
+        std::string key;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            const double time = _clock.getTimed() / 1000.;
+            if (_lastKey == _savedKey || time - _lastSave < 1.)
+                return;
+            _lastSave = time;
+            key = _lastKey;
+        }
+        if (!destination.flush())
+            throw std::runtime_error("Flush of destination failed");
+        _save(key);
+        _savedKey = key;
+    }
+
+    void print(const bool final)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        const double time = _clock.getTimed() / 1000.;
+        if (!final && time - _lastPrint < 1.)
+            return;
+        _lastPrint = time;
+
+        std::cout << boost::format(
+                         "%10.1fs: %12i keys, %12i values, %10.1f MB, "
+                         "%10.1f keys/s, %8.2f MB/s") %
+                         time % _numKeys % _numValues %
+                         (_bytes / 1024. / 1024.) % (_numKeys / time) %
+                         (_bytes / 1024. / 1024. / time)
+                  << (final ? "\n" : "\r") << std::flush;
+    }
+
+    void done()
+    {
+        if (!_checkpoint.empty())
+            ::remove(_checkpoint.c_str());
+    }
+
+private:
+    const std::string _checkpoint;
+    std::mutex _mutex;
+    std::map<size_t, std::string> _completed; // sequence -> last key
+    size_t _next = 0;                         // first uncompleted batch
+    std::string _lastKey;
+    size_t _numKeys = 0;
+    size_t _numValues = 0;
+    size_t _bytes = 0;
+    lunchbox::Clock _clock;
+    double _lastPrint = 0.;
+    double _lastSave = 0.;
+
+    std::mutex _saveMutex; // protects the following
+    std::string _savedKey;
+
+    // atomically replace the checkpoint file
+    void _save(const std::string& key)
+    {
+        const std::string tmpName = _checkpoint + ".tmp";
+        {
+            std::ofstream file(tmpName, std::ios::binary | std::ios::trunc);
+            file.write(key.data(), key.size());
+        }
+        ::rename(tmpName.c_str(), _checkpoint.c_str());
+    }
+};
+
+std::string _readCheckpoint(const std::string& filename)
+{
+    if (filename.empty())
+        return std::string();
+    std::ifstream file(filename, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file),
+                       std::istreambuf_iterator<char>());
+}
+}
+
+int main(const int argc, char* argv[])
+{
+    po::options_description options(
+        "keyv-copy: copy all keys and values between keyv stores\n\n"
+        "Usage: keyv-copy [options] source-uri destination-uri\n\nOptions");
+    size_t threads = 4;
+    size_t batchSize = 1024;
+    size_t queueSize = 0;
+    std::string checkpoint;
+    std::string source;
+    std::string destination;
+    // clang-format off
+    options.add_options()
+        ("help,h", "Display usage information and exit")
+        ("threads,t", po::value<size_t>(&threads)->default_value(threads),
+         "Number of reader and writer threads")
+        ("batch,b", po::value<size_t>(&batchSize)->default_value(batchSize),
+         "Number of keys per batch")
+        ("queue,q", po::value<size_t>(&queueSize),
+         "Maximum number of batches in flight [default: 2 * threads]")
+        ("checkpoint,c", po::value<std::string>(&checkpoint),
+         "File to resume from and to save progress to, not supported for "
+         "mmap:// destinations");
+    po::options_description hidden;
+    hidden.add_options()
+        ("source", po::value<std::string>(&source)->required(), "")
+        ("destination", po::value<std::string>(&destination)->required(), "");
+    // clang-format on
+    po::positional_options_description positional;
+    positional.add("source", 1).add("destination", 1);
+
+    po::options_description all;
+    all.add(options).add(hidden);
+    po::variables_map vm;
+    try
+    {
+        po::store(po::command_line_parser(argc, argv)
+                      .options(all)
+                      .positional(positional)
+                      .run(),
+                  vm);
+        if (vm.count("help"))
+        {
+            std::cout << options << std::endl;
+            return EXIT_SUCCESS;
+        }
+        po::notify(vm);
+    }
+    catch (const po::error& e)
+    {
+        std::cerr << e.what() << std::endl << options << std::endl;
+        return EXIT_FAILURE;
+    }
+    threads = std::max(threads, size_t(1));
+    batchSize = std::max(batchSize, size_t(1));
+    if (queueSize == 0)
+        queueSize = 2 * threads;
+    if (!checkpoint.empty() && servus::URI(destination).getScheme() == "mmap")
+    {
+        std::cerr << "Checkpoints are not supported for mmap:// destinations, "
+                     "the snapshot is only written at the end of the copy"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        const keyv::Map from{servus::URI(source)};
+        Destination to{servus::URI(destination)};
+
+        const std::string resumeKey = _readCheckpoint(checkpoint);
+        if (!resumeKey.empty())
+            std::cout << "Resuming from checkpoint " << checkpoint
+                      << std::endl;
+        Progress progress(checkpoint, resumeKey);
+
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::deque<Batch> queue;
+        size_t inFlight = 0;
+        bool finished = false;
+        std::exception_ptr error;
+
+        const auto work = [&] {
+            for (;;)
+            {
+                Batch batch;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    condition.wait(lock, [&] {
+                        return !queue.empty() || finished || error;
+                    });
+                    if (queue.empty() || error)
+                        return;
+                    batch = std::move(queue.front());
+                    queue.pop_front();
+                }
+
+                try
+                {
+                    const keyv::Values& values = from.fetch(batch.keys);
+                    to.insert(batch.keys, values);
+                    progress.completed(batch, values);
+                    progress.checkpoint(to);
+                    progress.print(false);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    error = std::current_exception();
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    --inFlight;
+                }
+                condition.notify_all();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back(work);
+
+        // enumerate source, blocking while the queue is full
+        std::string after = resumeKey;
+        for (size_t sequence = 0;; ++sequence)
+        {
+            Batch batch{sequence, from.getKeys(after, batchSize)};
+            if (batch.keys.empty())
+                break;
+            after = batch.keys.back();
+
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [&] { return inFlight < queueSize || error; });
+            if (error)
+                break;
+            ++inFlight;
+            queue.push_back(std::move(batch));
+            condition.notify_all();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished = true;
+        }
+        condition.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+
+        if (error)
+            std::rethrow_exception(error);
+        if (!to.flush())
+            throw std::runtime_error("Flush of " + destination + " failed");
+        progress.print(true);
+        progress.done();
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << std::endl << "Copy failed: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -16,6 +16,9 @@
  * along with this library; if not, write to the Free Software Foundation, Inc.,
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
+#include "Counter.h"
+#include "Deadline.h"
+
 #include <keyv/Plugin.h>
 
 #include <lunchbox/log.h>
@@ -25,6 +28,15 @@
 
 #include <boost/filesystem.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
 namespace keyv
 {
 class Ceph;
@@ -32,6 +44,9 @@ class Ceph;
 namespace
 {
 lunchbox::PluginRegisterer<Ceph> registerer;
+const uint64_t erasesPerOp = 1024;
+const size_t maxRetries = 100; // of atomic updates racing with other writers
+const std::chrono::microseconds maxPollInterval(1000); // for deadlines
 
 void _throw(const std::string& reason, const int error)
 {
@@ -49,25 +64,49 @@ public:
     static bool handles(const servus::URI& uri);
     static std::string getDescription();
 
+    size_t setQueueDepth(size_t depth) final;
+
     bool insert(const std::string& key, const void* data,
                 const size_t size) final;
 
+    bool insertParts(const std::string& key, const Spans& parts) final;
+
     std::string operator[](const std::string& key) const final;
 
     void takeValues(const Strings& keys, const ValueFunc& func) const final;
 
     void getValues(const Strings& keys, const ConstValueFunc& func) const final;
 
+    void getBatch(const Strings& keys, ConstBatchFunc func) const final;
+
+    void getSizes(const Strings& keys, const SizeFunc& func) const final;
+
+    bool compareAndSwap(const std::string& key, const void* expected,
+                        size_t expectedSize, const void* data,
+                        size_t size) final;
+
+    uint64_t increment(const std::string& key, uint64_t delta) final;
+
+    bool append(const std::string& key, const void* data, size_t size) final;
+
+    Strings getKeys(const std::string& after, size_t maxKeys) const final;
+
     void erase(const std::string& key) final;
 
-    bool flush() final { return true; }
+    void clear() final;
+
+    void erasePrefix(const std::string& prefix) final;
+
+    bool flush() final;
+
 private:
+    using IOMap = std::map<std::string, librados::bufferlist>;
+
     template <typename F>
     void _getValues(const Strings& keys, const F& func, const bool doCopy) const
     {
         IOMap map;
-        int ret = _context.omap_get_vals_by_keys(
-            _storeName, std::set<std::string>(keys.begin(), keys.end()), &map);
+        int ret = _read(std::set<std::string>(keys.begin(), keys.end()), map);
         if (ret < 0)
         {
             std::cerr << "Take failed: " << ::strerror(-ret) << std::endl;
@@ -92,14 +131,221 @@ private:
             func(pair.first, data, bl.length());
         }
     }
+
+    // The IoCtx is shared by all threads. Each operation is submitted
+    // asynchronously with its own completion, so that concurrent callers
+    // do not serialize on the context.
+    int _wait(librados::AioCompletion* completion, int ret) const
+    {
+        if (ret >= 0)
+        {
+            if (Deadline::isSet())
+                ret = _waitUntilDeadline(completion);
+            else
+            {
+                completion->wait_for_complete();
+                ret = completion->get_return_value();
+            }
+        }
+        completion->release();
+        return ret;
+    }
+
+    // Cancels the operation at the deadline. A cancelled write may still be
+    // applied.
+    int _waitUntilDeadline(librados::AioCompletion* completion) const
+    {
+        if (_poll(completion))
+            return completion->get_return_value();
+
+        _context.aio_cancel(completion);
+        completion->wait_for_complete();
+        return -ETIMEDOUT;
+    }
+
+    // librados has no timed wait, poll the completion with growing intervals
+    // @return false if the deadline of the caller expired before completion
+    bool _poll(librados::AioCompletion* completion) const
+    {
+        if (!Deadline::isSet())
+        {
+            completion->wait_for_complete();
+            return true;
+        }
+
+        std::chrono::microseconds interval(10);
+        while (!completion->is_complete())
+        {
+            if (Deadline::isExpired())
+                return false;
+            std::this_thread::sleep_for(interval);
+            interval = std::min(interval * 2, maxPollInterval);
+        }
+        return true;
+    }
+
+    int _write(librados::ObjectWriteOperation& op)
+    {
+        librados::AioCompletion* completion =
+            librados::Rados::aio_create_completion();
+        return _wait(completion,
+                     _context.aio_operate(_storeName, completion, &op));
+    }
+
+    // Waits for the write, or submits it if the queue depth is not zero
+    bool _insert(librados::ObjectWriteOperation& op)
+    {
+        if (_depth == 0)
+        {
+            const int ret = _write(op);
+            if (ret < 0)
+            {
+                std::cerr << "Write failed: " << ::strerror(-ret) << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        librados::AioCompletion* completion =
+            librados::Rados::aio_create_completion();
+        const int ret = _context.aio_operate(_storeName, completion, &op);
+        if (ret < 0)
+        {
+            completion->release();
+            std::cerr << "Write failed: " << ::strerror(-ret) << std::endl;
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _pending.push_back(completion);
+        }
+        return _drain(_depth, completion);
+    }
+
+    // Waits for the oldest outstanding writes until at most depth remain,
+    // without holding the lock. Writes to the object complete in order, and
+    // are visible to later reads. The deadline of the caller only abandons
+    // its own write: an older write it expires on stays queued, and own is
+    // cancelled if it was not taken by another thread.
+    // @return false if the deadline expired or own failed
+    bool _drain(const size_t depth, librados::AioCompletion* own = nullptr)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_pending.size() > depth)
+        {
+            librados::AioCompletion* completion = _pending.front();
+            _pending.pop_front();
+            ++_waiting;
+            lock.unlock();
+
+            const bool done = completion == own || _poll(completion);
+            const int ret = done ? _wait(completion, 0) : 0;
+
+            lock.lock();
+            --_waiting;
+            _drained.notify_all();
+            if (!done)
+            {
+                _pending.push_front(completion);
+                const auto i = std::find(_pending.begin(), _pending.end(), own);
+                if (!own || i == _pending.end())
+                    return false;
+                _pending.erase(i);
+                lock.unlock();
+                return _wait(own, 0) >= 0;
+            }
+            if (ret < 0)
+            {
+                std::cerr << "Write failed: " << ::strerror(-ret) << std::endl;
+                if (completion == own)
+                    return false;
+                _failed = true;
+            }
+        }
+        if (depth > 0)
+            return true;
+
+        // writes taken by other threads
+        const auto drained = [this] { return _waiting == 0; };
+        if (!Deadline::isSet())
+        {
+            _drained.wait(lock, drained);
+            return true;
+        }
+        return _drained.wait_until(lock, Deadline::get(), drained);
+    }
+
+    // @return the result of the operation, or ret if it succeeded
+    int _read(librados::ObjectReadOperation& op, const int& ret) const
+    {
+        librados::AioCompletion* completion =
+            librados::Rados::aio_create_completion();
+        const int result = _wait(completion, _context.aio_operate(
+                                                 _storeName, completion, &op,
+                                                 nullptr));
+        return result < 0 ? result : ret;
+    }
+
+    int _read(const std::set<std::string>& keys, IOMap& map) const
+    {
+        int ret = 0;
+        librados::ObjectReadOperation op;
+        op.omap_get_vals_by_keys(keys, &map, &ret);
+        return _read(op, ret);
+    }
+
+    // Sets the value of key if its current value equals expected, in one
+    // atomic operation. A missing key compares equal to an empty value.
+    // @return -ECANCELED if the value differs
+    int _swap(const std::string& key, librados::bufferlist expected,
+              librados::bufferlist value)
+    {
+        int ret = 0;
+        librados::ObjectWriteOperation op;
+        op.create(false);
+        op.omap_cmp({{key, {std::move(expected), LIBRADOS_CMPXATTR_OP_EQ}}},
+                    &ret);
+        op.omap_set({{key, std::move(value)}});
+        return _write(op);
+    }
+
+    // Replaces the value of key by modify(value) until no other writer
+    // changed it in between
+    // @return -ECANCELED if other writers won all retries
+    template <typename F>
+    int _update(const std::string& key, const F& modify)
+    {
+        for (size_t i = 0; i < maxRetries; ++i)
+        {
+            IOMap map;
+            int ret = _read({key}, map);
+            if (ret < 0)
+                return ret;
+
+            librados::bufferlist current = map[key];
+            ret = _swap(key, current, modify(current));
+            if (ret != -ECANCELED)
+                return ret;
+        }
+        return -ECANCELED;
+    }
+
     librados::Rados _cluster;
     mutable librados::IoCtx _context;
     std::string _storeName;
 
-    using IOMap = std::map<std::string, librados::bufferlist>;
+    std::atomic<size_t> _depth;
+    std::mutex _mutex; // protects the following
+    std::condition_variable _drained;
+    std::deque<librados::AioCompletion*> _pending; // oldest first
+    size_t _waiting; // taken from _pending and waited on outside the lock
+    bool _failed;
 };
 
 inline Ceph::Ceph(const servus::URI& uri)
+    : _depth(0)
+    , _waiting(0)
+    , _failed(false)
 {
     const auto poolName = uri.getUserinfo();
     const auto cephUserName = "client." + poolName;
@@ -172,6 +418,12 @@ inline Ceph::Ceph(const servus::URI& uri)
 
 inline Ceph::~Ceph()
 {
+    // no other operation runs, wait regardless of a deadline of the caller
+    for (librados::AioCompletion* completion : _pending)
+    {
+        completion->wait_for_complete();
+        completion->release();
+    }
     _context.close();
     _cluster.shutdown();
 }
@@ -186,25 +438,58 @@ inline std::string Ceph::getDescription()
     return "ceph://user@cluster?[store=storeName&config=path&keyring=path]";
 }
 
+inline size_t Ceph::setQueueDepth(const size_t depth)
+{
+    _depth = depth;
+    _drain(depth);
+    return depth;
+}
+
+inline bool Ceph::flush()
+{
+    const bool drained = _drain(0);
+    std::lock_guard<std::mutex> lock(_mutex);
+    const bool ok = drained && !_failed;
+    _failed = false;
+    return ok;
+}
+
 inline bool Ceph::insert(const std::string& key, const void* data,
                          const size_t size)
 {
     librados::bufferlist bl;
     bl.append((const char*)data, size);
 
-    int ret = _context.omap_set(_storeName, {{key, std::move(bl)}});
-    if (ret < 0)
+    librados::ObjectWriteOperation op;
+    op.omap_set({{key, std::move(bl)}});
+    return _insert(op);
+}
+
+// Without a queue depth, the parts are referenced, not copied, since
+// _insert() waits until the operation is complete. Asynchronous writes copy
+// them, since an adaptive queue depth changes while the caller writes.
+inline bool Ceph::insertParts(const std::string& key, const Spans& parts)
+{
+    const bool async = _depth > 0;
+    librados::bufferlist bl;
+    for (const auto& part : parts)
     {
-        std::cerr << "Write failed: " << ::strerror(-ret) << std::endl;
-        return false;
+        if (async)
+            bl.append((const char*)part.data, part.size);
+        else
+            bl.push_back(ceph::buffer::create_static(part.size,
+                                                     (char*)part.data));
     }
-    return true;
+
+    librados::ObjectWriteOperation op;
+    op.omap_set({{key, std::move(bl)}});
+    return _insert(op);
 }
 
 inline std::string Ceph::operator[](const std::string& key) const
 {
     IOMap map;
-    int ret = _context.omap_get_vals_by_keys(_storeName, {key}, &map);
+    const int ret = _read({key}, map);
     if (ret < 0)
     {
         std::cerr << "Get failed: " << ::strerror(-ret) << std::endl;
@@ -234,12 +519,172 @@ inline void Ceph::getValues(const lunchbox::Strings& keys,
     _getValues(keys, func, false);
 }
 
+inline void Ceph::getBatch(const lunchbox::Strings& keys,
+                          const ConstBatchFunc func) const
+{
+    IOMap map;
+    int ret = _read(std::set<std::string>(keys.begin(), keys.end()), map);
+    if (ret < 0)
+    {
+        std::cerr << "Get failed: " << ::strerror(-ret) << std::endl;
+        return;
+    }
+
+    // all values stay valid in map, deliver them as one batch
+    std::vector<ConstValue> values;
+    values.reserve(map.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        auto pos = map.find(keys[i]);
+        if (pos == map.end() || pos->second.length() == 0)
+            continue;
+        values.push_back({i, pos->second.c_str(), pos->second.length()});
+    }
+    if (!values.empty())
+        func(values.data(), values.size());
+}
+
+// omap has no size query, the values are read but not made contiguous
+inline void Ceph::getSizes(const lunchbox::Strings& keys,
+                           const SizeFunc& func) const
+{
+    IOMap map;
+    int ret = _read(std::set<std::string>(keys.begin(), keys.end()), map);
+    if (ret < 0)
+    {
+        std::cerr << "Get sizes failed: " << ::strerror(-ret) << std::endl;
+        return;
+    }
+
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        const auto pos = map.find(keys[i]);
+        if (pos != map.end() && pos->second.length() > 0)
+            func(i, pos->second.length());
+    }
+}
+
+inline bool Ceph::compareAndSwap(const std::string& key,
+                                 const void* expected,
+                                 const size_t expectedSize, const void* data,
+                                 const size_t size)
+{
+    librados::bufferlist expectedBl;
+    expectedBl.append((const char*)expected, expectedSize);
+    librados::bufferlist bl;
+    bl.append((const char*)data, size);
+
+    const int ret = _swap(key, std::move(expectedBl), std::move(bl));
+    if (ret < 0 && ret != -ECANCELED)
+        std::cerr << "Compare and swap failed: " << ::strerror(-ret)
+                  << std::endl;
+    return ret >= 0;
+}
+
+inline uint64_t Ceph::increment(const std::string& key, const uint64_t delta)
+{
+    uint64_t result = 0;
+    const int ret = _update(key, [&](librados::bufferlist& current) {
+        result = counter::parse(key, current.c_str(), current.length()) + delta;
+        librados::bufferlist bl;
+        bl.append(std::to_string(result));
+        return bl;
+    });
+    if (ret < 0)
+        _throw("Increment of " + key + " failed", ret);
+    return result;
+}
+
+inline bool Ceph::append(const std::string& key, const void* data,
+                         const size_t size)
+{
+    const int ret = _update(key, [&](const librados::bufferlist& current) {
+        librados::bufferlist bl = current;
+        bl.append((const char*)data, size);
+        return bl;
+    });
+    if (ret < 0)
+    {
+        std::cerr << "Append failed: " << ::strerror(-ret) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+inline Strings Ceph::getKeys(const std::string& after,
+                             const size_t maxKeys) const
+{
+    std::set<std::string> keys;
+    bool more = false;
+    int ret = 0;
+    librados::ObjectReadOperation op;
+    op.omap_get_keys2(after, maxKeys, &keys, &more, &ret);
+
+    ret = _read(op, ret);
+    if (ret < 0)
+        _throw("Get keys failed", ret);
+    return Strings(keys.begin(), keys.end());
+}
+
 inline void Ceph::erase(const std::string& key)
 {
-    const int ret = _context.omap_rm_keys(_storeName, {key});
+    librados::ObjectWriteOperation op;
+    op.omap_rm_keys({key});
+    const int ret = _write(op);
     if (ret < 0)
     {
         std::cerr << "Erase failed: " << ::strerror(-ret) << std::endl;
     }
 }
+
+inline void Ceph::clear()
+{
+    librados::ObjectWriteOperation op;
+    op.omap_clear();
+    const int ret = _write(op);
+    if (ret < 0)
+        _throw("Clear failed", ret);
+}
+
+// The keys of the object map are sorted, the ones with the prefix follow it
+inline void Ceph::erasePrefix(const std::string& prefix)
+{
+    const auto hasPrefix = [&prefix](const std::string& key) {
+        return key.compare(0, prefix.size(), prefix) == 0;
+    };
+
+    std::set<std::string> erased{prefix}; // start_after excludes the prefix
+    std::string after = prefix;
+    for (bool more = true; more;)
+    {
+        std::set<std::string> keys;
+        int ret = 0;
+        librados::ObjectReadOperation read;
+        read.omap_get_keys2(after, erasesPerOp, &keys, &more, &ret);
+        ret = _read(read, ret);
+        if (ret < 0)
+            _throw("Erase of prefix " + prefix + " failed", ret);
+
+        for (const auto& key : keys)
+        {
+            if (!hasPrefix(key))
+            {
+                more = false;
+                break;
+            }
+            erased.insert(key);
+        }
+        if (!keys.empty())
+            after = *keys.rbegin();
+        if (erased.empty())
+            continue;
+
+        librados::ObjectWriteOperation op;
+        op.omap_rm_keys(erased);
+        ret = _write(op);
+        if (ret < 0)
+            _throw("Erase of prefix " + prefix + " failed", ret);
+        erased.clear();
+    }
+}
 }
@@ -0,0 +1,74 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "ChildList.h"
+
+#include <lunchbox/log.h>
+
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+namespace keyv
+{
+namespace childList
+{
+std::vector<Child> read(const std::string& filename)
+{
+    std::ifstream file(filename);
+    if (!file)
+        LBTHROW(std::runtime_error("Can't open child list " + filename));
+
+    std::vector<Child> children;
+    std::set<std::string> uris;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream stream(line);
+        Child child{std::string(), 1.};
+        if (!(stream >> child.uri) || child.uri[0] == '#')
+            continue;
+
+        std::string weight;
+        if (stream >> weight)
+        {
+            try
+            {
+                child.weight = std::stod(weight);
+            }
+            catch (const std::logic_error&)
+            {
+                child.weight = 0.;
+            }
+            if (!(child.weight > 0.))
+                LBTHROW(std::runtime_error("Invalid weight '" + weight +
+                                           "' in " + filename));
+        }
+        if (!uris.insert(child.uri).second)
+            LBTHROW(std::runtime_error("Duplicate child " + child.uri +
+                                       " in " + filename));
+        children.push_back(child);
+    }
+    if (children.empty())
+        LBTHROW(std::runtime_error("No children in " + filename));
+    return children;
+}
+}
+}
@@ -0,0 +1,48 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace keyv
+{
+/**
+ * @internal Child store lists of the composite shard:// and mirror:// plugins.
+ *
+ * A list file names one child URI and an optional positive weight per line.
+ * Empty lines and lines starting with '#' are ignored.
+ */
+namespace childList
+{
+struct Child
+{
+    std::string uri;
+    double weight;
+};
+
+/**
+ * @return the children listed in the given file, in file order.
+ * @throw std::runtime_error if the file can't be read, is empty, or contains
+ *        invalid weights or duplicate URIs.
+ */
+std::vector<Child> read(const std::string& filename);
+}
+}
@@ -0,0 +1,230 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "CompletionQueue.h"
+
+#include <lunchbox/log.h>
+#include <lunchbox/threadPool.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#elif !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace keyv
+{
+namespace
+{
+#ifdef __linux__
+using Event = uint64_t; // eventfd counter
+#else
+using Event = char; // pipe byte
+#endif
+}
+
+/**
+ * The file descriptor is an eventfd on Linux, and the read end of a pipe on
+ * other POSIX systems. It is signalled when the first completion is queued,
+ * and cleared when the last one is delivered, so that at most one event is
+ * pending.
+ */
+class CompletionQueue::Impl
+{
+public:
+    explicit Impl(const size_t numThreads)
+        : outstanding(0)
+        , _pool(new lunchbox::ThreadPool(numThreads > 0 ? numThreads : 1))
+    {
+#ifdef __linux__
+        _fds[0] = _fds[1] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (_fds[0] < 0)
+            _throw("eventfd");
+#elif !defined(_WIN32)
+        if (::pipe(_fds) != 0)
+            _throw("pipe");
+        for (const int fd : _fds)
+        {
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+#else
+        _fds[0] = _fds[1] = -1;
+#endif
+    }
+
+    ~Impl()
+    {
+        // pool threads use the queue, join them before closing the fd
+        _pool.reset();
+#ifndef _WIN32
+        ::close(_fds[0]);
+        if (_fds[1] != _fds[0])
+            ::close(_fds[1]);
+#endif
+    }
+
+    int getFD() const { return _fds[0]; }
+
+    void submit(const Operation& operation)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++outstanding;
+        }
+        _pool->postDetached([this, operation] {
+            Completion completion;
+            try
+            {
+                completion = operation();
+            }
+            catch (...)
+            {
+                const std::exception_ptr error = std::current_exception();
+                completion = [error] { std::rethrow_exception(error); };
+            }
+            _post(std::move(completion));
+        });
+    }
+
+    // @return false if no completion is pending
+    bool pop(Completion& completion)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (completed.empty())
+            return false;
+
+        completion = std::move(completed.front());
+        completed.pop_front();
+        --outstanding;
+        if (completed.empty())
+            _clear();
+        return true;
+    }
+
+    mutable std::mutex mutex; // protects the following
+    std::condition_variable condition;
+    std::deque<Completion> completed;
+    size_t outstanding; // submitted and not delivered
+
+private:
+    int _fds[2]; // read, write end
+    std::unique_ptr<lunchbox::ThreadPool> _pool;
+
+    void _post(Completion&& completion)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (completed.empty())
+            _signal();
+        completed.push_back(std::move(completion));
+        condition.notify_all();
+    }
+
+    void _signal()
+    {
+#ifndef _WIN32
+        const Event event = 1;
+        if (::write(_fds[1], &event, sizeof(event)) != sizeof(event))
+            LBWARN << "Signalling completion failed: " << ::strerror(errno)
+                   << std::endl;
+#endif
+    }
+
+    void _clear()
+    {
+#ifndef _WIN32
+        Event event;
+        if (::read(_fds[0], &event, sizeof(event)) != sizeof(event))
+            LBWARN << "Clearing completion failed: " << ::strerror(errno)
+                   << std::endl;
+#endif
+    }
+
+    static void _throw(const char* function)
+    {
+        LBTHROW(std::runtime_error(std::string("Can't create completion ") +
+                                   "queue, " + function + " failed: " +
+                                   ::strerror(errno)));
+    }
+};
+
+CompletionQueue::CompletionQueue(const size_t numThreads)
+    : _impl(new Impl(numThreads))
+{
+}
+
+CompletionQueue::~CompletionQueue()
+{
+}
+
+int CompletionQueue::getFD() const
+{
+    return _impl->getFD();
+}
+
+size_t CompletionQueue::poll(const size_t maxCompletions)
+{
+    size_t delivered = 0;
+    Completion completion;
+    while (delivered < maxCompletions && _impl->pop(completion))
+    {
+        ++delivered;
+        completion();
+    }
+    return delivered;
+}
+
+size_t CompletionQueue::drain()
+{
+    size_t delivered = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(_impl->mutex);
+            _impl->condition.wait(lock, [this] {
+                return !_impl->completed.empty() || _impl->outstanding == 0;
+            });
+            if (_impl->completed.empty())
+                return delivered;
+        }
+        delivered += poll();
+    }
+}
+
+size_t CompletionQueue::getPending() const
+{
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    return _impl->outstanding;
+}
+
+void CompletionQueue::_submit(const Operation& operation)
+{
+    _impl->submit(operation);
+}
+}
@@ -0,0 +1,128 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KEYV_COMPLETIONQUEUE_H
+#define KEYV_COMPLETIONQUEUE_H
+
+#include <keyv/api.h>
+#include <keyv/types.h>
+
+#include <functional>
+#include <limits>
+#include <memory>
+
+namespace keyv
+{
+/**
+ * Delivers the results of asynchronous Map operations on the caller's thread.
+ *
+ * The asynchronous operations of Map run in the thread pool of the queue.
+ * Their completion handlers are called by poll() or drain() in the thread
+ * calling them, which integrates Keyv into a single-threaded event loop: the
+ * file descriptor of the queue becomes readable when completions are
+ * pending, and can be registered with epoll, select or any reactor.
+ *
+ * Example:
+ * @code
+ * keyv::CompletionQueue queue;
+ * map.get(queue, "key", [](std::string value) { render(value); });
+ * // in the event loop, when queue.getFD() is readable:
+ * queue.poll();
+ * @endcode
+ *
+ * The Map and the queue must outlive the operations submitted to it, and
+ * poll() and drain() must not be called concurrently.
+ */
+class CompletionQueue
+{
+public:
+    /**
+     * Create a new completion queue.
+     *
+     * @param numThreads the number of operations running concurrently.
+     * @throw std::runtime_error if the file descriptor can't be created.
+     * @version 1.2
+     */
+    KEYV_API explicit CompletionQueue(size_t numThreads = 4);
+
+    /**
+     * Wait for the running operations, and discard all undelivered results.
+     *
+     * The handlers of operations not delivered by poll() or drain() are never
+     * called, and the resources they own are released without notice. Call
+     * drain() first to deliver all of them.
+     * @version 1.2
+     */
+    KEYV_API ~CompletionQueue();
+
+    /**
+     * @return a file descriptor which is readable while completed operations
+     *         are pending, or -1 on Windows. Do not read from it.
+     * @version 1.2
+     */
+    KEYV_API int getFD() const;
+
+    /**
+     * Call the handlers of completed operations without blocking.
+     *
+     * An exception thrown by an operation or a handler is rethrown by the call
+     * delivering its completion. The completions after it stay queued, and
+     * the file descriptor readable, so that poll() or drain() can be called
+     * again to continue with them.
+     *
+     * @param maxCompletions the maximum number of handlers to call.
+     * @return the number of called handlers.
+     * @version 1.2
+     */
+    KEYV_API size_t poll(
+        size_t maxCompletions = std::numeric_limits<size_t>::max());
+
+    /**
+     * Wait for all operations, including the ones submitted by handlers, and
+     * call their handlers.
+     *
+     * @return the number of called handlers.
+     * @version 1.2
+     */
+    KEYV_API size_t drain();
+
+    /**
+     * @return the number of submitted operations whose handlers have not
+     *         been called yet.
+     * @version 1.2
+     */
+    KEYV_API size_t getPending() const;
+
+private:
+    CompletionQueue(const CompletionQueue&) = delete;
+    CompletionQueue& operator=(const CompletionQueue&) = delete;
+
+    friend class Map;
+    using Completion = std::function<void()>;
+    using Operation = std::function<Completion()>;
+
+    /** Run operation in the pool, and queue the completion it returns. */
+    void _submit(const Operation& operation);
+
+    class Impl;
+    std::unique_ptr<Impl> _impl;
+};
+}
+
+#endif // KEYV_COMPLETIONQUEUE_H
@@ -0,0 +1,48 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Counter.h"
+
+#include <lunchbox/log.h>
+
+#include <limits>
+#include <stdexcept>
+
+namespace keyv
+{
+namespace counter
+{
+uint64_t parse(const std::string& key, const char* data, const size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        const uint64_t digit = uint64_t(data[i] - '0');
+        if (digit > 9 ||
+            value > (std::numeric_limits<uint64_t>::max() - digit) / 10)
+        {
+            LBTHROW(std::runtime_error("Value of " + key +
+                                       " is not a counter"));
+        }
+        value = value * 10 + digit;
+    }
+    return value;
+}
+}
+}
@@ -0,0 +1,42 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace keyv
+{
+/**
+ * @internal Counters of Map::increment(), stored as decimal strings.
+ *
+ * Memcached increments such values on the server, all other backends read,
+ * parse and rewrite them.
+ */
+namespace counter
+{
+/**
+ * @return the counter value of the given key, 0 for an empty value.
+ * @throw std::runtime_error if the value is not a decimal counter.
+ */
+uint64_t parse(const std::string& key, const char* data, size_t size);
+}
+}
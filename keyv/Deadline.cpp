@@ -0,0 +1,72 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Deadline.h"
+
+#include <algorithm>
+
+namespace keyv
+{
+namespace
+{
+thread_local Deadline::Clock::time_point _deadline =
+    Deadline::Clock::time_point::max();
+}
+
+Deadline::Deadline(const std::chrono::milliseconds timeout)
+    : _previous(_deadline)
+{
+    if (timeout.count() > 0)
+        _deadline = std::min(_deadline, Clock::now() + timeout);
+}
+
+Deadline::Deadline(const Clock::time_point deadline)
+    : _previous(_deadline)
+{
+    _deadline = std::min(_deadline, deadline);
+}
+
+Deadline::~Deadline()
+{
+    _deadline = _previous;
+}
+
+Deadline::Clock::time_point Deadline::get()
+{
+    return _deadline;
+}
+
+bool Deadline::isSet()
+{
+    return _deadline != Clock::time_point::max();
+}
+
+bool Deadline::isExpired()
+{
+    return isSet() && Clock::now() >= _deadline;
+}
+
+std::chrono::milliseconds Deadline::getRemaining()
+{
+    if (isExpired())
+        return std::chrono::milliseconds(0);
+    return std::chrono::duration_cast<std::chrono::milliseconds>(_deadline -
+                                                                 Clock::now());
+}
+}
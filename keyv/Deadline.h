@@ -0,0 +1,69 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <chrono>
+
+namespace keyv
+{
+/**
+ * @internal The deadline of the operations of the calling thread.
+ *
+ * Map sets the deadline for the scope of an operation, and the backends
+ * check it while waiting for the store or between keys. Tasks running
+ * on behalf of an operation in other threads continue its deadline.
+ */
+class Deadline
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * Limit the operations of this thread in this scope to the timeout. A
+     * zero timeout does not limit them. Nested scopes can only shorten the
+     * deadline.
+     */
+    explicit Deadline(std::chrono::milliseconds timeout);
+
+    /** Continue a deadline from get(), e.g., of another thread. */
+    explicit Deadline(Clock::time_point deadline);
+
+    /** Restore the deadline of the enclosing scope. */
+    ~Deadline();
+
+    /** @return the deadline of this thread, Clock::time_point::max() if none */
+    static Clock::time_point get();
+
+    /** @return true if this thread has a deadline. */
+    static bool isSet();
+
+    /** @return true if the deadline of this thread has passed. */
+    static bool isExpired();
+
+    /** @return the time until the deadline, zero if it has passed. */
+    static std::chrono::milliseconds getRemaining();
+
+private:
+    const Clock::time_point _previous;
+
+    Deadline(const Deadline&) = delete;
+    Deadline& operator=(const Deadline&) = delete;
+};
+}
@@ -0,0 +1,383 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Dedup.h"
+#include "Counter.h"
+#include "Query.h"
+
+#include <servus/uint128_t.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace keyv
+{
+namespace
+{
+// A reference is the magic followed by the hex string of the content hash.
+// The leading zero byte never occurs in the printable values of our users.
+const char refMagic[8] = {'\0', 'K', 'E', 'Y', 'V', 'R', 'E', 'F'};
+const size_t hashSize = 32;
+const size_t refSize = sizeof(refMagic) + hashSize;
+
+const std::string reservedPrefix("\x01keyv.");
+const std::string blobPrefix(reservedPrefix + "blob.");  // + hash -> value
+const std::string countPrefix(reservedPrefix + "refs."); // + hash -> uint64
+
+// @return the hash of a reference value, or an empty string for values
+std::string _getHash(const char* data, const size_t size)
+{
+    if (size != refSize || ::memcmp(data, refMagic, sizeof(refMagic)) != 0)
+        return std::string();
+    return std::string(data + sizeof(refMagic), hashSize);
+}
+
+std::string _getHash(const std::string& value)
+{
+    return _getHash(value.data(), value.size());
+}
+
+std::string _hash(const void* data, const size_t size)
+{
+    const servus::uint128_t hash =
+        servus::make_uint128(static_cast<const char*>(data), size);
+    char string[hashSize + 1];
+    ::snprintf(string, sizeof(string), "%016llx%016llx",
+               (unsigned long long)hash.high(), (unsigned long long)hash.low());
+    return std::string(string, hashSize);
+}
+
+std::string _makeRef(const std::string& hash)
+{
+    return std::string(refMagic, sizeof(refMagic)) + hash;
+}
+
+// Collects the blobs referenced by a batch, and the indices referencing them
+class References
+{
+public:
+    bool add(const size_t index, const char* data, const size_t size)
+    {
+        const std::string& hash = _getHash(data, size);
+        if (hash.empty())
+            return false;
+
+        const auto i = _blobs.emplace(hash, keys.size());
+        if (i.second)
+        {
+            keys.push_back(blobPrefix + hash);
+            users.emplace_back();
+        }
+        users[i.first->second].push_back(index);
+        return true;
+    }
+
+    Strings keys;                           // of the referenced blobs
+    std::vector<std::vector<size_t>> users; // per blob, the indices
+private:
+    std::unordered_map<std::string, size_t> _blobs; // hash -> blob index
+};
+}
+
+bool Dedup::isEnabled(const servus::URI& uri)
+{
+    return query::getUInt(uri, "dedup", 0) != 0;
+}
+
+Dedup::Dedup(std::unique_ptr<Plugin> plugin, const servus::URI& uri)
+    : _plugin(std::move(plugin))
+    , _minSize(query::getUInt(uri, "dedup_min_size", 64))
+{
+}
+
+bool Dedup::insert(const std::string& key, const void* data, const size_t size)
+{
+    std::lock_guard<std::mutex> lock(_getLock());
+    return _insert(key, data, size);
+}
+
+void Dedup::erase(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(_getLock());
+    const std::string& previous = _getHash((*_plugin)[key]);
+    _plugin->erase(key);
+    if (!previous.empty())
+        _release(previous);
+}
+
+bool Dedup::compareAndSwap(const std::string& key, const void* expected,
+                           const size_t expectedSize, const void* data,
+                           const size_t size)
+{
+    std::lock_guard<std::mutex> lock(_getLock());
+    const std::string& value = (*this)[key];
+    if (value.size() != expectedSize ||
+        (expectedSize > 0 &&
+         ::memcmp(value.data(), expected, expectedSize) != 0))
+    {
+        return false;
+    }
+    return _insert(key, data, size);
+}
+
+uint64_t Dedup::increment(const std::string& key, const uint64_t delta)
+{
+    std::lock_guard<std::mutex> lock(_getLock());
+    const std::string& value = (*this)[key];
+    const uint64_t result =
+        counter::parse(key, value.data(), value.size()) + delta;
+    const std::string& string = std::to_string(result);
+    if (!_insert(key, string.data(), string.size()))
+        throw std::runtime_error("Increment of " + key + " failed");
+    return result;
+}
+
+bool Dedup::append(const std::string& key, const void* data,
+                   const size_t size)
+{
+    std::lock_guard<std::mutex> lock(_getLock());
+    std::string value = (*this)[key];
+    value.append(static_cast<const char*>(data), size);
+    return _insert(key, value.data(), value.size());
+}
+
+void Dedup::clear()
+{
+    std::lock_guard<std::mutex> lock(_getLock());
+    _plugin->clear();
+}
+
+std::string Dedup::operator[](const std::string& key) const
+{
+    const std::string& value = (*_plugin)[key];
+    const std::string& hash = _getHash(value);
+    return hash.empty() ? value : (*_plugin)[blobPrefix + hash];
+}
+
+// Only the ranges of a shared blob are read, inline values are small
+Strings Dedup::getRanges(const std::string& key, const Ranges& ranges) const
+{
+    const std::string& value = (*_plugin)[key];
+    const std::string& hash = _getHash(value);
+    if (!hash.empty())
+        return _plugin->getRanges(blobPrefix + hash, ranges);
+
+    Strings result;
+    result.reserve(ranges.size());
+    for (const auto& range : ranges)
+        result.push_back(slice(value.data(), value.size(), range));
+    return result;
+}
+
+void Dedup::getValues(const Strings& keys, const ConstValueFunc& func) const
+{
+    getBatch(keys, [&](const ConstValue* values, const size_t size) {
+        for (size_t i = 0; i < size; ++i)
+            func(keys[values[i].index], values[i].data, values[i].size);
+    });
+}
+
+void Dedup::takeValues(const Strings& keys, const ValueFunc& func) const
+{
+    takeBatch(keys, [&](const Value* values, const size_t size) {
+        for (size_t i = 0; i < size; ++i)
+            func(keys[values[i].index], values[i].data, values[i].size);
+    });
+}
+
+// Delivers plain values directly, and resolves all references with a second
+// batched read of the blobs.
+void Dedup::getBatch(const Strings& keys, const ConstBatchFunc func) const
+{
+    References refs;
+    std::vector<ConstValue> values;
+    _plugin->getBatch(keys, [&](const ConstValue* batch, const size_t size) {
+        values.clear();
+        for (size_t i = 0; i < size; ++i)
+            if (!refs.add(batch[i].index, batch[i].data, batch[i].size))
+                values.push_back(batch[i]);
+        if (!values.empty())
+            func(values.data(), values.size());
+    });
+    if (refs.keys.empty())
+        return;
+
+    _plugin->getBatch(refs.keys, [&](const ConstValue* batch,
+                                     const size_t size) {
+        values.clear();
+        for (size_t i = 0; i < size; ++i)
+            for (const size_t index : refs.users[batch[i].index])
+                values.push_back({index, batch[i].data, batch[i].size});
+        func(values.data(), values.size());
+    });
+}
+
+void Dedup::takeBatch(const Strings& keys, const BatchFunc func) const
+{
+    References refs;
+    std::vector<Value> values;
+    _plugin->takeBatch(keys, [&](const Value* batch, const size_t size) {
+        values.clear();
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (refs.add(batch[i].index, batch[i].data, batch[i].size))
+                ::free(batch[i].data);
+            else
+                values.push_back(batch[i]);
+        }
+        if (!values.empty())
+            func(values.data(), values.size());
+    });
+    if (refs.keys.empty())
+        return;
+
+    // The first user of a blob takes it, all others get a copy
+    _plugin->takeBatch(refs.keys, [&](const Value* batch, const size_t size) {
+        values.clear();
+        for (size_t i = 0; i < size; ++i)
+        {
+            const auto& users = refs.users[batch[i].index];
+            values.push_back({users.front(), batch[i].data, batch[i].size});
+            for (size_t j = 1; j < users.size(); ++j)
+            {
+                char* copy = (char*)::malloc(batch[i].size);
+                if (!copy)
+                    throw std::bad_alloc();
+                ::memcpy(copy, batch[i].data, batch[i].size);
+                values.push_back({users[j], copy, batch[i].size});
+            }
+        }
+        func(values.data(), values.size());
+    });
+}
+
+// Plain values are small and read, references are resolved to the sizes of
+// their shared blobs
+void Dedup::getSizes(const Strings& keys, const SizeFunc& func) const
+{
+    References refs;
+    _plugin->getBatch(keys, [&](const ConstValue* batch, const size_t size) {
+        for (size_t i = 0; i < size; ++i)
+            if (!refs.add(batch[i].index, batch[i].data, batch[i].size))
+                func(batch[i].index, batch[i].size);
+    });
+    if (refs.keys.empty())
+        return;
+
+    _plugin->getSizes(refs.keys, [&](const size_t index, const size_t size) {
+        for (const size_t user : refs.users[index])
+            func(user, size);
+    });
+}
+
+// Skips the reserved blob and count keys
+Strings Dedup::getKeys(const std::string& after, const size_t maxKeys) const
+{
+    std::string next = after;
+    for (;;)
+    {
+        Strings keys = _plugin->getKeys(next, maxKeys);
+        if (keys.empty())
+            return keys;
+
+        next = keys.back();
+        keys.erase(std::remove_if(keys.begin(), keys.end(),
+                                  [](const std::string& key) {
+                                      return key.compare(
+                                                 0, reservedPrefix.size(),
+                                                 reservedPrefix) == 0;
+                                  }),
+                   keys.end());
+        if (!keys.empty())
+            return keys;
+    }
+}
+
+// One lock for all counts, since an insert releases and references two blobs
+std::mutex& Dedup::_getLock()
+{
+    return _plugin->getLock(countPrefix);
+}
+
+bool Dedup::_insert(const std::string& key, const void* data,
+                    const size_t size)
+{
+    const bool dedup = size >= _minSize && size > refSize;
+    const std::string& hash = dedup ? _hash(data, size) : std::string();
+
+    // The previous reference of the key is needed to release its blob
+    const std::string& previous = _getHash((*_plugin)[key]);
+    if (dedup && hash == previous)
+        return true;
+
+    bool ok = true;
+    if (dedup)
+    {
+        _addRef(hash, data, size);
+        const std::string& ref = _makeRef(hash);
+        ok = _plugin->insert(key, ref.data(), ref.size());
+        if (!ok)
+            _release(hash);
+    }
+    else
+        ok = _plugin->insert(key, data, size);
+
+    if (ok && !previous.empty())
+        _release(previous);
+    return ok;
+}
+
+void Dedup::_addRef(const std::string& hash, const void* data,
+                    const size_t size)
+{
+    const std::string& countKey = countPrefix + hash;
+    const std::string& value = (*_plugin)[countKey];
+    uint64_t count = 0;
+    if (value.size() == sizeof(count))
+        ::memcpy(&count, value.data(), sizeof(count));
+
+    // blob before its count, a failure in between only leaks the blob
+    if (count == 0)
+        _plugin->insert(blobPrefix + hash, data, size);
+    ++count;
+    _plugin->insert(countKey, &count, sizeof(count));
+}
+
+void Dedup::_release(const std::string& hash)
+{
+    const std::string& countKey = countPrefix + hash;
+    const std::string& value = (*_plugin)[countKey];
+    uint64_t count = 0;
+    if (value.size() == sizeof(count))
+        ::memcpy(&count, value.data(), sizeof(count));
+
+    if (count > 1)
+    {
+        --count;
+        _plugin->insert(countKey, &count, sizeof(count));
+        return;
+    }
+    _plugin->erase(countKey);
+    _plugin->erase(blobPrefix + hash);
+}
+}
@@ -0,0 +1,85 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <keyv/Plugin.h>
+
+#include <memory>
+#include <mutex>
+
+namespace keyv
+{
+/**
+ * @internal Content-addressed deduplication on top of any plugin.
+ *
+ * Values of at least minSize bytes are stored once, under their content hash
+ * in a reserved key. The key itself only stores a reference: a magic marker
+ * followed by the hash. Each blob has a reference count, which is maintained
+ * under the lock of the reference counts from Plugin::getLock(), shared by
+ * all maps on a leveldb or lmdb store. Concurrent writers in other processes
+ * may leak or prematurely erase shared blobs. Smaller values, and values
+ * written without deduplication, are stored and read unchanged.
+ */
+class Dedup : public Plugin
+{
+public:
+    /** @return true if the URI enables deduplication (dedup=1). */
+    static bool isEnabled(const servus::URI& uri);
+
+    Dedup(std::unique_ptr<Plugin> plugin, const servus::URI& uri);
+
+    /** Writes are synchronous, since references are temporary values. */
+    size_t setQueueDepth(size_t) final { return 0; }
+    bool insert(const std::string& key, const void* data, size_t size) final;
+    void erase(const std::string& key) final;
+    /** Read-modify-writes also hold the lock of the reference counts. */
+    bool compareAndSwap(const std::string& key, const void* expected,
+                        size_t expectedSize, const void* data,
+                        size_t size) final;
+    uint64_t increment(const std::string& key, uint64_t delta) final;
+    bool append(const std::string& key, const void* data, size_t size) final;
+    /** Clears the values and the shared blobs of the plugin. */
+    void clear() final;
+    bool flush() final { return _plugin->flush(); }
+    void compact() final { _plugin->compact(); }
+    std::string getProperty(const std::string& name) const final
+    {
+        return _plugin->getProperty(name);
+    }
+    std::string operator[](const std::string& key) const final;
+    void getValues(const Strings& keys, const ConstValueFunc& func) const final;
+    void takeValues(const Strings& keys, const ValueFunc& func) const final;
+    void getBatch(const Strings& keys, ConstBatchFunc func) const final;
+    void takeBatch(const Strings& keys, BatchFunc func) const final;
+    Strings getKeys(const std::string& after, size_t maxKeys) const final;
+    void getSizes(const Strings& keys, const SizeFunc& func) const final;
+    Strings getRanges(const std::string& key,
+                      const Ranges& ranges) const final;
+
+private:
+    std::unique_ptr<Plugin> _plugin;
+    const size_t _minSize;
+
+    std::mutex& _getLock(); // serializes the reference count updates
+    bool _insert(const std::string& key, const void* data, size_t size);
+    void _addRef(const std::string& hash, const void* data, size_t size);
+    void _release(const std::string& hash);
+};
+}
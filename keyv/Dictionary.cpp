@@ -0,0 +1,276 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Dictionary.h"
+
+#include <lunchbox/log.h>
+
+#include <zdict.h>
+
+#include <cstring>
+#include <new>
+
+namespace keyv
+{
+namespace
+{
+// Larger values compress well on their own, and would dominate the samples
+const size_t maxSampleSize = 16384;
+
+void _setVersion(lunchbox::Bufferb& encoded, const Dictionary::Version version)
+{
+    ::memcpy(encoded.getData(), &version, sizeof(version));
+}
+}
+
+struct Dictionary::Entry
+{
+    Entry(const std::string& dictionary, const int level)
+        : version(getVersion(dictionary))
+        , compressor(ZSTD_createCDict(dictionary.data(), dictionary.size(),
+                                      level))
+        , decompressor(ZSTD_createDDict(dictionary.data(), dictionary.size()))
+    {
+    }
+
+    ~Entry()
+    {
+        ZSTD_freeCDict(compressor);
+        ZSTD_freeDDict(decompressor);
+    }
+
+    const Version version;
+    ZSTD_CDict* const compressor;
+    ZSTD_DDict* const decompressor;
+};
+
+Dictionary::Context::Context()
+    : compressor(ZSTD_createCCtx())
+    , decompressor(ZSTD_createDCtx())
+{
+}
+
+Dictionary::Context::~Context()
+{
+    ZSTD_freeCCtx(compressor);
+    ZSTD_freeDCtx(decompressor);
+}
+
+Dictionary::Dictionary(const size_t numSamples, const size_t maxSize,
+                       const int level)
+    : _numSamples(numSamples)
+    , _maxSize(maxSize)
+    , _level(level)
+    , _retry(false)
+{
+}
+
+Dictionary::~Dictionary()
+{
+}
+
+bool Dictionary::sample(const void* data, const size_t size)
+{
+    if (size == 0 || size > maxSampleSize)
+        return false;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_current)
+        return false;
+    if (_sampleSizes.size() >= _numSamples)
+    {
+        // retrain the restored samples of a dictionary failed to publish
+        const bool retry = _retry;
+        _retry = false;
+        return retry;
+    }
+
+    _samples.append(static_cast<const char*>(data), size);
+    _sampleSizes.push_back(size);
+    return _sampleSizes.size() == _numSamples;
+}
+
+std::string Dictionary::train()
+{
+    // values inserted during the training are sampled for the next attempt
+    std::string samples;
+    std::vector<size_t> sizes;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        samples.swap(_samples);
+        sizes.swap(_sampleSizes);
+    }
+
+    std::string dictionary(_maxSize, '\0');
+    const size_t size =
+        ZDICT_trainFromBuffer(&dictionary[0], dictionary.size(),
+                              samples.data(), sizes.data(),
+                              unsigned(sizes.size()));
+    if (ZDICT_isError(size))
+    {
+        LBWARN << "Training of compression dictionary failed: "
+               << ZDICT_getErrorName(size) << std::endl;
+        return std::string();
+    }
+    dictionary.resize(size);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _trained.swap(samples);
+    _trainedSizes.swap(sizes);
+    return dictionary;
+}
+
+void Dictionary::restore()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_current || _trainedSizes.empty())
+        return;
+
+    // the trained samples are complete, values sampled since are dropped
+    _samples.swap(_trained);
+    _sampleSizes.swap(_trainedSizes);
+    _trained.clear();
+    _trainedSizes.clear();
+    _retry = true;
+}
+
+void Dictionary::add(const std::string& dictionary, const bool current)
+{
+    const EntryPtr entry = std::make_shared<const Entry>(dictionary, _level);
+    if (!entry->compressor || !entry->decompressor)
+        throw std::bad_alloc();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _entries[entry->version] = entry;
+    if (!current)
+        return;
+
+    _current = entry;
+    _samples.clear();
+    _samples.shrink_to_fit();
+    _sampleSizes.clear();
+    _sampleSizes.shrink_to_fit();
+    _trained.clear();
+    _trained.shrink_to_fit();
+    _trainedSizes.clear();
+    _trainedSizes.shrink_to_fit();
+}
+
+bool Dictionary::has(const Version version) const
+{
+    return version == 0 || _get(version);
+}
+
+Dictionary::Version Dictionary::getCurrent() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _current ? _current->version : 0;
+}
+
+Dictionary::Version Dictionary::getVersion(const std::string& dictionary)
+{
+    return ZDICT_getDictID(dictionary.data(), dictionary.size());
+}
+
+Dictionary::Version Dictionary::getVersion(const void* data, const size_t size)
+{
+    Version version = 0;
+    if (size >= headerSize)
+        ::memcpy(&version, data, sizeof(version));
+    return version;
+}
+
+size_t Dictionary::getSize(const void* data, const size_t size)
+{
+    if (size < headerSize)
+        return 0;
+    if (getVersion(data, size) == 0)
+        return size - headerSize;
+
+    const unsigned long long decodedSize =
+        ZSTD_getFrameContentSize(static_cast<const char*>(data) + headerSize,
+                                 size - headerSize);
+    if (decodedSize == ZSTD_CONTENTSIZE_UNKNOWN ||
+        decodedSize == ZSTD_CONTENTSIZE_ERROR)
+    {
+        return 0;
+    }
+    return size_t(decodedSize);
+}
+
+void Dictionary::compress(Context& context, const void* data,
+                          const size_t size, lunchbox::Bufferb& encoded) const
+{
+    EntryPtr entry;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        entry = _current;
+    }
+
+    if (entry)
+    {
+        encoded.resize(headerSize + ZSTD_compressBound(size));
+        const size_t compressed =
+            ZSTD_compress_usingCDict(context.compressor,
+                                     encoded.getData() + headerSize,
+                                     encoded.getSize() - headerSize, data,
+                                     size, entry->compressor);
+        // incompressible values are stored as they are
+        if (!ZSTD_isError(compressed) && compressed < size)
+        {
+            encoded.resize(headerSize + compressed);
+            _setVersion(encoded, entry->version);
+            return;
+        }
+    }
+
+    encoded.resize(headerSize + size);
+    ::memcpy(encoded.getData() + headerSize, data, size);
+    _setVersion(encoded, 0);
+}
+
+bool Dictionary::decompress(Context& context, const void* data,
+                            const size_t size, void* decoded) const
+{
+    const size_t decodedSize = getSize(data, size);
+    const Version version = getVersion(data, size);
+    const char* payload = static_cast<const char*>(data) + headerSize;
+    if (version == 0)
+    {
+        ::memcpy(decoded, payload, decodedSize);
+        return true;
+    }
+
+    const EntryPtr entry = _get(version);
+    if (!entry)
+        return false;
+    const size_t result =
+        ZSTD_decompress_usingDDict(context.decompressor, decoded, decodedSize,
+                                   payload, size - headerSize,
+                                   entry->decompressor);
+    return !ZSTD_isError(result) && result == decodedSize;
+}
+
+Dictionary::EntryPtr Dictionary::_get(const Version version) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto i = _entries.find(version);
+    return i == _entries.end() ? EntryPtr() : i->second;
+}
+}
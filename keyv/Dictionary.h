@@ -0,0 +1,136 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <lunchbox/buffer.h>
+
+#include <zstd.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace keyv
+{
+/**
+ * @internal ZSTD compression of small values with trained dictionaries.
+ *
+ * Small values compress poorly on their own, but well with a dictionary
+ * trained from similar values. Values are sampled until enough are
+ * collected, and the backend stores the dictionary trained from them. Each
+ * compressed value starts with a header naming the version of its
+ * dictionary, the ZSTD dictionary ID, so that values of older dictionaries
+ * stay readable. Version 0 marks values stored uncompressed before a
+ * dictionary was available.
+ *
+ * Thread-safe, each thread uses its own Context.
+ */
+class Dictionary
+{
+public:
+    using Version = uint32_t;
+    static const size_t headerSize = sizeof(Version);
+
+    /** The compression state of one thread. */
+    struct Context
+    {
+        Context();
+        ~Context();
+        ZSTD_CCtx* const compressor;
+        ZSTD_DCtx* const decompressor;
+    };
+
+    /**
+     * @param numSamples the number of values to train a dictionary from.
+     * @param maxSize the maximum size of a dictionary in bytes.
+     * @param level the ZSTD compression level.
+     */
+    Dictionary(size_t numSamples, size_t maxSize, int level);
+    ~Dictionary();
+
+    /**
+     * Add a value to the training samples, unless a dictionary is in use.
+     *
+     * @return true for the one call completing the samples, which then has
+     *         to train() and publish the dictionary.
+     */
+    bool sample(const void* data, size_t size);
+
+    /** @return a dictionary trained from the samples, empty on failure. */
+    std::string train();
+
+    /**
+     * Restore the samples of the last train() if its dictionary could not be
+     * published. The next sample() call then returns true to retry.
+     */
+    void restore();
+
+    /** Add a dictionary, and compress with it if it is the current one. */
+    void add(const std::string& dictionary, bool current);
+
+    /** @return true if the dictionary of the given version was added. */
+    bool has(Version version) const;
+
+    /** @return the version used for compression, 0 if there is none. */
+    Version getCurrent() const;
+
+    /** @return the version of a dictionary returned by train(). */
+    static Version getVersion(const std::string& dictionary);
+
+    /** @return the version of an encoded value, 0 for invalid values. */
+    static Version getVersion(const void* data, size_t size);
+
+    /** @return the decoded size of an encoded value. */
+    static size_t getSize(const void* data, size_t size);
+
+    /** Encode a value with the current dictionary, including the header. */
+    void compress(Context& context, const void* data, size_t size,
+                  lunchbox::Bufferb& encoded) const;
+
+    /**
+     * Decode a value of a known version into decoded, which has getSize().
+     * @return false if the value is corrupt.
+     */
+    bool decompress(Context& context, const void* data, size_t size,
+                    void* decoded) const;
+
+private:
+    struct Entry;
+    using EntryPtr = std::shared_ptr<const Entry>;
+
+    const size_t _numSamples;
+    const size_t _maxSize;
+    const int _level;
+
+    mutable std::mutex _mutex; // protects the following
+    std::map<Version, EntryPtr> _entries;
+    EntryPtr _current;
+    std::string _samples; // concatenated values
+    std::vector<size_t> _sampleSizes;
+    std::string _trained; // samples of the last train(), see restore()
+    std::vector<size_t> _trainedSizes;
+    bool _retry;
+
+    EntryPtr _get(Version version) const;
+};
+}
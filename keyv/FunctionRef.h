@@ -0,0 +1,70 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KEYV_FUNCTIONREF_H
+#define KEYV_FUNCTIONREF_H
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace keyv
+{
+template <class F>
+class FunctionRef;
+
+/**
+ * Non-owning reference to a callable.
+ *
+ * Unlike std::function, a FunctionRef never allocates and is trivially
+ * copyable. It must not outlive the referenced callable, which makes it
+ * suitable only for callback parameters.
+ */
+template <class R, class... Args>
+class FunctionRef<R(Args...)>
+{
+public:
+    template <class F, class = typename std::enable_if<!std::is_same<
+                           typename std::decay<F>::type, FunctionRef>::value>::
+                           type>
+    FunctionRef(F&& func)
+        : _object(const_cast<void*>(
+              static_cast<const void*>(std::addressof(func))))
+        , _call(&_invoke<typename std::remove_reference<F>::type>)
+    {
+    }
+
+    R operator()(Args... args) const
+    {
+        return _call(_object, std::forward<Args>(args)...);
+    }
+
+private:
+    template <class F>
+    static R _invoke(void* object, Args... args)
+    {
+        return (*static_cast<F*>(object))(std::forward<Args>(args)...);
+    }
+
+    void* _object;
+    R (*_call)(void*, Args...);
+};
+}
+
+#endif // KEYV_FUNCTIONREF_H
@@ -0,0 +1,574 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Counter.h"
+#include "Query.h"
+
+#include <keyv/Plugin.h>
+
+#include <lunchbox/log.h>
+#include <lunchbox/pluginRegisterer.h>
+
+#include <lmdb.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace keyv
+{
+class LMDB;
+
+namespace
+{
+lunchbox::PluginRegisterer<LMDB> registerer;
+const size_t batchSize = 64; // values per getBatch() and takeBatch() callback
+const size_t deletesPerTxn = 4096; // bounds the dirty pages of bulk deletes
+const size_t numStripes = 64;       // locks for read-modify-writes of a store
+
+// sparse on 64 bit systems, only the used pages occupy memory and disk
+const uint64_t defaultMapSize = sizeof(size_t) == 8 ? 1ull << 40 : 1ull << 30;
+
+void _throw(const int ret, const std::string& what)
+{
+    LBTHROW(std::runtime_error(what + ": " + ::mdb_strerror(ret)));
+}
+
+MDB_val _val(const std::string& string)
+{
+    return MDB_val{string.size(), const_cast<char*>(string.data())};
+}
+
+/** Transaction which is aborted unless committed. */
+class Transaction
+{
+public:
+    Transaction(MDB_env* env, const unsigned flags)
+        : _txn(nullptr)
+    {
+        const int ret = ::mdb_txn_begin(env, nullptr, flags, &_txn);
+        if (ret != MDB_SUCCESS)
+            _throw(ret, "Can't begin lmdb transaction");
+    }
+
+    ~Transaction()
+    {
+        if (_txn)
+            ::mdb_txn_abort(_txn);
+    }
+
+    int commit()
+    {
+        const int ret = ::mdb_txn_commit(_txn);
+        _txn = nullptr;
+        return ret;
+    }
+
+    MDB_txn* get() const { return _txn; }
+private:
+    MDB_txn* _txn;
+};
+
+MDB_env* _open(const std::string& path, const uint64_t mapSize)
+{
+    MDB_env* env = nullptr;
+    int ret = ::mdb_env_create(&env);
+    if (ret != MDB_SUCCESS)
+        _throw(ret, "Can't create lmdb environment");
+
+    // NOSUBDIR: the store is a file, with a -lock file next to it.
+    // NOTLS: read transactions are not bound to threads, so that callbacks
+    // may issue nested reads. NOSYNC: flush() syncs to disk.
+    ret = ::mdb_env_set_mapsize(env, mapSize);
+    if (ret == MDB_SUCCESS)
+        ret = ::mdb_env_open(env, path.c_str(),
+                             MDB_NOSUBDIR | MDB_NOTLS | MDB_NOSYNC |
+                                 MDB_NORDAHEAD,
+                             0664);
+    if (ret != MDB_SUCCESS)
+    {
+        ::mdb_env_close(env);
+        _throw(ret, "Can't open " + path);
+    }
+    return env;
+}
+
+MDB_dbi _openDB(MDB_env* env)
+{
+    MDB_dbi dbi = 0;
+    Transaction txn(env, 0);
+    int ret = ::mdb_dbi_open(txn.get(), nullptr, 0, &dbi);
+    if (ret == MDB_SUCCESS)
+        ret = txn.commit();
+    if (ret != MDB_SUCCESS)
+        _throw(ret, "Can't open lmdb database");
+    return dbi;
+}
+
+std::string _canonical(const std::string& path)
+{
+#ifndef _WIN32
+    char* resolved = ::realpath(path.c_str(), nullptr);
+    if (resolved)
+    {
+        const std::string canonical(resolved);
+        ::free(resolved);
+        return canonical;
+    }
+#endif
+    return path;
+}
+
+/** Environment and database of an open store. */
+struct Store
+{
+    Store(const std::string& path, const uint64_t mapSize_)
+        : env(_open(path, mapSize_))
+        , mapSize(mapSize_)
+    {
+        try
+        {
+            dbi = _openDB(env);
+        }
+        catch (...)
+        {
+            ::mdb_env_close(env);
+            throw;
+        }
+    }
+
+    ~Store() { ::mdb_env_close(env); }
+    MDB_env* const env;
+    const uint64_t mapSize;
+    MDB_dbi dbi;
+    std::mutex locks[numStripes]; // see LMDB::getLock()
+};
+using StorePtr = std::shared_ptr<Store>;
+
+/**
+ * Opens each store once per process, since lmdb does not allow to open an
+ * environment twice in one process. All maps on a store share it, and each
+ * uses its own namespace. The store is closed with the last map. The map size
+ * of the first map opening the store applies to all maps.
+ */
+StorePtr _share(const servus::URI& uri)
+{
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<Store>> stores; // by path
+
+    const uint64_t mapSize = query::getSize(uri, "map_size", defaultMapSize);
+    const auto store = uri.findQuery("store");
+    const std::string& path =
+        store == uri.queryEnd() ? "keyvMap.lmdb" : store->second;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto i = stores.find(_canonical(path));
+    if (i != stores.end())
+    {
+        StorePtr shared = i->second.lock();
+        if (shared)
+        {
+            if (shared->mapSize != mapSize)
+                LBWARN << "lmdb " << path << " is already open with a "
+                       << shared->mapSize << " byte map size" << std::endl;
+            return shared;
+        }
+        stores.erase(i);
+    }
+
+    StorePtr shared = std::make_shared<Store>(path, mapSize);
+    stores[_canonical(path)] = shared;
+    return shared;
+}
+}
+
+/**
+ * Local store in a memory-mapped B+tree. Readers never block, and any number
+ * of processes may open the same store. Values are read straight from the
+ * memory map; getValues() and getBatch() deliver them without a copy from
+ * within one read transaction.
+ */
+class LMDB : public Plugin
+{
+public:
+    explicit LMDB(const servus::URI& uri)
+        : _store(_share(uri))
+        , _env(_store->env)
+        , _dbi(_store->dbi)
+        , _path(uri.getPath() + "/")
+    {
+    }
+
+    static bool handles(const servus::URI& uri)
+    {
+        return uri.getScheme() == "lmdb";
+    }
+
+    static std::string getDescription()
+    {
+        return "lmdb://[/namespace][?store=path_to_lmdb_file]"
+               "[&map_size=size[KB|MB|GB|TB]]";
+    }
+
+    bool insert(const std::string& key, const void* data,
+                const size_t size) final
+    {
+        Transaction txn(_env, 0);
+        return _put(txn, _path + key, data, size, "insert");
+    }
+
+    // Reserves the value in the map and copies the parts directly into it
+    bool insertParts(const std::string& key, const Spans& parts) final
+    {
+        size_t size = 0;
+        for (const auto& part : parts)
+            size += part.size;
+
+        const std::string& fullKey = _path + key;
+        MDB_val mdbKey = _val(fullKey);
+        MDB_val value{size, nullptr};
+        Transaction txn(_env, 0);
+        int ret = ::mdb_put(txn.get(), _dbi, &mdbKey, &value, MDB_RESERVE);
+        if (ret == MDB_SUCCESS)
+        {
+            char* ptr = static_cast<char*>(value.mv_data);
+            for (const auto& part : parts)
+            {
+                ::memcpy(ptr, part.data, part.size);
+                ptr += part.size;
+            }
+            ret = txn.commit();
+        }
+        if (ret == MDB_SUCCESS)
+            return true;
+
+        LBWARN << "lmdb insert failed: " << ::mdb_strerror(ret) << std::endl;
+        return false;
+    }
+
+    // The read-modify-writes run in one write transaction. lmdb serializes
+    // all write transactions, also across processes.
+    bool compareAndSwap(const std::string& key, const void* expected,
+                        const size_t expectedSize, const void* data,
+                        const size_t size) final
+    {
+        const std::string& fullKey = _path + key;
+        Transaction txn(_env, 0);
+        MDB_val value{0, nullptr};
+        _get(txn, fullKey, value);
+        if (value.mv_size != expectedSize ||
+            (expectedSize > 0 &&
+             ::memcmp(value.mv_data, expected, expectedSize) != 0))
+        {
+            return false;
+        }
+        return _put(txn, fullKey, data, size, "compareAndSwap");
+    }
+
+    uint64_t increment(const std::string& key, const uint64_t delta) final
+    {
+        const std::string& fullKey = _path + key;
+        Transaction txn(_env, 0);
+        MDB_val value{0, nullptr};
+        _get(txn, fullKey, value);
+        const uint64_t result =
+            counter::parse(key, static_cast<const char*>(value.mv_data),
+                           value.mv_size) +
+            delta;
+        const std::string& string = std::to_string(result);
+        if (!_put(txn, fullKey, string.data(), string.size(), "increment"))
+            LBTHROW(std::runtime_error("Increment of " + key + " failed"));
+        return result;
+    }
+
+    bool append(const std::string& key, const void* data,
+                const size_t size) final
+    {
+        const std::string& fullKey = _path + key;
+        Transaction txn(_env, 0);
+        MDB_val value{0, nullptr};
+        _get(txn, fullKey, value);
+
+        // copy, the old value may be moved by the write
+        std::string appended(static_cast<const char*>(value.mv_data),
+                             value.mv_size);
+        appended.append(static_cast<const char*>(data), size);
+        return _put(txn, fullKey, appended.data(), appended.size(), "append");
+    }
+
+    std::string operator[](const std::string& key) const final
+    {
+        Transaction txn(_env, MDB_RDONLY);
+        MDB_val value;
+        if (!_get(txn, _path + key, value))
+            return std::string();
+        const char* data = static_cast<const char*>(value.mv_data);
+        return std::string(data, data + value.mv_size);
+    }
+
+    Strings getRanges(const std::string& key, const Ranges& ranges) const final
+    {
+        Strings result(ranges.size());
+        Transaction txn(_env, MDB_RDONLY);
+        MDB_val value;
+        if (!_get(txn, _path + key, value))
+            return result;
+        for (size_t i = 0; i < ranges.size(); ++i)
+            result[i] = slice(static_cast<const char*>(value.mv_data),
+                              value.mv_size, ranges[i]);
+        return result;
+    }
+
+    void getValues(const Strings& keys, const ConstValueFunc& func) const final
+    {
+        Transaction txn(_env, MDB_RDONLY);
+        std::string key = _path;
+        MDB_val value;
+        for (const auto& k : keys)
+        {
+            key.resize(_path.size());
+            key.append(k);
+            if (_get(txn, key, value))
+                func(k, static_cast<const char*>(value.mv_data),
+                     value.mv_size);
+        }
+    }
+
+    void takeValues(const Strings& keys, const ValueFunc& func) const final
+    {
+        Transaction txn(_env, MDB_RDONLY);
+        std::string key = _path;
+        MDB_val value;
+        for (const auto& k : keys)
+        {
+            key.resize(_path.size());
+            key.append(k);
+            if (_get(txn, key, value))
+                func(k, _copy(value), value.mv_size);
+        }
+    }
+
+    void getBatch(const Strings& keys, const ConstBatchFunc func) const final
+    {
+        // values point into the map, valid until the transaction ends
+        Transaction txn(_env, MDB_RDONLY);
+        ConstValue values[batchSize];
+        size_t size = 0;
+        std::string key = _path;
+        MDB_val value;
+
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            key.resize(_path.size());
+            key.append(keys[i]);
+            if (!_get(txn, key, value))
+                continue;
+
+            values[size] = {i, static_cast<const char*>(value.mv_data),
+                            value.mv_size};
+            if (++size == batchSize)
+            {
+                func(values, size);
+                size = 0;
+            }
+        }
+        if (size > 0)
+            func(values, size);
+    }
+
+    void getSizes(const Strings& keys, const SizeFunc& func) const final
+    {
+        Transaction txn(_env, MDB_RDONLY);
+        std::string key = _path;
+        MDB_val value;
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            key.resize(_path.size());
+            key.append(keys[i]);
+            if (_get(txn, key, value))
+                func(i, value.mv_size);
+        }
+    }
+
+    // shared by all maps on the store, e.g., for Dedup reference counts
+    std::mutex& getLock(const std::string& key) final
+    {
+        const size_t hash = std::hash<std::string>()(_path + key);
+        return _store->locks[hash % numStripes];
+    }
+
+    void takeBatch(const Strings& keys, const BatchFunc func) const final
+    {
+        Transaction txn(_env, MDB_RDONLY);
+        Value values[batchSize];
+        size_t size = 0;
+        std::string key = _path;
+        MDB_val value;
+
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            key.resize(_path.size());
+            key.append(keys[i]);
+            if (!_get(txn, key, value))
+                continue;
+
+            values[size] = {i, _copy(value), value.mv_size};
+            if (++size == batchSize)
+            {
+                func(values, size);
+                size = 0;
+            }
+        }
+        if (size > 0)
+            func(values, size);
+    }
+
+    Strings getKeys(const std::string& after, const size_t maxKeys) const final
+    {
+        Transaction txn(_env, MDB_RDONLY);
+        MDB_cursor* cursor = nullptr;
+        int ret = ::mdb_cursor_open(txn.get(), _dbi, &cursor);
+        if (ret != MDB_SUCCESS)
+            _throw(ret, "Can't open lmdb cursor");
+
+        Strings keys;
+        const std::string start = _path + after;
+        MDB_val key = _val(start);
+        MDB_val value;
+        ret = ::mdb_cursor_get(cursor, &key, &value, MDB_SET_RANGE);
+        if (ret == MDB_SUCCESS && !after.empty() &&
+            key.mv_size == start.size() &&
+            ::memcmp(key.mv_data, start.data(), start.size()) == 0)
+        {
+            ret = ::mdb_cursor_get(cursor, &key, &value, MDB_NEXT);
+        }
+
+        for (; ret == MDB_SUCCESS && keys.size() < maxKeys;
+             ret = ::mdb_cursor_get(cursor, &key, &value, MDB_NEXT))
+        {
+            const char* data = static_cast<const char*>(key.mv_data);
+            if (key.mv_size < _path.size() ||
+                ::memcmp(data, _path.data(), _path.size()) != 0)
+            {
+                break;
+            }
+            keys.emplace_back(data + _path.size(), key.mv_size - _path.size());
+        }
+        ::mdb_cursor_close(cursor);
+        return keys;
+    }
+
+    bool flush() final { return ::mdb_env_sync(_env, 1) == MDB_SUCCESS; }
+    void erase(const std::string& key) final
+    {
+        const std::string& fullKey = _path + key;
+        MDB_val mdbKey = _val(fullKey);
+        Transaction txn(_env, 0);
+        const int ret = ::mdb_del(txn.get(), _dbi, &mdbKey, nullptr);
+        if (ret == MDB_SUCCESS)
+            txn.commit();
+    }
+
+    // All namespaces share one database, which can't be dropped. Deletes with
+    // a cursor, and commits regularly to not exhaust the transaction.
+    void erasePrefix(const std::string& prefix) final
+    {
+        const std::string start = _path + prefix;
+        for (;;)
+        {
+            Transaction txn(_env, 0);
+            MDB_cursor* cursor = nullptr;
+            int ret = ::mdb_cursor_open(txn.get(), _dbi, &cursor);
+            if (ret != MDB_SUCCESS)
+                _throw(ret, "Can't open lmdb cursor");
+
+            // seeks for each key, the first remaining one is the next to delete
+            MDB_val key = _val(start);
+            MDB_val value;
+            size_t deletes = 0;
+            for (ret = ::mdb_cursor_get(cursor, &key, &value, MDB_SET_RANGE);
+                 ret == MDB_SUCCESS && deletes < deletesPerTxn;
+                 key = _val(start),
+                ret = ::mdb_cursor_get(cursor, &key, &value, MDB_SET_RANGE))
+            {
+                if (key.mv_size < start.size() ||
+                    ::memcmp(key.mv_data, start.data(), start.size()) != 0)
+                {
+                    break;
+                }
+                ret = ::mdb_cursor_del(cursor, 0);
+                if (ret != MDB_SUCCESS)
+                    break;
+                ++deletes;
+            }
+            ::mdb_cursor_close(cursor);
+            if (ret != MDB_SUCCESS && ret != MDB_NOTFOUND)
+                _throw(ret, "Can't erase lmdb keys");
+
+            ret = txn.commit();
+            if (ret != MDB_SUCCESS)
+                _throw(ret, "Can't erase lmdb keys");
+            if (deletes < deletesPerTxn)
+                return;
+        }
+    }
+
+private:
+    // MDB_env is thread-safe, each operation uses its own transaction
+    const StorePtr _store;
+    MDB_env* const _env;
+    const MDB_dbi _dbi;
+    const std::string _path;
+
+    bool _get(const Transaction& txn, const std::string& fullKey,
+              MDB_val& value) const
+    {
+        MDB_val key = _val(fullKey);
+        return ::mdb_get(txn.get(), _dbi, &key, &value) == MDB_SUCCESS;
+    }
+
+    // Writes the value and commits the write transaction
+    bool _put(Transaction& txn, const std::string& fullKey, const void* data,
+              const size_t size, const char* operation)
+    {
+        MDB_val key = _val(fullKey);
+        MDB_val value{size, const_cast<void*>(data)};
+        int ret = ::mdb_put(txn.get(), _dbi, &key, &value, 0);
+        if (ret == MDB_SUCCESS)
+            ret = txn.commit();
+        if (ret == MDB_SUCCESS)
+            return true;
+
+        LBWARN << "lmdb " << operation << " failed: " << ::mdb_strerror(ret)
+               << std::endl;
+        return false;
+    }
+
+    static char* _copy(const MDB_val& value)
+    {
+        char* copy = (char*)malloc(value.mv_size);
+        if (!copy)
+            throw std::bad_alloc();
+        ::memcpy(copy, value.mv_data, value.mv_size);
+        return copy;
+    }
+};
+}
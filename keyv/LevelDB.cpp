@@ -17,6 +17,9 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include "Deadline.h"
+#include "Query.h"
+
 #include <keyv/Plugin.h>
 
 #include <lunchbox/compiler.h>
@@ -24,6 +27,19 @@
 #include <lunchbox/pluginRegisterer.h>
 
 #include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 namespace keyv
 {
@@ -33,19 +49,360 @@ class LevelDB;
 namespace
 {
 lunchbox::PluginRegisterer<LevelDB> registerer;
+const size_t batchSize = 64; // values per getBatch() and takeBatch() callback
+const size_t deletesPerWrite = 1024; // per write batch of bulk deletes
+const uint64_t bulkWriteBuffer = 256 * LB_1MB;
+const size_t numStripes = 64; // locks for read-modify-writes of a store
 
-db::DB* _open(const servus::URI& uri)
+bool _isBulk(const servus::URI& uri)
 {
-    db::DB* db = 0;
+    const auto profile = uri.findQuery("profile");
+    if (profile == uri.queryEnd() || profile->second == "default")
+        return false;
+    if (profile->second != "bulk")
+        LBTHROW(std::runtime_error("Unknown leveldb profile " +
+                                   profile->second));
+    return true;
+}
+
+// @return the absolute path of an existing store, to identify it
+std::string _canonical(const std::string& path)
+{
+#ifndef _WIN32
+    char* resolved = ::realpath(path.c_str(), nullptr);
+    if (resolved)
+    {
+        const std::string canonical(resolved);
+        ::free(resolved);
+        return canonical;
+    }
+#endif
+    return path;
+}
+
+// @return the first key after all keys starting with prefix
+std::string _limit(std::string prefix)
+{
+    while (!prefix.empty() && uint8_t(prefix.back()) == 0xff)
+        prefix.pop_back();
+    if (!prefix.empty())
+        prefix.back() = char(uint8_t(prefix.back()) + 1);
+    return prefix;
+}
+
+/**
+ * Bounds the size of a namespace by evicting old entries in the background.
+ *
+ * For each data key, a metadata entry under metaPrefix + key stores the last
+ * access (lru) or insertion (fifo) time and the value size. Reads only record
+ * the access in memory, which is written in one batch by the background
+ * thread. Once the approximate size of the namespace exceeds maxSize, the
+ * oldest entries are deleted until it is below lowWatermark * maxSize, and
+ * the namespace is compacted to free the disk space.
+ */
+class Eviction
+{
+public:
+    Eviction(db::DB& db, const std::string& path, const uint64_t maxSize,
+             const bool lru)
+        : _db(db)
+        , _dataPrefix(path)
+        , _metaPrefix(metaPrefix + path)
+        , _maxSize(maxSize)
+        , _lru(lru)
+        , _running(true)
+        , _thread([this] { _run(); })
+    {
+    }
+
+    ~Eviction()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _running = false;
+        }
+        _condition.notify_all();
+        _thread.join();
+        _flush();
+    }
+
+    /** Add the metadata of an inserted value to the batch. */
+    void inserted(db::WriteBatch& batch, const std::string& key,
+                  const size_t size)
+    {
+        const Entry entry{_now(), size};
+        batch.Put(metaPrefix + key,
+                  db::Slice((const char*)&entry, sizeof(entry)));
+    }
+
+    /** Add the removal of the metadata of an erased value to the batch. */
+    void erased(db::WriteBatch& batch, const std::string& key)
+    {
+        batch.Delete(metaPrefix + key);
+    }
+
+    /** Record a read of the given key. */
+    void accessed(const std::string& key, const size_t size)
+    {
+        if (!_lru)
+            return;
+        std::lock_guard<std::mutex> lock(_mutex);
+        _accessed[key] = size;
+    }
+
+    /** @return true if this eviction uses the given options. */
+    bool matches(const uint64_t maxSize, const bool lru) const
+    {
+        return maxSize == _maxSize && lru == _lru;
+    }
+
+    static const std::string metaPrefix;
+
+private:
+    struct Entry
+    {
+        uint64_t time; // seconds since epoch
+        uint64_t size;
+    };
+
+    static constexpr double lowWatermark = .9;
+
+    db::DB& _db;
+    const std::string _dataPrefix;
+    const std::string _metaPrefix;
+    const uint64_t _maxSize;
+    const bool _lru;
+
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::unordered_map<std::string, size_t> _accessed;
+    bool _running;
+    std::thread _thread; // last, started after all other members
+
+    static uint64_t _now()
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    void _run()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_running)
+        {
+            _condition.wait_for(lock, std::chrono::seconds(10));
+            if (!_running)
+                break;
+
+            lock.unlock();
+            _flush();
+            _evict();
+            lock.lock();
+        }
+    }
+
+    // write recorded accesses as metadata
+    void _flush()
+    {
+        std::unordered_map<std::string, size_t> accessed;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            accessed.swap(_accessed);
+        }
+        if (accessed.empty())
+            return;
+
+        db::WriteBatch batch;
+        for (const auto& access : accessed)
+            inserted(batch, access.first, access.second);
+        _db.Write(db::WriteOptions(), &batch);
+    }
+
+    uint64_t _getSize() const
+    {
+        const std::string dataLimit = _limit(_dataPrefix);
+        const std::string metaLimit = _limit(_metaPrefix);
+        const db::Range ranges[] = {db::Range(_dataPrefix, dataLimit),
+                                    db::Range(_metaPrefix, metaLimit)};
+        uint64_t sizes[2] = {0, 0};
+        _db.GetApproximateSizes(ranges, 2, sizes);
+        return sizes[0] + sizes[1];
+    }
+
+    template <class F>
+    void _forEachEntry(const F& func)
+    {
+        std::unique_ptr<db::Iterator> it(_db.NewIterator(db::ReadOptions()));
+        for (it->Seek(_metaPrefix);
+             it->Valid() && it->key().starts_with(_metaPrefix); it->Next())
+        {
+            if (it->value().size() != sizeof(Entry))
+                continue;
+            Entry entry;
+            ::memcpy(&entry, it->value().data(), sizeof(entry));
+            if (!func(it->key(), entry))
+                return;
+        }
+    }
+
+    void _evict()
+    {
+        const uint64_t size = _getSize();
+        if (size <= _maxSize)
+            return;
+
+        // Histogram of value bytes by time, to find the time before which all
+        // entries have to be evicted
+        std::map<uint64_t, uint64_t> histogram;
+        uint64_t total = 0;
+        _forEachEntry([&](const db::Slice&, const Entry& entry) {
+            histogram[entry.time] += entry.size;
+            total += entry.size;
+            return true;
+        });
+        if (total == 0)
+            return;
+
+        const double fraction = 1. - lowWatermark * _maxSize / double(size);
+        const uint64_t target = uint64_t(total * fraction);
+        uint64_t cutoff = 0;
+        uint64_t bytes = 0;
+        for (const auto& bucket : histogram)
+        {
+            cutoff = bucket.first;
+            bytes += bucket.second;
+            if (bytes >= target)
+                break;
+        }
+
+        db::WriteBatch batch;
+        size_t deletes = 0;
+        uint64_t freed = 0;
+        _forEachEntry([&](const db::Slice& metaKey, const Entry& entry) {
+            if (entry.time > cutoff)
+                return true;
+
+            db::Slice key = metaKey;
+            key.remove_prefix(metaPrefix.size());
+            batch.Delete(key);
+            batch.Delete(metaKey);
+            freed += entry.size;
+            if (++deletes % deletesPerWrite == 0)
+            {
+                _db.Write(db::WriteOptions(), &batch);
+                batch.Clear();
+            }
+            return freed < target;
+        });
+        _db.Write(db::WriteOptions(), &batch);
+
+        const std::string dataLimit = _limit(_dataPrefix);
+        const std::string metaLimit = _limit(_metaPrefix);
+        const db::Slice dataBegin(_dataPrefix), dataEnd(dataLimit);
+        const db::Slice metaBegin(_metaPrefix), metaEnd(metaLimit);
+        _db.CompactRange(&dataBegin, &dataEnd);
+        _db.CompactRange(&metaBegin, &metaEnd);
+
+        LBINFO << "Evicted " << deletes << " entries with " << freed
+               << " bytes from " << _dataPrefix << ", approximate size was "
+               << size << " bytes" << std::endl;
+    }
+};
+
+// Data keys always start with the '/' of the namespace path
+const std::string Eviction::metaPrefix("\x01keyv.cache");
+
+/** An open store, shared by all maps on it. */
+struct Store
+{
+    std::unique_ptr<db::DB> db;
+    size_t writeBuffer;
+    std::mutex locks[numStripes]; // see LevelDB::getLock()
+
+    std::mutex mutex; // protects evictions
+    std::map<std::string, std::weak_ptr<Eviction>> evictions; // by namespace
+};
+using StorePtr = std::shared_ptr<Store>;
+
+/**
+ * Opens each store once per process, since leveldb locks it. All maps on a
+ * store share its handle, block cache, write buffer and compaction thread,
+ * and each uses its own namespace. The store is closed with the last map.
+ * The options of the first map opening the store apply to all maps.
+ */
+StorePtr _open(const servus::URI& uri)
+{
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<Store>> stores; // by path
+
     db::Options options;
     options.create_if_missing = true;
+    options.write_buffer_size = query::getSize(
+        uri, "write_buffer",
+        _isBulk(uri) ? bulkWriteBuffer : options.write_buffer_size);
     const auto store = uri.findQuery("store");
     const std::string& path =
         store == uri.queryEnd() ? "keyvMap.leveldb" : store->second;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto i = stores.find(_canonical(path));
+    if (i != stores.end())
+    {
+        StorePtr shared = i->second.lock();
+        if (shared)
+        {
+            if (shared->writeBuffer != options.write_buffer_size)
+                LBWARN << "leveldb " << path << " is already open with a "
+                       << shared->writeBuffer << " byte write buffer"
+                       << std::endl;
+            return shared;
+        }
+        stores.erase(i);
+    }
+
+    db::DB* db = 0;
     const db::Status status = db::DB::Open(options, path, &db);
     if (!status.ok())
         LBTHROW(std::runtime_error(status.ToString() + " opening " + path));
-    return db;
+
+    StorePtr shared = std::make_shared<Store>();
+    shared->db.reset(db);
+    shared->writeBuffer = options.write_buffer_size;
+    stores[_canonical(path)] = shared;
+    return shared;
+}
+
+/**
+ * Shares the eviction of a namespace between all maps on it, so that one
+ * thread evicts its entries. The options of the first map apply to all maps.
+ */
+std::shared_ptr<Eviction> _share(Store& store, const std::string& path,
+                                 const servus::URI& uri)
+{
+    const uint64_t maxSize = query::getSize(uri, "max_size", 0);
+    if (maxSize == 0)
+        return std::shared_ptr<Eviction>();
+
+    const auto policy = uri.findQuery("policy");
+    const bool lru = policy == uri.queryEnd() || policy->second == "lru";
+    if (!lru && policy->second != "fifo")
+        LBTHROW(std::runtime_error("Unknown cache policy " + policy->second));
+
+    std::lock_guard<std::mutex> lock(store.mutex);
+    std::weak_ptr<Eviction>& eviction = store.evictions[path];
+    std::shared_ptr<Eviction> shared = eviction.lock();
+    if (shared)
+    {
+        if (!shared->matches(maxSize, lru))
+            LBWARN << "leveldb namespace " << path << " already evicts with "
+                   << "other options" << std::endl;
+        return shared;
+    }
+
+    shared = std::make_shared<Eviction>(*store.db, path, maxSize, lru);
+    eviction = shared;
+    return shared;
 }
 }
 
@@ -53,12 +410,23 @@ class LevelDB : public Plugin
 {
 public:
     explicit LevelDB(const servus::URI& uri)
-        : _db(_open(uri))
+        : _store(_open(uri))
+        , _db(_store->db.get())
         , _path(uri.getPath() + "/")
+        , _eviction(_share(*_store, _path, uri))
+        , _bulk(_isBulk(uri))
+        , _inserted(false)
     {
     }
 
-    virtual ~LevelDB() { delete _db; }
+    // The bulk profile compacts the loaded values once when closing, instead
+    // of on every flush() of a loading application.
+    ~LevelDB()
+    {
+        if (_inserted)
+            compact();
+    }
+
     static bool handles(const servus::URI& uri)
     {
         return uri.getScheme() == "leveldb" || uri.getScheme().empty();
@@ -66,20 +434,42 @@ public:
 
     static std::string getDescription()
     {
-        return "leveldb://[/namespace][?store=path_to_leveldb_dir]";
+        return "leveldb://[/namespace][?store=path_to_leveldb_dir]"
+               "[&max_size=size[KB|MB|GB|TB]&policy=lru|fifo]"
+               "[&profile=default|bulk][&write_buffer=size[KB|MB|GB|TB]]";
     }
 
     bool insert(const std::string& key, const void* data,
                 const size_t size) final
     {
         const db::Slice value((const char*)data, size);
-        return _db->Put(db::WriteOptions(), _path + key, value).ok();
+        if (_bulk)
+            _inserted = true;
+        if (!_eviction)
+            return _db->Put(db::WriteOptions(), _path + key, value).ok();
+
+        const std::string& fullKey = _path + key;
+        db::WriteBatch batch;
+        batch.Put(fullKey, value);
+        _eviction->inserted(batch, fullKey, size);
+        return _db->Write(db::WriteOptions(), &batch).ok();
+    }
+
+    // leveldb copies each value into its write batch. Gather the parts into a
+    // per-thread buffer which keeps its capacity, to not allocate per write.
+    bool insertParts(const std::string& key, const Spans& parts) final
+    {
+        static thread_local std::string buffer;
+        buffer.clear();
+        for (const auto& part : parts)
+            buffer.append(static_cast<const char*>(part.data), part.size);
+        return insert(key, buffer.data(), buffer.size());
     }
 
     std::string operator[](const std::string& key) const final
     {
         std::string value;
-        if (_db->Get(db::ReadOptions(), _path + key, &value).ok())
+        if (_get(_path + key, value))
             return value;
         return std::string();
     }
@@ -88,8 +478,10 @@ public:
     {
         for (const auto& key : keys)
         {
+            if (Deadline::isExpired())
+                return;
             std::string value;
-            if (!_db->Get(db::ReadOptions(), _path + key, &value).ok())
+            if (!_get(_path + key, value))
                 continue;
 
             char* copy = (char*)malloc(value.size());
@@ -102,23 +494,215 @@ public:
     {
         for (const auto& key : keys)
         {
+            if (Deadline::isExpired())
+                return;
             std::string value;
-            if (!_db->Get(db::ReadOptions(), _path + key, &value).ok())
+            if (!_get(_path + key, value))
                 continue;
 
             func(key, value.data(), value.size());
         }
     }
 
+    void getBatch(const Strings& keys, const ConstBatchFunc func) const final
+    {
+        // The value buffers of a batch stay valid until it is delivered, and
+        // their memory is reused by the following batches.
+        std::string buffers[batchSize];
+        ConstValue values[batchSize];
+        size_t size = 0;
+        std::string key = _path;
+
+        for (size_t i = 0; i < keys.size() && !Deadline::isExpired(); ++i)
+        {
+            key.resize(_path.size());
+            key.append(keys[i]);
+            std::string& value = buffers[size];
+            if (!_get(key, value))
+                continue;
+
+            values[size] = {i, value.data(), value.size()};
+            if (++size == batchSize)
+            {
+                func(values, size);
+                size = 0;
+            }
+        }
+        if (size > 0)
+            func(values, size);
+    }
+
+    void takeBatch(const Strings& keys, const BatchFunc func) const final
+    {
+        Value values[batchSize];
+        size_t size = 0;
+        std::string key = _path;
+        std::string value;
+
+        for (size_t i = 0; i < keys.size() && !Deadline::isExpired(); ++i)
+        {
+            key.resize(_path.size());
+            key.append(keys[i]);
+            if (!_get(key, value))
+                continue;
+
+            char* copy = (char*)malloc(value.size());
+            memcpy(copy, value.data(), value.size());
+            values[size] = {i, copy, value.size()};
+            if (++size == batchSize)
+            {
+                func(values, size);
+                size = 0;
+            }
+        }
+        if (size > 0)
+            func(values, size);
+    }
+
+    // Seeks an iterator to each key in key order, which reads the size of
+    // the value without copying it. Probes neither count as accesses in cache
+    // mode nor fill the block cache.
+    void getSizes(const Strings& keys, const SizeFunc& func) const final
+    {
+        std::vector<size_t> order(keys.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&keys](size_t a, size_t b) {
+            return keys[a] < keys[b];
+        });
+
+        db::ReadOptions options;
+        options.fill_cache = false;
+        std::unique_ptr<db::Iterator> it(_db->NewIterator(options));
+        std::string key = _path;
+        for (const size_t i : order)
+        {
+            if (Deadline::isExpired())
+                return;
+            key.resize(_path.size());
+            key.append(keys[i]);
+            it->Seek(key);
+            if (it->Valid() && it->key() == key)
+                func(i, it->value().size());
+        }
+    }
+
+    // The default read-modify-writes of all maps on the store exclude each
+    // other, as do their Dedup reference counts
+    std::mutex& getLock(const std::string& key) final
+    {
+        const size_t hash = std::hash<std::string>()(_path + key);
+        return _store->locks[hash % numStripes];
+    }
+
+    Strings getKeys(const std::string& after, const size_t maxKeys) const final
+    {
+        Strings keys;
+        const std::string start = _path + after;
+        std::unique_ptr<db::Iterator> it(_db->NewIterator(db::ReadOptions()));
+        it->Seek(start);
+        if (!after.empty() && it->Valid() && it->key() == start)
+            it->Next();
+
+        for (; it->Valid() && keys.size() < maxKeys; it->Next())
+        {
+            db::Slice key = it->key();
+            if (!key.starts_with(_path))
+                break;
+            key.remove_prefix(_path.size());
+            keys.push_back(key.ToString());
+        }
+        return keys;
+    }
+
     bool flush() final { /*NOP?*/ return true; }
 
+    void compact() final
+    {
+        _compact(_path);
+        if (_eviction)
+            _compact(Eviction::metaPrefix + _path);
+    }
+
+    std::string getProperty(const std::string& name) const final
+    {
+        std::string value;
+        if (!_db->GetProperty(name, &value))
+            return std::string();
+        return value;
+    }
+
     void erase(const std::string& key) final
     {
-        _db->Delete(db::WriteOptions(), _path + key);
+        if (!_eviction)
+        {
+            _db->Delete(db::WriteOptions(), _path + key);
+            return;
+        }
+
+        const std::string& fullKey = _path + key;
+        db::WriteBatch batch;
+        batch.Delete(fullKey);
+        _eviction->erased(batch, fullKey);
+        _db->Write(db::WriteOptions(), &batch);
+    }
+
+    // Also erases the cache metadata of the range, nested namespaces may be
+    // caches even if this one is not
+    void erasePrefix(const std::string& prefix) final
+    {
+        const std::string begin = _path + prefix;
+        _erase(begin);
+        _erase(Eviction::metaPrefix + begin);
     }
 
 private:
+    // db::DB is internally synchronized, all operations are lock-free here.
+    // The eviction is destroyed first, it uses the store.
+    const StorePtr _store; // shared by all maps on the store
     db::DB* const _db;
     const std::string _path;
+    const std::shared_ptr<Eviction> _eviction; // set in cache mode
+    const bool _bulk;                    // profile=bulk
+    std::atomic<bool> _inserted;         // since opening in bulk mode
+
+    // Deletes all keys starting with begin in batches, and compacts the range
+    // to free the disk space
+    void _erase(const std::string& begin)
+    {
+        db::WriteBatch batch;
+        size_t deletes = 0;
+        std::unique_ptr<db::Iterator> it(_db->NewIterator(db::ReadOptions()));
+        for (it->Seek(begin); it->Valid() && it->key().starts_with(begin);
+             it->Next())
+        {
+            batch.Delete(it->key());
+            if (++deletes % deletesPerWrite == 0)
+            {
+                _db->Write(db::WriteOptions(), &batch);
+                batch.Clear();
+            }
+        }
+        if (deletes == 0)
+            return;
+        _db->Write(db::WriteOptions(), &batch);
+        _compact(begin);
+    }
+
+    void _compact(const std::string& prefix)
+    {
+        const std::string& limit = _limit(prefix);
+        const db::Slice begin(prefix), end(limit);
+        _db->CompactRange(&begin, limit.empty() ? nullptr : &end);
+    }
+
+    bool _get(const std::string& fullKey, std::string& value) const
+    {
+        if (!_db->Get(db::ReadOptions(), fullKey, &value).ok())
+            return false;
+        if (_eviction)
+            _eviction->accessed(fullKey, value.size());
+        return true;
+    }
 };
 }
@@ -18,12 +18,23 @@
  */
 
 #include "Map.h"
+#include "CompletionQueue.h"
+#include "Deadline.h"
+#include "Dedup.h"
 #include "Plugin.h"
+#include "Tuner.h"
 
 #include <lunchbox/plugin.h>
 #include <lunchbox/pluginFactory.h>
 #include <servus/uri.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <mutex>
+#include <unordered_set>
+
 // #define HISTOGRAM
 
 namespace keyv
@@ -31,30 +42,180 @@ namespace keyv
 namespace
 {
 using PluginFactory = lunchbox::PluginFactory<Plugin>;
+using Clock = std::chrono::steady_clock;
+
+const size_t maxQueueDepth = 1024;
+const size_t initialQueueDepth = 8;
+const size_t initialBatchSize = 64;
+const size_t maxBatchSize = 65536;
+const size_t batchSizeStep = 32;
+
+double _elapsed(const Clock::time_point& start)
+{
+    return std::chrono::duration_cast<std::chrono::duration<double,
+                                                            std::milli>>(
+               Clock::now() - start)
+        .count();
+}
 }
 
+const size_t Map::AUTO = std::numeric_limits<size_t>::max();
+
 class Map::Impl
 {
 public:
-    Impl(const servus::URI& uri)
-        : plugin(PluginFactory::getInstance().create(uri))
+    Impl(const servus::URI& uri_, const bool lazy)
+        : uri(uri_)
         , swap(false)
+        , lowLatency(1.)
+        , highLatency(100.)
+        , timeout(0)
+        , _ready(nullptr)
     {
+        if (!lazy)
+            getPlugin();
     }
 
-    std::unique_ptr<Plugin> plugin;
-    bool swap;
+    // Opens the plugin on first use. The atomic avoids the call_once overhead
+    // on the hot path once the plugin is open.
+    Plugin& getPlugin()
+    {
+        Plugin* plugin = _ready.load(std::memory_order_acquire);
+        if (plugin)
+            return *plugin;
+
+        std::call_once(_once, [this] {
+            _plugin.reset(PluginFactory::getInstance().create(uri));
+            if (Dedup::isEnabled(uri))
+                _plugin.reset(new Dedup(std::move(_plugin), uri));
+            _ready.store(_plugin.get(), std::memory_order_release);
+        });
+        return *_plugin;
+    }
+
+    // Counts an insert, and adapts the queue depth of the backend. The time
+    // a value spends in the queue is estimated from the write throughput, the
+    // duration of the insert call only covers enqueuing it.
+    template <typename F>
+    bool write(const F& func)
+    {
+        if (!writes)
+            return func();
+
+        const bool ok = func();
+        if (writes->update(1, 0.))
+            getPlugin().setQueueDepth(writes->get());
+        return ok;
+    }
+
+    // Requests the keys from the backend in batches of the adaptive size, as
+    // func(batchKeys, offset) with the offset of the batch in keys
+    template <typename F>
+    void read(const Strings& keys, const F& func)
+    {
+        if (!reads)
+        {
+            func(keys, 0);
+            return;
+        }
+
+        for (size_t offset = 0;
+             offset < keys.size() && !Deadline::isExpired();)
+        {
+            const size_t size = std::min(reads->get(), keys.size() - offset);
+            const Clock::time_point start = Clock::now();
+            if (size == keys.size())
+                func(keys, 0);
+            else
+                func(Strings(keys.begin() + offset,
+                             keys.begin() + offset + size),
+                     offset);
+            reads->update(size, _elapsed(start));
+            offset += size;
+        }
+    }
+
+    // Batched read with the indices of the values relative to all keys
+    void getBatch(const Strings& keys, const ConstBatchFunc func)
+    {
+        std::vector<ConstValue> shifted;
+        read(keys, [&](const Strings& batch, const size_t offset) {
+            getPlugin().getBatch(batch, [&](const ConstValue* values,
+                                            const size_t size) {
+                if (offset == 0)
+                {
+                    func(values, size);
+                    return;
+                }
+                shifted.assign(values, values + size);
+                for (auto& value : shifted)
+                    value.index += offset;
+                func(shifted.data(), size);
+            });
+        });
+    }
+
+    void takeBatch(const Strings& keys, const BatchFunc func)
+    {
+        std::vector<Value> shifted;
+        read(keys, [&](const Strings& batch, const size_t offset) {
+            getPlugin().takeBatch(batch, [&](const Value* values,
+                                             const size_t size) {
+                if (offset == 0)
+                {
+                    func(values, size);
+                    return;
+                }
+                shifted.assign(values, values + size);
+                for (auto& value : shifted)
+                    value.index += offset;
+                func(shifted.data(), size);
+            });
+        });
+    }
+
+    const servus::URI uri;
+    std::atomic<bool> swap;
+    double lowLatency;
+    double highLatency;
+    std::chrono::milliseconds timeout; // default of reads and writes
+    std::unique_ptr<Tuner> writes; // adaptive queue depth
+    std::unique_ptr<Tuner> reads;  // adaptive read batch size
 #ifdef HISTOGRAM
+    std::mutex mutex;
     std::map<size_t, size_t> keys;
     std::map<size_t, size_t> values;
 #endif
+
+private:
+    std::once_flag _once;
+    std::unique_ptr<Plugin> _plugin;
+    std::atomic<Plugin*> _ready;
 };
 
 Map::Map(const servus::URI& uri)
-    : _impl(new Impl(uri))
+    : _impl(new Impl(uri, false))
 {
 }
 
+Map::Map(std::unique_ptr<Impl> impl)
+    : _impl(std::move(impl))
+{
+}
+
+std::future<Map> Map::open(const servus::URI& uri)
+{
+    return std::async(std::launch::async, [uri] { return Map(uri); });
+}
+
+Map Map::openLazy(const servus::URI& uri)
+{
+    if (!handles(uri))
+        LBTHROW(std::runtime_error("No keyv implementation for " +
+                                   std::to_string(uri)));
+    return Map(std::unique_ptr<Impl>(new Impl(uri, true)));
+}
+
 Map::Map(Map&& from)
     : _impl(std::move(from._impl))
 {
@@ -87,8 +248,13 @@ MapPtr Map::createCache()
 
     const char* leveldb = ::getenv("LEVELDB_CACHE");
     if (leveldb && handles(servus::URI("leveldb://")))
-        return MapPtr(new Map(
-            servus::URI(std::string("leveldb:///cache/?store=") + leveldb)));
+    {
+        std::string uri = std::string("leveldb:///cache/?store=") + leveldb;
+        const char* size = ::getenv("LEVELDB_CACHE_SIZE");
+        if (size)
+            uri += std::string("&max_size=") + size + "&policy=lru";
+        return MapPtr(new Map(servus::URI(uri)));
+    }
     return MapPtr();
 }
 
@@ -104,41 +270,291 @@ std::string Map::getDescriptions()
 
 size_t Map::setQueueDepth(const size_t depth)
 {
-    return _impl->plugin->setQueueDepth(depth);
+    Plugin& plugin = _impl->getPlugin();
+    _impl->writes.reset();
+    _impl->reads.reset();
+    if (depth != AUTO)
+        return plugin.setQueueDepth(depth);
+
+    _impl->reads.reset(new Tuner(initialBatchSize, 1, maxBatchSize,
+                                 batchSizeStep, false));
+    _impl->reads->setBounds(_impl->lowLatency, _impl->highLatency);
+
+    // backends without asynchronous writes only adapt the read batch size
+    const size_t maxDepth = plugin.setQueueDepth(maxQueueDepth);
+    if (maxDepth == 0)
+        return 0;
+
+    _impl->writes.reset(new Tuner(initialQueueDepth, 1, maxDepth, 1, true));
+    _impl->writes->setBounds(_impl->lowLatency, _impl->highLatency);
+    return plugin.setQueueDepth(_impl->writes->get());
+}
+
+void Map::setTimeout(const std::chrono::milliseconds timeout)
+{
+    _impl->timeout = timeout;
+}
+
+void Map::setLatencyBounds(const double low, const double high)
+{
+    _impl->lowLatency = low;
+    _impl->highLatency = high;
+    if (_impl->writes)
+        _impl->writes->setBounds(low, high);
+    if (_impl->reads)
+        _impl->reads->setBounds(low, high);
 }
 
 bool Map::insert(const std::string& key, const void* data, const size_t size)
 {
+    const Deadline deadline(_impl->timeout);
+#ifdef HISTOGRAM
+    {
+        std::lock_guard<std::mutex> lock(_impl->mutex);
+        ++_impl->keys[key.size()];
+        ++_impl->values[size];
+    }
+#endif
+    return _impl->write(
+        [&] { return _impl->getPlugin().insert(key, data, size); });
+}
+
+bool Map::insert(const std::string& key, const Spans& parts)
+{
+    const Deadline deadline(_impl->timeout);
 #ifdef HISTOGRAM
-    ++_impl->keys[key.size()];
-    ++_impl->values[size];
+    {
+        size_t size = 0;
+        for (const auto& part : parts)
+            size += part.size;
+        std::lock_guard<std::mutex> lock(_impl->mutex);
+        ++_impl->keys[key.size()];
+        ++_impl->values[size];
+    }
 #endif
-    return _impl->plugin->insert(key, data, size);
+    return _impl->write(
+        [&] { return _impl->getPlugin().insertParts(key, parts); });
+}
+
+bool Map::insert(const std::string& key, const void* data, const size_t size,
+                 const std::chrono::milliseconds timeout)
+{
+    const Deadline deadline(timeout);
+    return insert(key, data, size);
+}
+
+bool Map::compareAndSwap(const std::string& key, const void* expected,
+                         const size_t expectedSize, const void* data,
+                         const size_t size)
+{
+    return _impl->getPlugin().compareAndSwap(key, expected, expectedSize, data,
+                                             size);
+}
+
+uint64_t Map::increment(const std::string& key, const uint64_t delta)
+{
+    return _impl->getPlugin().increment(key, delta);
+}
+
+bool Map::append(const std::string& key, const void* data, const size_t size)
+{
+    return _impl->getPlugin().append(key, data, size);
 }
 
 std::string Map::operator[](const std::string& key) const
 {
-    return (*_impl->plugin)[key];
+    const Deadline deadline(_impl->timeout);
+    return _impl->getPlugin()[key];
+}
+
+std::string Map::get(const std::string& key,
+                     const std::chrono::milliseconds timeout) const
+{
+    const Deadline deadline(timeout);
+    return (*this)[key];
+}
+
+std::string Map::getRange(const std::string& key, const uint64_t offset,
+                          const size_t size) const
+{
+    return getRanges(key, {{offset, size}}).front();
+}
+
+Strings Map::getRanges(const std::string& key, const Ranges& ranges) const
+{
+    const Deadline deadline(_impl->timeout);
+    return _impl->getPlugin().getRanges(key, ranges);
 }
 
 void Map::getValues(const Strings& keys, const ConstValueFunc& func) const
 {
-    _impl->plugin->getValues(keys, func);
+    const Deadline deadline(_impl->timeout);
+    _impl->read(keys, [&](const Strings& batch, size_t) {
+        _impl->getPlugin().getValues(batch, func);
+    });
 }
 
 void Map::takeValues(const Strings& keys, const ValueFunc& func) const
 {
-    _impl->plugin->takeValues(keys, func);
+    const Deadline deadline(_impl->timeout);
+    _impl->read(keys, [&](const Strings& batch, size_t) {
+        _impl->getPlugin().takeValues(batch, func);
+    });
+}
+
+namespace
+{
+Strings _missing(const Strings& keys,
+                 const std::unordered_set<std::string>& found)
+{
+    Strings missing;
+    for (const auto& key : keys)
+        if (found.count(key) == 0)
+            missing.push_back(key);
+    return missing;
+}
+}
+
+Strings Map::getValues(const Strings& keys, const ConstValueFunc& func,
+                       const std::chrono::milliseconds timeout) const
+{
+    const Deadline deadline(timeout);
+    std::unordered_set<std::string> found;
+    getValues(keys, [&](const std::string& key, const char* data,
+                        const size_t size) {
+        found.insert(key);
+        func(key, data, size);
+    });
+    return _missing(keys, found);
+}
+
+Strings Map::takeValues(const Strings& keys, const ValueFunc& func,
+                        const std::chrono::milliseconds timeout) const
+{
+    const Deadline deadline(timeout);
+    std::unordered_set<std::string> found;
+    takeValues(keys, [&](const std::string& key, char* data,
+                         const size_t size) {
+        found.insert(key);
+        func(key, data, size);
+    });
+    return _missing(keys, found);
+}
+
+std::vector<bool> Map::contains(const Strings& keys) const
+{
+    std::vector<bool> found(keys.size(), false);
+    sizes(keys, [&found](const size_t index, size_t) { found[index] = true; });
+    return found;
+}
+
+void Map::sizes(const Strings& keys, const SizeFunc& func) const
+{
+    const Deadline deadline(_impl->timeout);
+    _impl->read(keys, [&](const Strings& batch, const size_t offset) {
+        _impl->getPlugin().getSizes(batch,
+                                    [&](const size_t index, const size_t size) {
+                                        func(index + offset, size);
+                                    });
+    });
+}
+
+Strings Map::getKeys(const std::string& after, const size_t maxKeys) const
+{
+    return _impl->getPlugin().getKeys(after, maxKeys);
+}
+
+Values Map::fetch(const Strings& keys) const
+{
+    const Deadline deadline(_impl->timeout);
+    Values values(keys.size());
+    _impl->getBatch(keys, [&values](const ConstValue* batch,
+                                    const size_t size) {
+        values.set(batch, size);
+    });
+    return values;
+}
+
+void Map::_getBatch(const Strings& keys, const ConstBatchFunc func) const
+{
+    const Deadline deadline(_impl->timeout);
+    _impl->getBatch(keys, func);
+}
+
+void Map::_takeBatch(const Strings& keys, const BatchFunc func) const
+{
+    const Deadline deadline(_impl->timeout);
+    _impl->takeBatch(keys, func);
 }
 
 bool Map::flush()
 {
-    return _impl->plugin->flush();
+    return _impl->getPlugin().flush();
+}
+
+void Map::compact()
+{
+    _impl->getPlugin().compact();
+}
+
+std::string Map::getProperty(const std::string& name) const
+{
+    return _impl->getPlugin().getProperty(name);
+}
+
+void Map::insert(CompletionQueue& queue, const std::string& key,
+                 std::string value, const std::function<void(bool)>& handler)
+{
+    const auto data = std::make_shared<std::string>(std::move(value));
+    queue._submit([this, key, data, handler] {
+        const bool ok = insert(key, data->data(), data->size());
+        return CompletionQueue::Completion([handler, ok] { handler(ok); });
+    });
+}
+
+void Map::get(CompletionQueue& queue, const std::string& key,
+              const std::function<void(std::string)>& handler) const
+{
+    queue._submit([this, key, handler] {
+        const auto value = std::make_shared<std::string>((*this)[key]);
+        return CompletionQueue::Completion(
+            [handler, value] { handler(std::move(*value)); });
+    });
+}
+
+void Map::fetch(CompletionQueue& queue, const Strings& keys,
+                const std::function<void(Values)>& handler) const
+{
+    queue._submit([this, keys, handler] {
+        const auto values = std::make_shared<Values>(fetch(keys));
+        return CompletionQueue::Completion(
+            [handler, values] { handler(std::move(*values)); });
+    });
+}
+
+void Map::flush(CompletionQueue& queue,
+                const std::function<void(bool)>& handler)
+{
+    queue._submit([this, handler] {
+        const bool ok = flush();
+        return CompletionQueue::Completion([handler, ok] { handler(ok); });
+    });
 }
 
 void Map::erase(const std::string& key)
 {
-    _impl->plugin->erase(key);
+    const Deadline deadline(_impl->timeout);
+    _impl->getPlugin().erase(key);
+}
+
+void Map::clear()
+{
+    _impl->getPlugin().clear();
+}
+
+void Map::erasePrefix(const std::string& prefix)
+{
+    _impl->getPlugin().erasePrefix(prefix);
 }
 
 void Map::setByteswap(const bool swap)
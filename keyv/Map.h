@@ -20,6 +20,7 @@
 #ifndef KEYV_MAP_H
 #define KEYV_MAP_H
 
+#include <keyv/Values.h>
 #include <keyv/api.h>
 #include <keyv/types.h>
 
@@ -28,7 +29,9 @@
 #include <lunchbox/log.h>          // LBTHROW
 #include <servus/uri.h>
 
+#include <chrono>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <set>
 #include <stdexcept>
@@ -41,6 +44,22 @@ namespace keyv
 /**
  * Unified interface to save key-value pairs in a store.
  *
+ * Thread safety: a single Map may be used concurrently from any number of
+ * threads for insert(), erase(), flush() and all read operations. Concurrent
+ * writes to the same key are not ordered. Construction, move assignment,
+ * setQueueDepth(), setLatencyBounds(), setTimeout() and setByteswap() must
+ * not race with other operations on the same Map. The first operations on a
+ * lazily opened Map may race, the backend is opened exactly once. The
+ * backends implement this as follows:
+ * * leveldb: operations are passed through to the internally synchronized
+ *   database without additional locking.
+ * * lmdb: each operation uses its own transaction. Reads never block, also
+ *   not across processes sharing the store.
+ * * memcached: each operation leases a connection from a per-Map pool, which
+ *   grows to the number of concurrent callers.
+ * * ceph: all threads share one I/O context, and each operation waits on its
+ *   own asynchronous completion.
+ *
  * Example: @include tests/Map.cpp
  */
 class Map
@@ -54,10 +73,48 @@ public:
      * * ceph://user@cluster?[store=storeName&config=path&keyring=path]
      *   (if KEYV_USE_RADOS is defined)
      * * leveldb://path (if KEYV_USE_LEVELDB is defined)
+     * * lmdb://[/namespace][?store=path] (if KEYV_USE_LMDB is defined)
      * * memcached://[server] (if KEYV_USE_LIBMEMCACHED is defined)
+     * * mmap://path, a read-only snapshot written by MmapWriter (not on
+     *   Windows)
+     * * shard://path/to/child_list, partitioning the keys over the child
+     *   stores listed in the file, one 'uri [weight]' per line with a default
+     *   weight of 1. Keys are routed by consistent hashing, so that changing
+     *   the list only moves the keys of the changed children. getKeys()
+     *   merges the keys of all children, which only works if all children
+     *   enumerate their keys in order, as leveldb and ceph do.
+     * * mirror://path/to/child_list[?delay=ms][&percentile=P][&threads=N],
+     *   writing to all child stores listed in the file, one uri per line.
+     *   Reads go to the first child, the primary, and are also sent to the
+     *   next child if the primary has not answered after the delay (default
+     *   5ms), or after the given percentile of the primary latencies. The
+     *   requests run in a pool of N threads (default 4 per child). The
+     *   outcome of compareAndSwap() and increment() is decided by the
+     *   primary and copied to the other children.
+     *
+     * All lmdb maps of a process on the same store share one environment,
+     * whose map_size is set by the first map opening it.
+     *
+     * Maps of a process on the same leveldb or lmdb store also share the
+     * locks of their read-modify-writes and dedup reference counts, so that
+     * compareAndSwap(), increment() and append() stay atomic across them.
      *
      * If no path is given for leveldb, the implementation uses
-     * keyvMap.leveldb in the current working directory.
+     * keyvMap.leveldb in the current working directory. All leveldb maps of
+     * a process on the same store share one database, whose options are set
+     * by the first map opening it. A leveldb namespace becomes a size-bounded
+     * cache if max_size is given, e.g.
+     * leveldb:///cache?store=path&max_size=50GB&policy=lru. Least recently
+     * used (lru, default) or oldest (fifo) entries are then evicted in the
+     * background once the namespace exceeds the given size, by one thread
+     * for all maps of a process on the namespace.
+     *
+     * The leveldb write buffer is set with write_buffer, e.g.,
+     * write_buffer=64MB. profile=bulk configures leveldb for loading large
+     * amounts of data: the write buffer defaults to 256MB, which avoids
+     * write stalls on many small level-0 files, and the namespace is
+     * compacted when the Map is destroyed if values were inserted. Use
+     * compact() to compact it earlier.
      *
      * If no servers are given for memcached, the implementation uses all
      * servers in the MEMCACHED_SERVERS environment variable, or
@@ -65,12 +122,59 @@ public:
      * servers. Each server contains the address, and optionally a
      * colon-separated port number.
      *
+     * Memcached stores each value on N servers if replicas=N is given, and
+     * reads it from a random one. compareAndSwap(), increment() and append()
+     * are not supported with replicas, since the servers would only update
+     * one copy.
+     *
+     * Memcached compresses values with a shared zstd dictionary if
+     * dictionary=1 is given and Keyv was built with zstd. The first
+     * dictionary_samples values (default 1000) are stored uncompressed and
+     * train a dictionary of at most dictionary_size bytes (default 110KB),
+     * which is stored in the namespace and used by all clients. Values
+     * written with a dictionary evicted by memcached are lost. Compressed
+     * values decoding to more than max_value_size bytes (default 64MB) are
+     * treated as corrupt and not read.
+     *
+     * Any backend stores identical values only once if dedup=1 is given.
+     * Values of at least dedup_min_size bytes (default 64) are then stored
+     * under their content hash, and the keys hold a reference. Writes become
+     * synchronous and read the previous value of the key. The reference
+     * counts are only consistent if one process writes to the store.
+     *
      * @param uri the storage backend and destination.
      * @throw std::runtime_error if no suitable implementation is found.
      * @throw std::runtime_error if opening the leveldb failed.
      * @version 1.9.2
      */
     KEYV_API explicit Map(const servus::URI& uri);
+
+    /**
+     * Open a map asynchronously.
+     *
+     * Opening a backend may take seconds, e.g., to connect to a ceph cluster
+     * or to recover a leveldb log. Several maps can be opened concurrently.
+     *
+     * @param uri the storage backend and destination, see Map().
+     * @return a future which becomes ready once the map is open, and throws
+     *         the construction errors of Map() from get().
+     * @version 1.2
+     */
+    KEYV_API static std::future<Map> open(const servus::URI& uri);
+
+    /**
+     * Create a map which opens its backend on first use.
+     *
+     * Returns immediately. The backend is opened by the first operation on
+     * the map, which throws the construction errors of Map(). A failed open
+     * is retried by the next operation.
+     *
+     * @param uri the storage backend and destination, see Map().
+     * @throw std::runtime_error if no suitable implementation is found.
+     * @version 1.2
+     */
+    KEYV_API static Map openLazy(const servus::URI& uri);
+
     KEYV_API Map(Map&& from);
     KEYV_API Map& operator=(Map&& from);
 
@@ -98,7 +202,8 @@ public:
      *   environment variable MEMCACHED_SERVERS is set (see constructor
      *   documentation for details).
      * * A leveldb-backed cache if leveldb is available and LEVELDB_CACHE is set
-     *   to the path for the leveldb storage.
+     *   to the path for the leveldb storage. If LEVELDB_CACHE_SIZE is set, the
+     *   cache is bounded to this size (e.g. 50GB) using LRU eviction.
      *
      * @return a Map for caching IO, or 0.
      */
@@ -113,12 +218,56 @@ public:
      * elements have been inserted or flush() has been called. Implementations
      * which do not support asynchronous writes return 0.
      *
+     * With AUTO, the queue depth and the number of keys requested from the
+     * backend at once by the batched reads adapt to the measured throughput
+     * and latency. They grow while the throughput improves or the latency is
+     * below the lower latency bound, and shrink when the throughput drops or
+     * the latency exceeds the upper bound. Since the queue depth is not known
+     * in advance, inserted values need to stay valid until flush() has been
+     * called. Any other depth disables the adaptation.
+     *
      * @return the queue depth chosen by the implementation, smaller or equal to
-     *         the given depth.
+     *         the given depth. The initial queue depth for AUTO.
      * @version 1.11
      */
     KEYV_API size_t setQueueDepth(const size_t depth);
 
+    /** Adapt the queue depth and read batch size to the measurements. */
+    KEYV_API static const size_t AUTO;
+
+    /**
+     * Set the latency bounds of the adaptive queue depth and read batch size.
+     *
+     * The latency is the duration of one read batch, and for writes the time
+     * a value spends in the queue, estimated from the queue depth and the
+     * write throughput. The default bounds are 1 and 100 ms.
+     *
+     * @param low the latency in milliseconds below which sizes always grow.
+     * @param high the latency in milliseconds above which sizes are halved.
+     * @sa setQueueDepth()
+     * @version 1.2
+     */
+    KEYV_API void setLatencyBounds(double low, double high);
+
+    /**
+     * Set the default timeout of reads and writes.
+     *
+     * An operation exceeding its timeout returns without the values not
+     * retrieved yet, or reports a failed write, which may still be applied
+     * later. The backends enforce the deadline of an operation as follows:
+     * * leveldb: batched reads check the deadline between keys.
+     * * memcached: the poll timeout is limited to the remaining time, and
+     *   batched reads stop receiving values after the deadline. A timeout
+     *   counts as a server failure.
+     * * ceph: an operation not completed at the deadline is cancelled. A
+     *   queued insert waiting for older writes only cancels its own write.
+     * * lmdb and mmap: reads do not block, the timeout is ignored.
+     *
+     * @param timeout the maximum duration of an operation, zero for none.
+     * @version 1.2
+     */
+    KEYV_API void setTimeout(std::chrono::milliseconds timeout);
+
     /**
      * Insert or update a value in the database.
      *
@@ -142,6 +291,20 @@ public:
 #endif
     KEYV_API bool insert(const std::string& key, const void* data, size_t size);
 
+    /**
+     * Insert or update a value in the database within a timeout.
+     *
+     * @param key the key to store the value.
+     * @param data the value.
+     * @param size the size of the value.
+     * @param timeout the maximum duration, shortening the default timeout.
+     * @return false if the value was not stored within the timeout.
+     * @sa setTimeout()
+     * @version 1.2
+     */
+    KEYV_API bool insert(const std::string& key, const void* data, size_t size,
+                         std::chrono::milliseconds timeout);
+
     /**
      * Insert or update a vector of values in the database.
      *
@@ -179,6 +342,88 @@ public:
         return insert(key, std::vector<V>(values.begin(), values.end()));
     }
 
+    /**
+     * Insert or update a value assembled from several parts.
+     *
+     * Stores the concatenation of all parts. The lmdb and ceph backends write
+     * the parts without an intermediate copy, leveldb gathers them in a
+     * per-thread buffer, all others concatenate them first.
+     *
+     * @param key the key to store the value.
+     * @param parts the parts of the value, in order.
+     * @return true on success, false otherwise
+     * @version 1.2
+     */
+    KEYV_API bool insert(const std::string& key, const Spans& parts);
+
+    /**
+     * Atomically replace a value if it equals the expected value.
+     *
+     * An empty expected value matches a missing key, i.e., the value is only
+     * created if the key does not exist. Memcached, ceph and lmdb compare and
+     * swap on the server or within one transaction, which is atomic across
+     * processes. The other backends use a process-local lock.
+     *
+     * @param key the key of the value.
+     * @param expected the expected current value.
+     * @param expectedSize the size of the expected value.
+     * @param data the new value.
+     * @param size the size of the new value.
+     * @return true if the value was replaced, false if it differed from the
+     *         expected value or on failure.
+     * @version 1.2
+     */
+    KEYV_API bool compareAndSwap(const std::string& key, const void* expected,
+                                 size_t expectedSize, const void* data,
+                                 size_t size);
+
+    /** @sa compareAndSwap() @version 1.2 */
+    bool compareAndSwap(const std::string& key, const std::string& expected,
+                        const std::string& value)
+    {
+        return compareAndSwap(key, expected.data(), expected.size(),
+                              value.data(), value.size());
+    }
+
+    /**
+     * Atomically increment a counter.
+     *
+     * Counters are stored as decimal strings, a missing key counts as 0.
+     * Memcached increments on the server, ceph retries a compare and swap
+     * until no other writer interfered, and lmdb uses one write transaction.
+     * The other backends use a process-local lock.
+     *
+     * @param key the key of the counter.
+     * @param delta the value to add.
+     * @return the new value of the counter.
+     * @throw std::runtime_error if the value is not a counter or the update
+     *        failed.
+     * @version 1.2
+     */
+    KEYV_API uint64_t increment(const std::string& key, uint64_t delta = 1);
+
+    /**
+     * Atomically append data to a value, creating it if the key is missing.
+     *
+     * Memcached appends on the server without sending the existing value to
+     * the client. Ceph and lmdb update the value like increment(). The other
+     * backends use a process-local lock.
+     *
+     * @param key the key of the value.
+     * @param data the data to append.
+     * @param size the size of the data.
+     * @return true on success, false otherwise.
+     * @version 1.2
+     */
+    KEYV_API bool append(const std::string& key, const void* data,
+                         size_t size);
+
+    /** @sa append() @version 1.2 */
+    bool append(const std::string& key, const std::string& value)
+    {
+        return append(key, value.data(), value.size());
+    }
+
     /**
      * Retrieve a value for a key.
      *
@@ -188,6 +433,48 @@ public:
      */
     KEYV_API std::string operator[](const std::string& key) const;
 
+    /**
+     * Retrieve a value for a key within a timeout.
+     *
+     * @param key the key to retrieve.
+     * @param timeout the maximum duration, shortening the default timeout.
+     * @return the value, or an empty string if the key is not available
+     *         within the timeout.
+     * @sa setTimeout()
+     * @version 1.2
+     */
+    KEYV_API std::string get(const std::string& key,
+                             std::chrono::milliseconds timeout) const;
+
+    /**
+     * Retrieve a part of a value.
+     *
+     * The mmap and lmdb backends copy only the requested bytes from the
+     * stored value. All other backends read the full value and slice it.
+     *
+     * @param key the key to retrieve.
+     * @param offset the position of the first byte in the value.
+     * @param size the maximum number of bytes to retrieve.
+     * @return the bytes in the range, shorter if the value ends before the
+     *         end of the range, empty if the key is not available.
+     * @version 1.2
+     */
+    KEYV_API std::string getRange(const std::string& key, uint64_t offset,
+                                  size_t size) const;
+
+    /**
+     * Retrieve several parts of a value.
+     *
+     * The value is read only once for all ranges, see getRange().
+     *
+     * @param key the key to retrieve.
+     * @param ranges the parts to retrieve, in any order.
+     * @return the bytes of each range, in the order of the ranges.
+     * @version 1.2
+     */
+    KEYV_API Strings getRanges(const std::string& key,
+                               const Ranges& ranges) const;
+
     /**
      * Retrieve a value for a key.
      *
@@ -252,12 +539,254 @@ public:
      */
     KEYV_API void takeValues(const Strings& keys, const ValueFunc& func) const;
 
+    /**
+     * Retrieve values from a list of keys within a timeout.
+     *
+     * The values retrieved before the timeout are delivered as by
+     * getValues(), and the keys without a value are returned.
+     *
+     * @param keys list of keys to obtain
+     * @param func callback function which is called for each found key
+     * @param timeout the maximum duration, shortening the default timeout.
+     * @return the keys which are not available or were not retrieved within
+     *         the timeout, in the order of keys.
+     * @sa setTimeout()
+     * @version 1.2
+     */
+    KEYV_API Strings getValues(const Strings& keys, const ConstValueFunc& func,
+                               std::chrono::milliseconds timeout) const;
+
+    /**
+     * Take values from a list of keys within a timeout.
+     *
+     * @return the keys which are not available or were not retrieved within
+     *         the timeout, in the order of keys.
+     * @sa getValues(const Strings&, const ConstValueFunc&,
+     *     std::chrono::milliseconds), takeValues()
+     * @version 1.2
+     */
+    KEYV_API Strings takeValues(const Strings& keys, const ValueFunc& func,
+                                std::chrono::milliseconds timeout) const;
+
+    /**
+     * Retrieve values from a list of keys and call back for each found value.
+     *
+     * The callback is invoked as func(index, data, size), where index is the
+     * position of the key in keys. The backend hands over values in batches,
+     * and the callback is inlined into the loop over each batch. No
+     * std::function is created and no key is copied, which makes this the
+     * fastest way to read many small values.
+     *
+     * The ownership of the returned data is not transfered, so the value needs
+     * to be copied if needed.
+     *
+     * @param keys list of keys to obtain
+     * @param func callable with the signature
+     *             void(size_t index, const char* data, size_t size)
+     * @version 1.2
+     */
+    template <class F>
+    void getIndexedValues(const Strings& keys, F&& func) const
+    {
+        _getBatch(keys, [&func](const ConstValue* values, const size_t size) {
+            for (size_t i = 0; i < size; ++i)
+                func(values[i].index, values[i].data, values[i].size);
+        });
+    }
+
+    /**
+     * Retrieve values from a list of keys and call back for each found value.
+     *
+     * The callback is invoked as func(index, data, size), where index is the
+     * position of the key in keys. The ownership of the returned data is
+     * transfered, so the data must be free'd (with free()) by the caller.
+     *
+     * @param keys list of keys to obtain
+     * @param func callable with the signature
+     *             void(size_t index, char* data, size_t size)
+     * @version 1.2
+     * @sa getIndexedValues()
+     */
+    template <class F>
+    void takeIndexedValues(const Strings& keys, F&& func) const
+    {
+        _takeBatch(keys, [&func](const Value* values, const size_t size) {
+            for (size_t i = 0; i < size; ++i)
+                func(values[i].index, values[i].data, values[i].size);
+        });
+    }
+
+    /**
+     * Retrieve values from a list of keys into one batch result.
+     *
+     * All values are copied into a few large memory blocks owned by the
+     * result, instead of one allocation per value as in takeValues(). The
+     * values are accessed by the index of their key in keys.
+     *
+     * @param keys list of keys to obtain
+     * @return the values of all found keys
+     * @version 1.2
+     */
+    KEYV_API Values fetch(const Strings& keys) const;
+
+    /**
+     * Check which of the given keys exist.
+     *
+     * Uses sizes(), i.e., does not transfer values where the backend allows.
+     *
+     * @param keys list of keys to check
+     * @return for each key, true if it exists in the store
+     * @version 1.2
+     */
+    KEYV_API std::vector<bool> contains(const Strings& keys) const;
+
+    /**
+     * Retrieve the sizes of the values of a list of keys.
+     *
+     * The callback is invoked as func(index, size) for each existing key,
+     * where index is the position of the key in keys. Leveldb seeks to each
+     * key without copying its value, mmap and lmdb read the sizes from their
+     * index. Memcached and ceph have no size query and fetch the values,
+     * without decompressing them in memcached.
+     *
+     * @param keys list of keys to query
+     * @param func the callback for each existing key
+     * @version 1.2
+     */
+    KEYV_API void sizes(const Strings& keys, const SizeFunc& func) const;
+
+    /**
+     * Enumerate the keys of the store in the backend-specific order.
+     *
+     * Call repeatedly with the last returned key to page through all keys.
+     * Only the leveldb, ceph and mmap backends support enumeration. In
+     * leveldb, the keys of a namespace include the keys of its nested
+     * namespaces, and the root namespace enumerates all keys of the store.
+     *
+     * @param after the key after which to continue, empty to start from the
+     *              beginning.
+     * @param maxKeys the maximum number of returned keys.
+     * @return the next keys, or an empty list if all keys have been returned.
+     * @throw std::runtime_error if the backend can't enumerate keys.
+     * @version 1.2
+     */
+    KEYV_API Strings getKeys(const std::string& after, size_t maxKeys) const;
+
     /** Erase the given key from the store. @version 1.1 */
     KEYV_API void erase(const std::string& key);
 
+    /**
+     * Erase all keys of the map.
+     *
+     * Erases all keys of the namespace given in the URI, in leveldb and lmdb
+     * including the keys of nested namespaces. Clearing the root namespace,
+     * i.e., a URI without a path, therefore wipes the whole store, including
+     * the namespaces of all other maps on it. Memcached invalidates all keys
+     * at once by incrementing a generation number stored in the namespace,
+     * which is part of all key hashes. Other maps on the same namespace use
+     * the new generation after at most generation_refresh ms (default 1000),
+     * and the old values are evicted by memcached over time. Leveldb deletes
+     * in batches and compacts the key range, ceph clears the object map of
+     * its store.
+     *
+     * @throw std::runtime_error if the backend failed to clear the map.
+     * @version 1.2
+     */
+    KEYV_API void clear();
+
+    /**
+     * Erase all keys starting with the given prefix.
+     *
+     * @param prefix the common prefix of the erased keys.
+     * @throw std::runtime_error if the backend can't enumerate keys, e.g.,
+     *        memcached.
+     * @version 1.2
+     */
+    KEYV_API void erasePrefix(const std::string& prefix);
+
     /** Flush outstanding operations to the backend storage. @version 1.0 */
     KEYV_API bool flush();
 
+    /**
+     * Compact the storage of the values in this map.
+     *
+     * leveldb rewrites the files of the namespace of the map into the lowest
+     * possible level, which speeds up the reads of a freshly loaded store and
+     * frees the space of erased values. Other backends ignore this call.
+     *
+     * @version 1.2
+     */
+    KEYV_API void compact();
+
+    /**
+     * Retrieve a property of the backend storage.
+     *
+     * leveldb provides its properties, e.g., "leveldb.stats",
+     * "leveldb.num-files-at-level<N>", "leveldb.sstables" and
+     * "leveldb.approximate-memory-usage". Sharded stores return one line for
+     * each child providing the property.
+     *
+     * @param name the name of the property.
+     * @return the value of the property, empty if it is not available.
+     * @version 1.2
+     */
+    KEYV_API std::string getProperty(const std::string& name) const;
+
+    /** @name Asynchronous operations */
+    //@{
+    /**
+     * The operations run in the thread pool of the queue, and call the
+     * handler with their result from CompletionQueue::poll() or drain().
+     * The Map must not be moved or destroyed until all handlers are called.
+     */
+
+    /**
+     * Insert or update a value asynchronously.
+     *
+     * @param queue the queue running the operation and delivering its result.
+     * @param key the key to store the value.
+     * @param value the value, owned by the operation.
+     * @param handler called with the result of insert().
+     * @version 1.2
+     */
+    KEYV_API void insert(CompletionQueue& queue, const std::string& key,
+                         std::string value,
+                         const std::function<void(bool)>& handler);
+
+    /**
+     * Retrieve a value asynchronously.
+     *
+     * @param queue the queue running the operation and delivering its result.
+     * @param key the key to retrieve.
+     * @param handler called with the value, or an empty string if the key is
+     *        not available.
+     * @version 1.2
+     */
+    KEYV_API void get(CompletionQueue& queue, const std::string& key,
+                      const std::function<void(std::string)>& handler) const;
+
+    /**
+     * Retrieve the values of a list of keys asynchronously.
+     *
+     * @param queue the queue running the operation and delivering its result.
+     * @param keys the keys to retrieve.
+     * @param handler called with the result of fetch().
+     * @version 1.2
+     */
+    KEYV_API void fetch(CompletionQueue& queue, const Strings& keys,
+                        const std::function<void(Values)>& handler) const;
+
+    /**
+     * Flush outstanding operations asynchronously.
+     *
+     * @param queue the queue running the operation and delivering its result.
+     * @param handler called with the result of flush().
+     * @version 1.2
+     */
+    KEYV_API void flush(CompletionQueue& queue,
+                        const std::function<void(bool)>& handler);
+    //@}
+
     /** Enable or disable endianness conversion on reads. @version 1.0 */
     KEYV_API void setByteswap(const bool swap);
 
@@ -268,7 +797,11 @@ private:
     class Impl;
     std::unique_ptr<Impl> _impl;
 
+    explicit Map(std::unique_ptr<Impl> impl);
+
     KEYV_API bool _swap() const;
+    KEYV_API void _getBatch(const Strings& keys, ConstBatchFunc func) const;
+    KEYV_API void _takeBatch(const Strings& keys, BatchFunc func) const;
 
     // Enables map.insert( "foo", "bar" ); bar is a char[4]. The funny braces
     // declare v as a "const ref to array of four chars", not as a "const array
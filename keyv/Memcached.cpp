@@ -17,11 +17,28 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include "Counter.h"
+#include "Deadline.h"
+#include "MemcachedHash.h"
+#include "Query.h"
+
 #include <keyv/Plugin.h>
 #include <libmemcached/memcached.h>
+#include <lunchbox/buffer.h>
+#include <lunchbox/compiler.h>
+#include <lunchbox/log.h>
 #include <lunchbox/pluginRegisterer.h>
 #include <lunchbox/uint128_t.h>
-#include <unordered_map>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_set>
 #include <utility>
 
 #ifdef KEYV_USE_PRESSION
@@ -29,6 +46,9 @@
 #include <pression/data/CompressorZSTD.h>
 #include <pression/data/Registry.h>
 #endif
+#ifdef KEYV_USE_ZSTD
+#include "Dictionary.h"
+#endif
 
 namespace keyv
 {
@@ -36,11 +56,39 @@ class Memcached;
 namespace
 {
 lunchbox::PluginRegisterer<Memcached> registerer;
+const size_t batchSize = 64; // values per getBatch() and takeBatch() callback
+const size_t maxRetries = 100; // of atomic updates racing with other writers
+const size_t maxValueSize = 64 * 1024 * 1024; // decoded, rejects corrupt data
+#ifdef KEYV_USE_ZSTD
+const int dictionaryLevel = 3;            // the default ZSTD compression level
+const size_t dictionarySize = 110 * 1024; // the default of the zstd tool
+#endif
+
+// rounds up, libmemcached retry timeouts have a granularity of seconds
+uint64_t _toSeconds(const uint64_t ms)
+{
+    return (ms + 999) / 1000;
+}
 
 memcached_st* _getInstance(const servus::URI& uri)
 {
+    const uint64_t replicas = query::getUInt(uri, "replicas", 1);
+    if (replicas == 0)
+        LBTHROW(std::runtime_error("Need at least one replica in " +
+                                   std::to_string(uri)));
+
     const std::string& host = uri.getHost();
     const int16_t port = uri.getPort() ? uri.getPort() : 11211;
+    // Parse all options before creating the instance to not leak it
+    const uint64_t connectTimeout = query::getUInt(uri, "connect_timeout", 500);
+    const uint64_t pollTimeout = query::getUInt(uri, "poll_timeout", 500);
+    const uint64_t rcvTimeout = query::getUInt(uri, "rcv_timeout", 0);
+    const uint64_t sndTimeout = query::getUInt(uri, "snd_timeout", 0);
+    const uint64_t retryTimeout = query::getUInt(uri, "retry_timeout", 2000);
+    const uint64_t deadTimeout = query::getUInt(uri, "dead_timeout", 10000);
+    const uint64_t failureLimit = query::getUInt(uri, "failure_limit", 2);
+    const uint64_t removeFailed = query::getUInt(uri, "remove_failed", 1);
+
     memcached_st* instance = memcached_create(0);
     size_t nServers = 1;
 
@@ -49,7 +97,6 @@ memcached_st* _getInstance(const servus::URI& uri)
         const char* servers = ::getenv("MEMCACHED_SERVERS");
         if (servers)
         {
-            instance->server_failure_limit = 10;
             std::string data = servers;
             while (!data.empty())
             {
@@ -85,14 +132,66 @@ memcached_st* _getInstance(const servus::URI& uri)
     memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_NO_BLOCK, 1); // nop?
     // fire-and-forget writes
     memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+    // CAS identifiers for compareAndSwap()
+    memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_SUPPORT_CAS, 1);
     // buffer sizes
     memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_SOCKET_SEND_SIZE,
                            LB_1MB * nServers);
     memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_SOCKET_RECV_SIZE,
                            LB_1MB * nServers);
+
+    // A hung or dead server must not stall the clients, it is a cache after
+    // all: time out quickly (ms), treat timeouts as misses, and after
+    // failure_limit consecutive failures eject the server from the hash ring.
+    // Ejected and failed servers are retried after the retry and dead timeouts.
+    memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT,
+                           connectTimeout);
+    memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_POLL_TIMEOUT,
+                           pollTimeout);
+    if (rcvTimeout > 0) // libmemcached uses us for socket timeouts
+        memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_RCV_TIMEOUT,
+                               rcvTimeout * 1000);
+    if (sndTimeout > 0)
+        memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_SND_TIMEOUT,
+                               sndTimeout * 1000);
+    memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_RETRY_TIMEOUT,
+                           _toSeconds(retryTimeout));
+    memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_DEAD_TIMEOUT,
+                           _toSeconds(deadTimeout));
+    memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_SERVER_FAILURE_LIMIT,
+                           failureLimit);
+    memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_REMOVE_FAILED_SERVERS,
+                           removeFailed);
+
+    // Spread hot keys: each value is written to the next 'replicas' servers on
+    // the consistent hash ring. Reads start at a random replica and fall back
+    // to the others if a server fails. Replication needs the binary protocol.
+    const uint64_t copies =
+        std::min(replicas, uint64_t(memcached_server_count(instance)));
+    if (copies > 1)
+    {
+        memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
+        memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_NUMBER_OF_REPLICAS,
+                               copies - 1);
+        memcached_behavior_set(instance,
+                               MEMCACHED_BEHAVIOR_RANDOMIZE_REPLICA_READ, 1);
+    }
     return instance;
 }
 
+uint64_t _now() // ms
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+bool _isReplicated(memcached_st* instance)
+{
+    return instance && memcached_behavior_get(
+                           instance, MEMCACHED_BEHAVIOR_NUMBER_OF_REPLICAS) > 0;
+}
+
 lunchbox::uint128_t _generateNamespace(const servus::URI& uri)
 {
     const auto& path = uri.getPath();
@@ -109,11 +208,34 @@ public:
     explicit Memcached(const servus::URI& uri)
         : _instance(_getInstance(uri))
         , _namespace(_generateNamespace(uri))
+        , _generationKey(_reservedKey("generation"))
+        , _generationRefresh(query::getUInt(uri, "generation_refresh", 1000))
+        , _generation(0)
+        , _nextRefresh(0)
         , _lastError(MEMCACHED_SUCCESS)
+        , _replicated(_isReplicated(_instance))
+        , _maxValueSize(query::getSize(uri, "max_value_size", maxValueSize))
+        , _flushFailed(false)
+        , _flushes(0)
     {
         if (!_instance)
             throw std::runtime_error(std::string("Open of ") +
                                      std::to_string(uri) + " failed");
+#ifdef KEYV_USE_PRESSION
+        _compressorName = pression::data::CompressorSnappy().getName();
+#endif
+        if (query::getUInt(uri, "dictionary", 0) == 0)
+            return;
+#ifdef KEYV_USE_ZSTD
+        _dictionary.reset(new Dictionary(
+            query::getUInt(uri, "dictionary_samples", 1000),
+            query::getSize(uri, "dictionary_size", dictionarySize),
+            dictionaryLevel));
+        _compressorName = "zstd-dictionary";
+#else
+        LBWARN << "Ignoring dictionary compression in " << std::to_string(uri)
+               << ", Keyv was built without zstd" << std::endl;
+#endif
     }
 
     virtual ~Memcached() { memcached_free(_instance); }
@@ -124,160 +246,942 @@ public:
 
     static std::string getDescription()
     {
-        return "memcached://[host][:port][/namespace]";
+        return "memcached://[host][:port][/namespace][?replicas=N]"
+               "[&connect_timeout=ms][&poll_timeout=ms][&rcv_timeout=ms]"
+               "[&snd_timeout=ms][&retry_timeout=ms][&dead_timeout=ms]"
+               "[&failure_limit=N][&remove_failed=0|1]"
+               "[&generation_refresh=ms][&dictionary=0|1]"
+               "[&dictionary_samples=N][&dictionary_size=bytes]";
     }
 
     bool insert(const std::string& key, const void* data,
                 const size_t size) final
     {
+        Lease connection(*this);
         const std::string& hash = _hash(key);
-#ifdef KEYV_USE_PRESSION
-        const lunchbox::Bufferb compressed{_compress(data, size)};
+        const char* value = static_cast<const char*>(data);
+        size_t length = size;
+        lunchbox::Bufferb buffer;
+        _encode(*connection, value, length, buffer);
         const memcached_return_t ret =
-            memcached_set(_instance, hash.c_str(), hash.length(),
-                          (char*)compressed.getData(), compressed.getSize(),
-                          (time_t)0, (uint32_t)0);
-#else
+            memcached_set(connection->instance, hash.c_str(), hash.length(),
+                          value, length, (time_t)0, (uint32_t)0);
+        connection->dirty = true;
+
+        _checkError(*connection, "memcached_set", ret);
+        return ret == MEMCACHED_SUCCESS;
+    }
+
+    bool compareAndSwap(const std::string& key, const void* expected,
+                        const size_t expectedSize, const void* data,
+                        const size_t size) final
+    {
+        _checkUnreplicated("compareAndSwap");
+        Lease connection(*this);
+        const std::string& hash = _hash(key);
+        Replies replies(*connection);
+        const Current current = _gets(*connection, hash);
+        if (current.value.size() != expectedSize ||
+            (expectedSize > 0 &&
+             ::memcmp(current.value.data(), expected, expectedSize) != 0))
+        {
+            return false;
+        }
+
         const memcached_return_t ret =
-            memcached_set(_instance, hash.c_str(), hash.length(),
-                          (const char*)data, size, (time_t)0, (uint32_t)0);
-#endif
+            _store(*connection, hash, current, data, size);
+        if (ret != MEMCACHED_DATA_EXISTS && ret != MEMCACHED_NOTSTORED)
+            _checkError(*connection, "memcached_cas", ret);
+        return ret == MEMCACHED_SUCCESS;
+    }
 
-        if (ret != MEMCACHED_SUCCESS && _lastError != ret)
+    uint64_t increment(const std::string& key, const uint64_t delta) final
+    {
+        _checkUnreplicated("increment");
+        Lease connection(*this);
+        const std::string& hash = _hash(key);
+        Replies replies(*connection);
+        uint64_t result = 0;
+        memcached_return_t ret = MEMCACHED_FAILURE;
+        if (_isEncoded()) // the server can't increment compressed values
+            ret = _update(*connection, hash, [&](const std::string& value) {
+                result = counter::parse(key, value.data(), value.size());
+                result += delta;
+                return std::to_string(result);
+            });
+        else
+            ret = _increment(*connection, hash, delta, delta, result);
+        if (ret != MEMCACHED_SUCCESS)
         {
-            LBWARN << "memcached_set failed: "
-                   << memcached_strerror(_instance, ret) << std::endl;
-            _lastError = ret;
+            _checkError(*connection, "memcached_increment", ret);
+            LBTHROW(std::runtime_error(
+                "Increment of " + key + " failed: " +
+                memcached_strerror(connection->instance, ret)));
         }
+        return result;
+    }
+
+    bool append(const std::string& key, const void* data,
+                const size_t size) final
+    {
+        _checkUnreplicated("append");
+        Lease connection(*this);
+        const std::string& hash = _hash(key);
+        Replies replies(*connection);
+        memcached_return_t ret = MEMCACHED_FAILURE;
+        if (_isEncoded()) // the server can't append to compressed values
+            ret = _update(*connection, hash, [&](const std::string& value) {
+                return value + std::string((const char*)data, size);
+            });
+        else
+            ret = _append(*connection, hash, data, size);
+        _checkError(*connection, "memcached_append", ret);
         return ret == MEMCACHED_SUCCESS;
     }
 
     std::string operator[](const std::string& key) const final
     {
+        Lease connection(*this);
         const std::string& hash = _hash(key);
         size_t size = 0;
         uint32_t flags = 0;
         memcached_return_t ret = MEMCACHED_SUCCESS;
-        char* data = memcached_get(_instance, hash.c_str(), hash.length(),
-                                   &size, &flags, &ret);
+        char* data = memcached_get(connection->instance, hash.c_str(),
+                                   hash.length(), &size, &flags, &ret);
         if (ret != MEMCACHED_SUCCESS)
+        {
+            if (ret != MEMCACHED_NOTFOUND)
+                _checkError(*connection, "memcached_get", ret);
             return std::string();
+        }
 
-        std::string value;
-#ifdef KEYV_USE_PRESSION
-        const uint64_t fullSize = *reinterpret_cast<uint64_t*>(data);
-        value.resize(fullSize);
-        _decompress((uint8_t*)value.data(), fullSize, (const uint8_t*)data,
-                    size);
-#else
-        value.assign(data, data + size);
-#endif
+        lunchbox::Bufferb buffer;
+        const auto& decoded = _decode(*connection, data, size, buffer);
+        const std::string value =
+            decoded.first ? std::string(decoded.first, decoded.second)
+                          : std::string();
         ::free(data);
         return value;
     }
 
     void takeValues(const Strings& keys, const ValueFunc& func) const final
     {
-        const auto decompress = [](memcached_result_st* fetched,
-                                       const size_t size) {
-            char* data = memcached_result_take_value(fetched);
-            if (!data)
-                return std::make_pair<char*, size_t>(nullptr, 0);
+        Lease connection(*this);
+        _multiGet(*connection, keys, [&](const size_t index,
+                                         memcached_result_st* fetched) {
+            const auto& value = _takeValue(*connection, fetched);
+            memcached_result_free(fetched);
+            if (value.first)
+                func(keys[index], value.first, value.second);
+        });
+    }
 
-#ifdef KEYV_USE_PRESSION
-            const uint64_t fullSize = *reinterpret_cast<const uint64_t*>(data);
-            char* decompressed = (char*)::malloc(fullSize);
-            _decompress((uint8_t*)decompressed, fullSize, (uint8_t*)data, size);
-            ::free(data);
-            return std::pair<char*, size_t>({decompressed, fullSize});
-#else
-            return std::pair<char*, size_t>({data, size});
-#endif
+    void getValues(const Strings& keys, const ConstValueFunc& func) const final
+    {
+        Lease connection(*this);
+        lunchbox::Bufferb buffer;
+        _multiGet(*connection, keys, [&](const size_t index,
+                                         memcached_result_st* fetched) {
+            const auto& value = _getValue(*connection, fetched, buffer);
+            if (value.first)
+                func(keys[index], value.first, value.second);
+            memcached_result_free(fetched);
+        });
+    }
+
+    void getBatch(const Strings& keys, const ConstBatchFunc func) const final
+    {
+        // Fetched results, and decompressed values, are kept until their batch
+        // has been delivered.
+        Lease connection(*this);
+        memcached_result_st* results[batchSize];
+        lunchbox::Bufferb buffers[batchSize];
+        ConstValue values[batchSize];
+        size_t size = 0;
+
+        const auto deliver = [&] {
+            func(values, size);
+            for (size_t i = 0; i < size; ++i)
+                memcached_result_free(results[i]);
+            size = 0;
         };
-        _multiGet(keys, func, decompress);
+
+        _multiGet(*connection, keys, [&](const size_t index,
+                                         memcached_result_st* fetched) {
+            const auto& value =
+                _getValue(*connection, fetched, buffers[size]);
+            if (!value.first)
+            {
+                memcached_result_free(fetched);
+                return;
+            }
+            results[size] = fetched;
+            values[size] = {index, value.first, value.second};
+            if (++size == batchSize)
+                deliver();
+        });
+        if (size > 0)
+            deliver();
     }
 
-    void getValues(const Strings& keys, const ConstValueFunc& func) const final
+    // memcached has no size query, the values are fetched but not copied or
+    // decompressed
+    void getSizes(const Strings& keys, const SizeFunc& func) const final
     {
-#ifdef KEYV_USE_PRESSION
-        lunchbox::Bufferb decompressed;
-#endif
-        const auto decompress = [&](memcached_result_st* fetched,
-                                    const size_t size) {
+        Lease connection(*this);
+        _multiGet(*connection, keys, [&](const size_t index,
+                                         memcached_result_st* fetched) {
             const char* data = memcached_result_value(fetched);
-            if (!data)
-                return std::make_pair<const char*, size_t>(nullptr, 0);
+            if (data)
+                func(index,
+                     _getSize(data, memcached_result_length(fetched)));
+            memcached_result_free(fetched);
+        });
+    }
 
-#ifdef KEYV_USE_PRESSION
-            const uint64_t fullSize = *reinterpret_cast<const uint64_t*>(data);
-            decompressed.resize(fullSize);
-            _decompress(decompressed.getData(), fullSize, (const uint8_t*)data,
-                        size);
-            return std::pair<const char*, size_t>((char*)decompressed.getData(),
-                                                  fullSize);
-#else
-            return std::pair<const char*, size_t>({data, size});
-#endif
-        };
-        _multiGet(keys, func, decompress);
+    void takeBatch(const Strings& keys, const BatchFunc func) const final
+    {
+        Lease connection(*this);
+        Value values[batchSize];
+        size_t size = 0;
+
+        _multiGet(*connection, keys, [&](const size_t index,
+                                         memcached_result_st* fetched) {
+            const auto& value = _takeValue(*connection, fetched);
+            memcached_result_free(fetched);
+            if (!value.first)
+                return;
+            values[size] = {index, value.first, value.second};
+            if (++size == batchSize)
+            {
+                func(values, size);
+                size = 0;
+            }
+        });
+        if (size > 0)
+            func(values, size);
     }
 
+    // Flushes all idle connections with buffered writes, and waits for the
+    // connections leased by other threads, which flush their writes when they
+    // are returned. The buffers are flushed without holding the pool lock.
     bool flush() final
     {
-        return memcached_flush_buffers(_instance) == MEMCACHED_SUCCESS;
+        std::unique_lock<std::mutex> lock(_mutex);
+        ++_flushes;
+        std::vector<std::pair<const Connection*, uint64_t>> leased;
+        for (const Connection* connection : _leased)
+            leased.emplace_back(connection, connection->releases);
+
+        std::vector<ConnectionPtr> dirty;
+        for (auto i = _idle.begin(); i != _idle.end();)
+        {
+            if (!(*i)->dirty)
+            {
+                ++i;
+                continue;
+            }
+            _leased.insert(i->get());
+            dirty.push_back(std::move(*i));
+            i = _idle.erase(i);
+        }
+
+        lock.unlock();
+        for (const auto& connection : dirty)
+            _flushBuffers(*connection);
+        lock.lock();
+        for (auto& connection : dirty)
+            _return(std::move(connection));
+
+        _returned.wait(lock, [&] {
+            return std::all_of(leased.begin(), leased.end(),
+                               [](const std::pair<const Connection*,
+                                                  uint64_t>& connection) {
+                                   return connection.first->releases !=
+                                          connection.second;
+                               });
+        });
+        return !_flushFailed.exchange(false);
     }
 
     void erase(const std::string& key) final
     {
+        Lease connection(*this);
         const std::string& hash = _hash(key);
-        memcached_delete(_instance, hash.c_str(), hash.length(), 0);
+        memcached_delete(connection->instance, hash.c_str(), hash.length(),
+                         0);
+        connection->dirty = true;
+    }
+
+    // memcached can't enumerate or drop keys. All keys are hashed with a
+    // generation counter stored on the server, which clear() increments: the
+    // old values are no longer found and age out of the servers' LRUs.
+    void clear() final
+    {
+        Lease connection(*this);
+        Replies replies(*connection);
+        Unreplicated unreplicated(*connection);
+        uint64_t generation = 0;
+        const memcached_return_t ret =
+            _increment(*connection, _generationKey, 1, _generation + 1,
+                       generation);
+        if (ret != MEMCACHED_SUCCESS)
+        {
+            _checkError(*connection, "memcached_increment", ret);
+            LBTHROW(std::runtime_error(
+                std::string("Clear failed: ") +
+                memcached_strerror(connection->instance, ret)));
+        }
+        _setGeneration(generation);
+    }
+
+    void erasePrefix(const std::string&) final
+    {
+        LBTHROW(std::runtime_error("memcached can't erase keys by prefix"));
     }
 
 private:
-    template <typename F, typename T>
-    void _multiGet(const Strings& keys, const F& func, const T& getFunc) const
+    // A memcached_st is not thread-safe. Each operation leases a connection
+    // cloned from _instance for its exclusive use, and returns it to the pool
+    // afterwards. The pool grows to the number of concurrent callers.
+    struct Connection
     {
+        explicit Connection(memcached_st* instance_)
+            : instance(instance_)
+        {
+        }
+        ~Connection() { memcached_free(instance); }
+        memcached_st* const instance;
+        bool dirty = false;    // has buffered fire-and-forget writes
+        uint64_t acquired = 0; // _flushes when leased
+        uint64_t releases = 0; // protected by _mutex
+#ifdef KEYV_USE_PRESSION
+        pression::data::CompressorSnappy compressor;
+#endif
+#ifdef KEYV_USE_ZSTD
+        Dictionary::Context dictionary;
+#endif
+    };
+    using ConnectionPtr = std::unique_ptr<Connection>;
+
+    class Lease
+    {
+    public:
+        explicit Lease(const Memcached& plugin)
+            : _plugin(plugin)
+            , _connection(plugin._acquire())
+            , _limited(Deadline::isSet())
+            , _pollTimeout(0)
+        {
+            if (_limited)
+                _limitPollTimeout();
+            plugin._refresh(*_connection);
+        }
+        ~Lease()
+        {
+            if (_limited)
+                memcached_behavior_set(_connection->instance,
+                                       MEMCACHED_BEHAVIOR_POLL_TIMEOUT,
+                                       _pollTimeout);
+            _plugin._release(std::move(_connection));
+        }
+        Connection& operator*() { return *_connection; }
+        Connection* operator->() { return _connection.get(); }
+    private:
+        const Memcached& _plugin;
+        ConnectionPtr _connection;
+        const bool _limited;
+        uint64_t _pollTimeout; // configured, restored on release
+
+        // Waits for the servers at most until the deadline of the operation
+        void _limitPollTimeout()
+        {
+            memcached_st* instance = _connection->instance;
+            _pollTimeout = memcached_behavior_get(
+                instance, MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+            const uint64_t remaining = std::max(
+                int64_t(1), int64_t(Deadline::getRemaining().count()));
+            memcached_behavior_set(instance, MEMCACHED_BEHAVIOR_POLL_TIMEOUT,
+                                   std::min(_pollTimeout, remaining));
+        }
+    };
+
+    // Atomic operations need the answer of the server, which fire-and-forget
+    // writes do not wait for.
+    class Replies
+    {
+    public:
+        explicit Replies(Connection& connection)
+            : _instance(connection.instance)
+        {
+            memcached_behavior_set(_instance, MEMCACHED_BEHAVIOR_NOREPLY, 0);
+        }
+        ~Replies()
+        {
+            memcached_behavior_set(_instance, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+        }
+
+    private:
+        memcached_st* const _instance;
+    };
+
+    // Reserved keys are only stored on the master server of their key: the
+    // servers do not replicate increments, and the CAS identifiers differ
+    // between replicas. A random replica read might return a stale value.
+    class Unreplicated
+    {
+    public:
+        explicit Unreplicated(Connection& connection)
+            : _instance(connection.instance)
+            , _replicas(memcached_behavior_get(
+                  _instance, MEMCACHED_BEHAVIOR_NUMBER_OF_REPLICAS))
+        {
+            if (_replicas == 0)
+                return;
+            memcached_behavior_set(_instance,
+                                   MEMCACHED_BEHAVIOR_NUMBER_OF_REPLICAS, 0);
+            memcached_behavior_set(
+                _instance, MEMCACHED_BEHAVIOR_RANDOMIZE_REPLICA_READ, 0);
+        }
+        ~Unreplicated()
+        {
+            if (_replicas == 0)
+                return;
+            memcached_behavior_set(_instance,
+                                   MEMCACHED_BEHAVIOR_NUMBER_OF_REPLICAS,
+                                   _replicas);
+            memcached_behavior_set(
+                _instance, MEMCACHED_BEHAVIOR_RANDOMIZE_REPLICA_READ, 1);
+        }
+
+    private:
+        memcached_st* const _instance;
+        const uint64_t _replicas;
+    };
+
+    // Atomic updates of user keys would only update one of the replicas
+    void _checkUnreplicated(const char* operation) const
+    {
+        if (_replicated)
+            LBTHROW(std::runtime_error(
+                std::string("memcached can't ") + operation +
+                " with replicas, the servers do not replicate it"));
+    }
+
+    // The value of a key, and its CAS identifier if the key exists
+    struct Current
+    {
+        bool found = false;
+        std::string value;
+        uint64_t cas = 0;
+    };
+
+    Current _gets(Connection& connection, const std::string& hash) const
+    {
+        Current current;
+        const char* keys[] = {hash.c_str()};
+        const size_t lengths[] = {hash.length()};
+        memcached_return_t ret =
+            memcached_mget(connection.instance, keys, lengths, 1);
+        if (!memcached_success(ret))
+        {
+            _checkError(connection, "memcached_mget", ret);
+            return current;
+        }
+
+        lunchbox::Bufferb buffer;
+        memcached_result_st* fetched;
+        while ((fetched =
+                    memcached_fetch_result(connection.instance, nullptr, &ret)))
+        {
+            if (ret == MEMCACHED_SUCCESS && !current.found)
+            {
+                const auto& value = _getValue(connection, fetched, buffer);
+                if (value.first)
+                    current.value.assign(value.first, value.second);
+                current.cas = memcached_result_cas(fetched);
+                current.found = true;
+            }
+            memcached_result_free(fetched);
+        }
+        return current;
+    }
+
+    // Replaces current if it has not changed since it was read, or adds the
+    // value if the key did not exist. Fails with MEMCACHED_DATA_EXISTS or
+    // MEMCACHED_NOTSTORED if another writer was faster.
+    memcached_return_t _store(Connection& connection, const std::string& hash,
+                              const Current& current, const void* data,
+                              const size_t size) const
+    {
+        const char* value = static_cast<const char*>(data);
+        size_t length = size;
+        lunchbox::Bufferb buffer;
+        _encode(connection, value, length, buffer);
+        if (current.found)
+            return memcached_cas(connection.instance, hash.c_str(),
+                                 hash.length(), value, length, (time_t)0,
+                                 (uint32_t)0, current.cas);
+        return memcached_add(connection.instance, hash.c_str(), hash.length(),
+                             value, length, (time_t)0, (uint32_t)0);
+    }
+
+    // Replaces the value by modify(value) in a compare-and-swap loop, for
+    // updates which the server can't apply itself
+    template <typename F>
+    memcached_return_t _update(Connection& connection, const std::string& hash,
+                               const F& modify) const
+    {
+        memcached_return_t ret = MEMCACHED_FAILURE;
+        for (size_t i = 0; i < maxRetries; ++i)
+        {
+            const Current current = _gets(connection, hash);
+            const std::string& value = modify(current.value);
+            ret = _store(connection, hash, current, value.data(), value.size());
+            if (ret != MEMCACHED_DATA_EXISTS && ret != MEMCACHED_NOTSTORED)
+                return ret;
+        }
+        return ret;
+    }
+
+    // Increments the counter at hash, or creates it with initial
+    memcached_return_t _increment(Connection& connection,
+                                  const std::string& hash,
+                                  const uint64_t delta, const uint64_t initial,
+                                  uint64_t& result) const
+    {
+        memcached_return_t ret = MEMCACHED_FAILURE;
+        for (size_t i = 0; i < maxRetries; ++i)
+        {
+            ret = memcached_increment(connection.instance, hash.c_str(),
+                                      hash.length(), delta, &result);
+            if (ret != MEMCACHED_NOTFOUND)
+                break;
+
+            // create the counter, unless another writer was faster
+            const std::string& value = std::to_string(initial);
+            ret = memcached_add(connection.instance, hash.c_str(),
+                                hash.length(), value.data(), value.size(),
+                                (time_t)0, (uint32_t)0);
+            result = initial;
+            if (ret != MEMCACHED_NOTSTORED)
+                break;
+        }
+        return ret;
+    }
+
+    // Appends to the value at hash, or creates it
+    memcached_return_t _append(Connection& connection, const std::string& hash,
+                               const void* data, const size_t size) const
+    {
+        memcached_return_t ret = MEMCACHED_FAILURE;
+        for (size_t i = 0; i < maxRetries; ++i)
+        {
+            ret = memcached_append(connection.instance, hash.c_str(),
+                                   hash.length(), (const char*)data, size,
+                                   (time_t)0, (uint32_t)0);
+            if (ret != MEMCACHED_NOTSTORED)
+                break;
+
+            // create the value, unless another writer was faster
+            ret = memcached_add(connection.instance, hash.c_str(),
+                                hash.length(), (const char*)data, size,
+                                (time_t)0, (uint32_t)0);
+            if (ret != MEMCACHED_NOTSTORED)
+                break;
+        }
+        return ret;
+    }
+
+    // Reads the unencoded value of a reserved key
+    bool _getReserved(Connection& connection, const std::string& hash,
+                      std::string& value) const
+    {
+        Unreplicated unreplicated(connection);
+        size_t size = 0;
+        uint32_t flags = 0;
+        memcached_return_t ret = MEMCACHED_SUCCESS;
+        char* data = memcached_get(connection.instance, hash.c_str(),
+                                   hash.length(), &size, &flags, &ret);
+        if (ret != MEMCACHED_SUCCESS)
+        {
+            if (ret != MEMCACHED_NOTFOUND)
+                _checkError(connection, "memcached_get", ret);
+            return false;
+        }
+        value.assign(data, size);
+        ::free(data);
+        return true;
+    }
+
+    // Reads the shared state of the namespace every generation_refresh ms
+    void _refresh(Connection& connection) const
+    {
+        const uint64_t now = _now();
+        uint64_t next = _nextRefresh;
+        if (now < next ||
+            !_nextRefresh.compare_exchange_strong(next,
+                                                  now + _generationRefresh))
+        {
+            return; // fresh, or refreshed by another thread
+        }
+
+        _refreshGeneration(connection);
+#ifdef KEYV_USE_ZSTD
+        if (_dictionary)
+            _refreshDictionary(connection);
+#endif
+    }
+
+    // An evicted generation is restored, so that cleared values stay hidden
+    void _refreshGeneration(Connection& connection) const
+    {
+        std::string value;
+        if (_getReserved(connection, _generationKey, value))
+        {
+            // the server pads decremented counters with spaces
+            while (!value.empty() && value.back() == ' ')
+                value.pop_back();
+            try
+            {
+                _setGeneration(
+                    counter::parse("generation", value.data(), value.size()));
+            }
+            catch (const std::runtime_error& e)
+            {
+                LBWARN << e.what() << std::endl;
+            }
+            return;
+        }
+
+        const uint64_t generation = _generation;
+        if (generation == 0)
+            return;
+        value = std::to_string(generation);
+        Unreplicated unreplicated(connection);
+        memcached_add(connection.instance, _generationKey.c_str(),
+                      _generationKey.length(), value.data(), value.size(),
+                      (time_t)0, (uint32_t)0);
+    }
+
+    // Generations only grow, a stale read must not resurrect cleared values
+    void _setGeneration(const uint64_t generation) const
+    {
+        uint64_t current = _generation;
+        while (current < generation &&
+               !_generation.compare_exchange_weak(current, generation))
+        {
+        }
+    }
+
+    ConnectionPtr _acquire() const
+    {
+        ConnectionPtr connection;
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_idle.empty())
+        {
+            memcached_st* clone = memcached_clone(nullptr, _instance);
+            if (!clone)
+                throw std::bad_alloc();
+            connection.reset(new Connection(clone));
+        }
+        else
+        {
+            connection = std::move(_idle.back());
+            _idle.pop_back();
+        }
+        connection->acquired = _flushes;
+        _leased.insert(connection.get());
+        return connection;
+    }
+
+    // A connection leased during a flush() flushes its writes before it can be
+    // leased again, which the waiting flush() relies on.
+    void _release(ConnectionPtr connection) const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (connection->dirty && connection->acquired != _flushes)
+        {
+            lock.unlock();
+            _flushBuffers(*connection);
+            lock.lock();
+        }
+        _return(std::move(connection));
+    }
+
+    // Puts a leased connection back into the pool, _mutex has to be locked
+    void _return(ConnectionPtr connection) const
+    {
+        ++connection->releases;
+        _leased.erase(connection.get());
+        _idle.push_back(std::move(connection));
+        _returned.notify_all();
+    }
+
+    void _flushBuffers(Connection& connection) const
+    {
+        connection.dirty = false;
+        if (memcached_flush_buffers(connection.instance) != MEMCACHED_SUCCESS)
+            _flushFailed = true;
+    }
+
+    // Fetches all keys, and calls func(index, result) for each found value
+    // with the index of its key. The callee owns and has to free the result.
+    template <typename F>
+    void _multiGet(Connection& connection, const Strings& keys,
+                   const F& func) const
+    {
+        // Sorted hashes to look up fetched keys without allocations
+        std::vector<std::pair<std::string, size_t>> hashes;
+        hashes.reserve(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i)
+            hashes.emplace_back(_hash(keys[i]), i);
+        std::sort(hashes.begin(), hashes.end());
+
         std::vector<const char*> keysArray;
         std::vector<size_t> keyLengths;
         keysArray.reserve(keys.size());
         keyLengths.reserve(keys.size());
-        std::unordered_map<std::string, std::string> hashes;
-        Strings hashCopy;
-        hashCopy.reserve(keys.size());
-
-        for (const auto& key : keys)
+        for (const auto& hash : hashes)
         {
-            const std::string& hash = _hash(key);
-            hashes[hash] = key;
-            hashCopy.push_back(hash);
-            keysArray.push_back(hashCopy.back().c_str());
-            keyLengths.push_back(hashCopy.back().length());
+            keysArray.push_back(hash.first.c_str());
+            keyLengths.push_back(hash.first.length());
         }
 
-        memcached_mget(_instance, keysArray.data(), keyLengths.data(),
-                       keysArray.size());
+        memcached_st* instance = connection.instance;
+        memcached_return ret = memcached_mget(instance, keysArray.data(),
+                                              keyLengths.data(),
+                                              keysArray.size());
+        // unreachable servers are ejected or timed out, i.e., their keys are
+        // simply missing. Only a failure of the whole request aborts.
+        if (!memcached_success(ret) && ret != MEMCACHED_SOME_ERRORS)
+        {
+            _checkError(connection, "memcached_mget", ret);
+            return;
+        }
 
-        memcached_return ret = MEMCACHED_SUCCESS;
         memcached_result_st* fetched;
-        while ((fetched = memcached_fetch_result(_instance, nullptr, &ret)))
+        while ((fetched = memcached_fetch_result(instance, nullptr, &ret)))
         {
-            if (ret == MEMCACHED_SUCCESS)
+            if (ret != MEMCACHED_SUCCESS)
             {
-                const std::string key(memcached_result_key_value(fetched),
-                                      memcached_result_key_length(fetched));
-                const size_t size = memcached_result_length(fetched);
-                const auto& result = getFunc(fetched, size);
-                func(hashes[key], result.first, result.second);
+                memcached_result_free(fetched);
+                continue;
+            }
+
+            const char* key = memcached_result_key_value(fetched);
+            const size_t length = memcached_result_key_length(fetched);
+            const auto i =
+                std::lower_bound(hashes.begin(), hashes.end(), key,
+                                 [length](
+                                     const std::pair<std::string, size_t>& a,
+                                     const char* b) {
+                                     return a.first.compare(0, a.first.size(),
+                                                            b, length) < 0;
+                                 });
+            if (i == hashes.end() ||
+                i->first.compare(0, i->first.size(), key, length) != 0)
+            {
+                memcached_result_free(fetched);
+                continue;
+            }
+            func(i->second, fetched);
+
+            // drops the outstanding values by closing the server connections
+            if (Deadline::isExpired())
+            {
+                memcached_quit(instance);
+                return;
             }
-            memcached_result_free(fetched);
         }
     }
 
+    // Warns once for each new error, to not flood the log with timeouts
+    void _checkError(Connection& connection, const char* function,
+                     const memcached_return_t ret) const
+    {
+        if (ret != MEMCACHED_SUCCESS && _lastError.exchange(ret) != ret)
+        {
+            LBWARN << function << " failed: "
+                   << memcached_strerror(connection.instance, ret)
+                   << std::endl;
+        }
+    }
+
+    // Values are stored as given, or compressed with a header
+    bool _isEncoded() const
+    {
 #ifdef KEYV_USE_PRESSION
-    lunchbox::Bufferb _compress(const void* data, const size_t size) const
+        return true;
+#elif defined(KEYV_USE_ZSTD)
+        return bool(_dictionary);
+#else
+        return false;
+#endif
+    }
+
+    // Replaces data and size by the stored form of the value, which is
+    // compressed into buffer if needed
+    void _encode(Connection& connection LB_UNUSED,
+                 const char*& data LB_UNUSED, size_t& size LB_UNUSED,
+                 lunchbox::Bufferb& buffer LB_UNUSED) const
+    {
+#ifdef KEYV_USE_ZSTD
+        if (_dictionary)
+        {
+            // the writer completing the samples trains the dictionary
+            if (_dictionary->sample(data, size))
+                _publishDictionary(connection);
+            _dictionary->compress(connection.dictionary, data, size, buffer);
+            data = (const char*)buffer.getData();
+            size = buffer.getSize();
+            return;
+        }
+#endif
+#ifdef KEYV_USE_PRESSION
+        _compress(connection, data, size, buffer);
+        data = (const char*)buffer.getData();
+        size = buffer.getSize();
+#endif
+    }
+
+    // @return the value of stored data, decompressed into buffer if needed,
+    //         or nullptr if it can't be decoded
+    std::pair<const char*, size_t> _decode(Connection& connection LB_UNUSED,
+                                           const char* data, const size_t size,
+                                           lunchbox::Bufferb& buffer
+                                               LB_UNUSED) const
     {
-        lunchbox::Bufferb compressed;
-        const auto& results = _compressor.compress((const uint8_t*)data, size);
+#ifdef KEYV_USE_ZSTD
+        if (_dictionary)
+        {
+            const size_t fullSize = Dictionary::getSize(data, size);
+            if (size < Dictionary::headerSize || fullSize > _maxValueSize)
+                return std::make_pair<const char*, size_t>(nullptr, 0);
+            if (Dictionary::getVersion(data, size) == 0) // not compressed
+                return std::pair<const char*, size_t>(
+                    data + Dictionary::headerSize, fullSize);
+
+            buffer.resize(fullSize);
+            if (!_decompress(connection, data, size, buffer.getData()))
+                return std::make_pair<const char*, size_t>(nullptr, 0);
+            return std::pair<const char*, size_t>((char*)buffer.getData(),
+                                                  fullSize);
+        }
+#endif
+#ifdef KEYV_USE_PRESSION
+        if (size < sizeof(uint64_t))
+            return std::make_pair<const char*, size_t>(nullptr, 0);
+        const uint64_t fullSize = *reinterpret_cast<const uint64_t*>(data);
+        if (fullSize > _maxValueSize)
+            return std::make_pair<const char*, size_t>(nullptr, 0);
+        buffer.resize(fullSize);
+        if (!_decompress(connection, buffer.getData(), fullSize,
+                         (const uint8_t*)data, size))
+        {
+            return std::make_pair<const char*, size_t>(nullptr, 0);
+        }
+        return std::pair<const char*, size_t>((char*)buffer.getData(),
+                                              fullSize);
+#else
+        return std::pair<const char*, size_t>({data, size});
+#endif
+    }
+
+    // @return the size of the value of stored data
+    size_t _getSize(const char* data LB_UNUSED,
+                    const size_t size LB_UNUSED) const
+    {
+#ifdef KEYV_USE_ZSTD
+        if (_dictionary)
+            return Dictionary::getSize(data, size);
+#endif
+#ifdef KEYV_USE_PRESSION
+        if (size < sizeof(uint64_t)) // not a compressed value
+            return size;
+        return *reinterpret_cast<const uint64_t*>(data);
+#else
+        return size;
+#endif
+    }
+
+    // @return the value of the result, the ownership is transferred
+    std::pair<char*, size_t> _takeValue(Connection& connection LB_UNUSED,
+                                        memcached_result_st* fetched) const
+    {
+        const size_t size = memcached_result_length(fetched);
+        char* data = memcached_result_take_value(fetched);
+        if (!data)
+            return std::make_pair<char*, size_t>(nullptr, 0);
+
+#ifdef KEYV_USE_ZSTD
+        if (_dictionary)
+        {
+            const size_t fullSize = Dictionary::getSize(data, size);
+            if (size < Dictionary::headerSize || fullSize > _maxValueSize)
+            {
+                ::free(data);
+                return std::make_pair<char*, size_t>(nullptr, 0);
+            }
+            char* decompressed = (char*)::malloc(std::max(fullSize, size_t(1)));
+            if (!decompressed)
+            {
+                ::free(data);
+                throw std::bad_alloc();
+            }
+            const bool ok = _decompress(connection, data, size, decompressed);
+            ::free(data);
+            if (ok)
+                return std::pair<char*, size_t>({decompressed, fullSize});
+            ::free(decompressed);
+            return std::make_pair<char*, size_t>(nullptr, 0);
+        }
+#endif
+#ifdef KEYV_USE_PRESSION
+        const uint64_t fullSize =
+            size < sizeof(uint64_t) ? 0
+                                    : *reinterpret_cast<const uint64_t*>(data);
+        if (size < sizeof(uint64_t) || fullSize > _maxValueSize)
+        {
+            ::free(data);
+            return std::make_pair<char*, size_t>(nullptr, 0);
+        }
+        char* decompressed = (char*)::malloc(std::max(fullSize, uint64_t(1)));
+        if (!decompressed)
+        {
+            ::free(data);
+            throw std::bad_alloc();
+        }
+        const bool ok = _decompress(connection, (uint8_t*)decompressed,
+                                    fullSize, (uint8_t*)data, size);
+        ::free(data);
+        if (ok)
+            return std::pair<char*, size_t>({decompressed, fullSize});
+        ::free(decompressed);
+        return std::make_pair<char*, size_t>(nullptr, 0);
+#else
+        return std::pair<char*, size_t>({data, size});
+#endif
+    }
+
+    // @return the value of the result, decompressed into buffer if needed
+    std::pair<const char*, size_t> _getValue(Connection& connection,
+                                             memcached_result_st* fetched,
+                                             lunchbox::Bufferb& buffer) const
+    {
+        const char* data = memcached_result_value(fetched);
+        if (!data)
+            return std::make_pair<const char*, size_t>(nullptr, 0);
+        return _decode(connection, data, memcached_result_length(fetched),
+                       buffer);
+    }
+
+#ifdef KEYV_USE_PRESSION
+    static void _compress(Connection& connection, const void* data,
+                          const size_t size, lunchbox::Bufferb& compressed)
+    {
+        const auto& results =
+            connection.compressor.compress((const uint8_t*)data, size);
         compressed.resize(sizeof(uint64_t) + // uncompressed size
                           results.size() * sizeof(uint64_t) +    // chunk sizes
                           pression::data::getDataSize(results)); // chunks
@@ -296,47 +1200,143 @@ private:
             ::memcpy(ptr, result.getData(), result.getSize());
             ptr += result.getSize();
         }
-        return compressed;
     }
 
-    void _decompress(uint8_t* decompressed, const size_t fullSize,
-                     const uint8_t* data, const size_t size) const
+    // @return false if the chunks exceed the data, e.g., of foreign values
+    static bool _decompress(Connection& connection, uint8_t* decompressed,
+                            const size_t fullSize, const uint8_t* data,
+                            const size_t size)
     {
         std::vector<std::pair<const uint8_t*, size_t>> inputs;
         for (size_t i = sizeof(uint64_t); i < size;
              i += sizeof(uint64_t) + inputs.back().second)
         {
-            const size_t chunkSize =
+            if (size - i < sizeof(uint64_t))
+                return false;
+            const uint64_t chunkSize =
                 *reinterpret_cast<const uint64_t*>(data + i);
+            if (chunkSize > size - i - sizeof(uint64_t))
+                return false;
             inputs.push_back({data + i + sizeof(uint64_t), chunkSize});
         }
-        _compressor.decompress(inputs, decompressed, fullSize);
+        connection.compressor.decompress(inputs, decompressed, fullSize);
+        return true;
     }
+#endif
 
-    // memcached has relative strict requirements on keys (no whitespace or
-    // control characters, max length). We therefore hash incoming keys and use
-    // their string representation. If we compress data, the compressor name is
-    // appended to the key to avoid name clashes.
-    std::string _hash(const std::string& key) const
+#ifdef KEYV_USE_ZSTD
+    // Decompresses a value, reading its dictionary from the servers on first
+    // use. Values of evicted dictionaries are lost.
+    bool _decompress(Connection& connection, const char* data,
+                     const size_t size, void* decompressed) const
     {
-        return lunchbox::uint128_t(
-                   _namespace +
-                   servus::make_uint128(key + _compressor.getName()))
-            .getString();
+        const Dictionary::Version version = Dictionary::getVersion(data, size);
+        if (!_dictionary->has(version) &&
+            !_loadDictionary(connection, version, false))
+        {
+            return false;
+        }
+        return _dictionary->decompress(connection.dictionary, data, size,
+                                       decompressed);
     }
-#else
-    std::string _hash(const std::string& key) const
+
+    bool _loadDictionary(Connection& connection,
+                         const Dictionary::Version version,
+                         const bool current) const
+    {
+        std::string dictionary;
+        if (!_getReserved(connection, _dictionaryKey(version), dictionary) ||
+            Dictionary::getVersion(dictionary) != version)
+        {
+            return false;
+        }
+        _dictionary->add(dictionary, current);
+        return true;
+    }
+
+    // Switches to the dictionary published last by any client
+    void _refreshDictionary(Connection& connection) const
+    {
+        std::string value;
+        if (!_getReserved(connection, _reservedKey("dictionary"), value))
+            return;
+        const Dictionary::Version version =
+            Dictionary::Version(std::strtoul(value.c_str(), nullptr, 10));
+        if (version != _dictionary->getCurrent())
+            _loadDictionary(connection, version, true);
+    }
+
+    // Trains a dictionary from the sampled values, and stores it before
+    // announcing it as the current one to all clients. Happens once in the
+    // insert completing the samples, or again if publishing failed.
+    void _publishDictionary(Connection& connection) const
+    {
+        const std::string& dictionary = _dictionary->train();
+        if (dictionary.empty())
+            return;
+
+        const Dictionary::Version version = Dictionary::getVersion(dictionary);
+        const std::string& key = _dictionaryKey(version);
+        const std::string& currentKey = _reservedKey("dictionary");
+        const std::string& current = std::to_string(version);
+
+        Replies replies(connection);
+        Unreplicated unreplicated(connection);
+        memcached_return_t ret =
+            memcached_set(connection.instance, key.c_str(), key.length(),
+                          dictionary.data(), dictionary.size(), (time_t)0,
+                          (uint32_t)0);
+        if (ret == MEMCACHED_SUCCESS)
+            ret = memcached_set(connection.instance, currentKey.c_str(),
+                                currentKey.length(), current.data(),
+                                current.size(), (time_t)0, (uint32_t)0);
+        if (ret != MEMCACHED_SUCCESS)
+        {
+            _checkError(connection, "memcached_set", ret);
+            _dictionary->restore();
+            return;
+        }
+        _dictionary->add(dictionary, true);
+    }
+
+    std::string _dictionaryKey(const Dictionary::Version version) const
     {
-        return lunchbox::uint128_t(_namespace + servus::make_uint128(key))
-            .getString();
+        return _reservedKey("dictionary." + std::to_string(version));
     }
 #endif
 
-    memcached_st* const _instance;
+    std::string _hash(const std::string& key) const
+    {
+        return memcachedHash::hash(_namespace, _generation, key,
+                                   _compressorName);
+    }
+
+    // @return the key of shared state, which is not part of any generation
+    std::string _reservedKey(const std::string& name) const
+    {
+        return memcachedHash::reserved(_namespace, name);
+    }
+
+    memcached_st* const _instance; // master, only used for cloning and flush
     const lunchbox::uint128_t _namespace;
-    memcached_return_t _lastError;
-#ifdef KEYV_USE_PRESSION
-    mutable pression::data::CompressorSnappy _compressor;
+    const std::string _generationKey;
+    const uint64_t _generationRefresh; // ms
+    mutable std::atomic<uint64_t> _generation;
+    mutable std::atomic<uint64_t> _nextRefresh; // ms
+    mutable std::atomic<memcached_return_t> _lastError;
+    const bool _replicated; // values are stored on multiple servers
+    const size_t _maxValueSize; // of decoded values
+    std::string _compressorName; // empty without compression
+#ifdef KEYV_USE_ZSTD
+    std::unique_ptr<Dictionary> _dictionary; // null unless dictionary=1
 #endif
+
+    mutable std::atomic<bool> _flushFailed; // since the last flush()
+
+    mutable std::mutex _mutex; // protects the following
+    mutable std::condition_variable _returned;
+    mutable std::vector<ConnectionPtr> _idle;
+    mutable std::unordered_set<const Connection*> _leased;
+    mutable uint64_t _flushes; // number of started flush() calls
 };
 }
@@ -0,0 +1,60 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <lunchbox/uint128_t.h>
+
+#include <cstdint>
+#include <string>
+
+namespace keyv
+{
+/**
+ * @internal Key hashing of the memcached:// plugin.
+ *
+ * memcached has relative strict requirements on keys (no whitespace or control
+ * characters, max length). Incoming keys are therefore hashed and stored under
+ * their string representation.
+ */
+namespace memcachedHash
+{
+/**
+ * @return the memcached key of a user key. The compressor name is appended to
+ *         avoid name clashes between compressed and uncompressed data, the
+ *         generation invalidates all keys of a namespace on clear().
+ */
+inline std::string hash(const lunchbox::uint128_t& ns,
+                        const uint64_t generation, const std::string& key,
+                        const std::string& compressor)
+{
+    return lunchbox::uint128_t(ns + lunchbox::uint128_t(generation, 0) +
+                               servus::make_uint128(key + compressor))
+        .getString();
+}
+
+/** @return the memcached key of shared state, not part of any generation. */
+inline std::string reserved(const lunchbox::uint128_t& ns,
+                            const std::string& name)
+{
+    return lunchbox::uint128_t(ns + servus::make_uint128("\x01keyv." + name))
+        .getString();
+}
+}
+}
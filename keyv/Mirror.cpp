@@ -0,0 +1,559 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "ChildList.h"
+#include "Deadline.h"
+#include "Query.h"
+
+#include <keyv/Plugin.h>
+
+#include <lunchbox/log.h>
+#include <lunchbox/pluginFactory.h>
+#include <lunchbox/pluginRegisterer.h>
+#include <lunchbox/threadPool.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+
+namespace keyv
+{
+class Mirror;
+
+namespace
+{
+lunchbox::PluginRegisterer<Mirror> registerer;
+using PluginFactory = lunchbox::PluginFactory<Plugin>;
+using Clock = std::chrono::steady_clock;
+const size_t batchSize = 64; // keys per hedged getValues() request
+const size_t numSamples = 1024;  // primary latencies for the hedge delay
+const size_t updateInterval = 64; // samples between hedge delay updates
+
+/** Values taken from a child, free'd unless their ownership is released. */
+struct Taken
+{
+    Taken() {}
+    Taken(Taken&&) = default;
+    Taken& operator=(Taken&&) = default;
+    ~Taken()
+    {
+        for (const auto& value : values)
+            ::free(value.data);
+    }
+
+    std::vector<Value> values; // index into the requested keys
+};
+
+/**
+ * Delivers the values of a getValues() straight from the children to the
+ * callback, without copying them. Each key is delivered by the first child
+ * answering it, and nothing is delivered once the caller has returned.
+ */
+class Delivery
+{
+public:
+    Delivery(const Strings& keys, const ConstValueFunc& func)
+        : _keys(keys)
+        , _func(func)
+        , _delivered(keys.size(), false)
+    {
+    }
+
+    void deliver(const size_t offset, const ConstValue* values,
+                 const size_t size)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_finished)
+            return;
+        for (size_t i = 0; i < size; ++i)
+        {
+            const size_t index = offset + values[i].index;
+            if (_delivered[index])
+                continue;
+            _delivered[index] = true;
+            _func(_keys[index], values[i].data, values[i].size);
+        }
+    }
+
+    void finish()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _finished = true;
+    }
+
+private:
+    std::mutex _mutex; // serializes the callbacks from the children
+    const Strings& _keys;
+    const ConstValueFunc& _func;
+    std::vector<bool> _delivered;
+    bool _finished = false;
+};
+
+/**
+ * State of one hedged request, shared with its tasks in the thread pool. Late
+ * answers after the first one find the state completed and are dropped.
+ */
+template <class T>
+struct Hedge
+{
+    std::mutex mutex;
+    std::condition_variable condition;
+    size_t launched = 0;
+    size_t started = 0; // launched requests taken from the pool queue
+    size_t failed = 0;
+    bool done = false;
+    std::chrono::steady_clock::time_point lastLaunch;
+    T result;
+    std::exception_ptr error;
+};
+template <class T>
+using HedgePtr = std::shared_ptr<Hedge<T>>;
+}
+
+/**
+ * Writes to all children, and reads from the first one, the primary. If the
+ * primary does not answer within the hedge delay, or fails, the request is
+ * also sent to the next child. The first answer is used, all children are
+ * assumed to hold the same data.
+ */
+class Mirror : public Plugin
+{
+public:
+    explicit Mirror(const servus::URI& uri)
+        : _delay(query::getDouble(uri, "delay", 5.))
+        , _percentile(query::getDouble(uri, "percentile", 0.))
+        , _samples(numSamples, float(_delay))
+        , _numSamples(0)
+    {
+        if (_percentile > 100.)
+            LBTHROW(std::runtime_error("Invalid percentile in " +
+                                       std::to_string(uri)));
+
+        const std::string filename = uri.getHost() + uri.getPath();
+        for (const auto& child : childList::read(filename))
+            _children.emplace_back(
+                PluginFactory::getInstance().create(servus::URI(child.uri)));
+
+        const size_t threads =
+            query::getUInt(uri, "threads", 4 * _children.size());
+        _pool.reset(new lunchbox::ThreadPool(std::max(threads, size_t(1))));
+    }
+
+    static bool handles(const servus::URI& uri)
+    {
+        return uri.getScheme() == "mirror";
+    }
+
+    static std::string getDescription()
+    {
+        return "mirror://path/to/child_list[?delay=ms][&percentile=P]"
+               "[&threads=N] with one child uri per line";
+    }
+
+    size_t setQueueDepth(const size_t depth) final
+    {
+        size_t result = std::numeric_limits<size_t>::max();
+        for (const auto& child : _children)
+            result = std::min(result, child->setQueueDepth(depth));
+        return result;
+    }
+
+    bool insert(const std::string& key, const void* data,
+                const size_t size) final
+    {
+        bool ok = true;
+        for (const auto& child : _children)
+            ok = child->insert(key, data, size) && ok;
+        return ok;
+    }
+
+    bool insertParts(const std::string& key, const Spans& parts) final
+    {
+        bool ok = true;
+        for (const auto& child : _children)
+            ok = child->insertParts(key, parts) && ok;
+        return ok;
+    }
+
+    // The primary decides the outcome of read-modify-writes, and its result
+    // is copied to the other children.
+    bool compareAndSwap(const std::string& key, const void* expected,
+                        const size_t expectedSize, const void* data,
+                        const size_t size) final
+    {
+        if (!_children.front()->compareAndSwap(key, expected, expectedSize,
+                                               data, size))
+        {
+            return false;
+        }
+        for (size_t i = 1; i < _children.size(); ++i)
+            _children[i]->insert(key, data, size);
+        return true;
+    }
+
+    uint64_t increment(const std::string& key, const uint64_t delta) final
+    {
+        const uint64_t result = _children.front()->increment(key, delta);
+        const std::string& value = std::to_string(result);
+        for (size_t i = 1; i < _children.size(); ++i)
+            _children[i]->insert(key, value.data(), value.size());
+        return result;
+    }
+
+    bool append(const std::string& key, const void* data,
+                const size_t size) final
+    {
+        bool ok = true;
+        for (const auto& child : _children)
+            ok = child->append(key, data, size) && ok;
+        return ok;
+    }
+
+    void erase(const std::string& key) final
+    {
+        for (const auto& child : _children)
+            child->erase(key);
+    }
+
+    void clear() final
+    {
+        for (const auto& child : _children)
+            child->clear();
+    }
+
+    void erasePrefix(const std::string& prefix) final
+    {
+        for (const auto& child : _children)
+            child->erasePrefix(prefix);
+    }
+
+    bool flush() final
+    {
+        bool ok = true;
+        for (const auto& child : _children)
+            ok = child->flush() && ok;
+        return ok;
+    }
+
+    void compact() final
+    {
+        for (const auto& child : _children)
+            child->compact();
+    }
+
+    // all children are assumed to be alike, report the primary
+    std::string getProperty(const std::string& name) const final
+    {
+        return _children.front()->getProperty(name);
+    }
+
+    std::string operator[](const std::string& key) const final
+    {
+        return _hedge<std::string>(
+            [key](const Plugin& child) { return child[key]; });
+    }
+
+    Strings getRanges(const std::string& key, const Ranges& ranges) const final
+    {
+        return _hedge<Strings>([key, ranges](const Plugin& child) {
+            return child.getRanges(key, ranges);
+        });
+    }
+
+    void getValues(const Strings& keys, const ConstValueFunc& func) const final
+    {
+        if (_children.size() == 1)
+        {
+            _children.front()->getValues(keys, func);
+            return;
+        }
+
+        const auto delivery = std::make_shared<Delivery>(keys, func);
+        try
+        {
+            _hedgeBatches<bool>(
+                keys,
+                [delivery](const Strings& batch, const size_t offset) {
+                    return [delivery, batch, offset](const Plugin& child) {
+                        child.getBatch(batch, [&](const ConstValue* values,
+                                                  const size_t size) {
+                            delivery->deliver(offset, values, size);
+                        });
+                        return true;
+                    };
+                },
+                [](const size_t, bool) {});
+        }
+        catch (...)
+        {
+            delivery->finish();
+            throw;
+        }
+        delivery->finish();
+    }
+
+    void takeValues(const Strings& keys, const ValueFunc& func) const final
+    {
+        _hedgeBatches<Taken>(
+            keys,
+            [](const Strings& batch, const size_t) {
+                return [batch](const Plugin& child) {
+                    Taken result;
+                    child.takeBatch(batch, [&](const Value* values,
+                                               const size_t size) {
+                        result.values.insert(result.values.end(), values,
+                                             values + size);
+                    });
+                    return result;
+                };
+            },
+            [&](const size_t offset, Taken&& taken) {
+                for (Value& value : taken.values)
+                {
+                    func(keys[offset + value.index], value.data, value.size);
+                    value.data = nullptr; // ownership transferred
+                }
+            });
+    }
+
+    void getSizes(const Strings& keys, const SizeFunc& func) const final
+    {
+        using Sizes = std::vector<std::pair<size_t, size_t>>; // index, size
+        const Sizes& sizes = _hedge<Sizes>([keys](const Plugin& child) {
+            Sizes result;
+            child.getSizes(keys, [&](const size_t index, const size_t size) {
+                result.emplace_back(index, size);
+            });
+            return result;
+        });
+        for (const auto& size : sizes)
+            func(size.first, size.second);
+    }
+
+    Strings getKeys(const std::string& after, const size_t maxKeys) const final
+    {
+        return _children.front()->getKeys(after, maxKeys);
+    }
+
+private:
+    std::vector<std::unique_ptr<Plugin>> _children;
+    const double _delay;      // ms
+    const double _percentile; // of primary latencies, 0 for a fixed delay
+
+    mutable std::mutex _mutex; // protects the following
+    mutable std::vector<float> _samples;
+    mutable size_t _numSamples;
+    mutable double _adaptiveDelay = 0.;
+
+    std::unique_ptr<lunchbox::ThreadPool> _pool; // last, joins before dtor
+
+    // Hedges sub-batches of keys. makeRequest(batch, offset) creates the
+    // request for the keys starting at offset, and consume(offset, result) is
+    // called in order with the first answer of each sub-batch. At most one
+    // sub-batch per pool thread is requested ahead.
+    template <class T, class M, class C>
+    void _hedgeBatches(const Strings& keys, const M& makeRequest,
+                       const C& consume) const
+    {
+        struct Batch
+        {
+            std::function<T(const Plugin&)> request;
+            HedgePtr<T> hedge;
+            size_t offset;
+        };
+        std::deque<Batch> batches;
+        const size_t window = std::max(_pool->getSize(), size_t(1));
+        const double delay = _getDelay();
+        size_t next = 0;
+        while (next < keys.size() || !batches.empty())
+        {
+            while (next < keys.size() && batches.size() < window &&
+                   !Deadline::isExpired())
+            {
+                const size_t end = std::min(next + batchSize, keys.size());
+                Batch batch{makeRequest(Strings(keys.begin() + next,
+                                                keys.begin() + end),
+                                        next),
+                            nullptr, next};
+                batch.hedge = _start(batch.request);
+                batches.push_back(std::move(batch));
+                next = end;
+            }
+            if (batches.empty())
+                return;
+
+            Batch& batch = batches.front();
+            consume(batch.offset, _wait(batch.request, batch.hedge, delay));
+            batches.pop_front();
+        }
+    }
+
+    // Sends request to the primary, and to the next child after each hedge
+    // delay or failure without an answer. The hedge delay starts when the
+    // request is taken from the pool queue. Returns the first answer, throws
+    // the last error if all children failed, or returns an empty answer at
+    // the deadline.
+    template <class T>
+    T _hedge(const std::function<T(const Plugin&)>& request) const
+    {
+        if (_children.size() == 1)
+            return request(*_children.front());
+        return _wait(request, _start(request), _getDelay());
+    }
+
+    template <class T>
+    HedgePtr<T> _start(const std::function<T(const Plugin&)>& request) const
+    {
+        const auto hedge = std::make_shared<Hedge<T>>();
+        std::lock_guard<std::mutex> lock(hedge->mutex);
+        _launch(request, hedge);
+        return hedge;
+    }
+
+    template <class T>
+    T _wait(const std::function<T(const Plugin&)>& request,
+            const HedgePtr<T>& hedge, const double delay) const
+    {
+        const auto answered = [&] {
+            return hedge->done || hedge->failed == hedge->launched;
+        };
+        const auto timeout =
+            std::chrono::microseconds(int64_t(delay * 1000.));
+
+        const bool hasDeadline = Deadline::isSet();
+        const Clock::time_point deadline = Deadline::get();
+
+        std::unique_lock<std::mutex> lock(hedge->mutex);
+        for (;;)
+        {
+            // the hedge delay runs once the last request has started
+            const size_t started = hedge->started;
+            const bool launch = started == hedge->launched &&
+                                hedge->launched < _children.size();
+            const auto wakeup = [&] {
+                return answered() || hedge->started != started;
+            };
+            if (launch || hasDeadline)
+                hedge->condition.wait_until(
+                    lock, launch ? std::min(hedge->lastLaunch + timeout,
+                                            deadline)
+                                 : deadline,
+                    wakeup);
+            else
+                hedge->condition.wait(lock, wakeup);
+
+            if (hedge->done)
+                return std::move(hedge->result);
+            if (hasDeadline && Clock::now() >= deadline)
+            {
+                hedge->done = true; // drop the late answers
+                return T();
+            }
+            if (hedge->started != started)
+                continue;
+            if (hedge->failed == hedge->launched && !launch)
+                std::rethrow_exception(hedge->error);
+            if (launch)
+                _launch(request, hedge);
+        }
+    }
+
+    // Posts request for the next child of the hedge, which must be locked.
+    // The task holds copies of the request and the hedge, since it may
+    // outlive the waiting caller.
+    template <class T>
+    void _launch(const std::function<T(const Plugin&)>& request,
+                 const HedgePtr<T>& hedge) const
+    {
+        const Plugin* plugin = _children[hedge->launched].get();
+        const bool primary = hedge->launched == 0;
+        ++hedge->launched;
+
+        const Clock::time_point deadline = Deadline::get();
+        _pool->postDetached([this, hedge, plugin, request, primary, deadline] {
+            const Deadline scope(deadline);
+            Clock::time_point start;
+            {
+                std::lock_guard<std::mutex> lock(hedge->mutex);
+                if (hedge->done)
+                    return; // answered while queued
+                start = Clock::now();
+                hedge->lastLaunch = start;
+                ++hedge->started;
+            }
+            hedge->condition.notify_all();
+            try
+            {
+                T result = request(*plugin);
+                if (primary)
+                    _addSample(start);
+
+                std::lock_guard<std::mutex> lock(hedge->mutex);
+                if (hedge->done)
+                    return; // late answer, dropped with result
+                hedge->result = std::move(result);
+                hedge->done = true;
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(hedge->mutex);
+                ++hedge->failed;
+                hedge->error = std::current_exception();
+            }
+            hedge->condition.notify_all();
+        });
+    }
+
+    double _getDelay() const
+    {
+        if (_percentile <= 0.)
+            return _delay;
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _numSamples < numSamples ? _delay : _adaptiveDelay;
+    }
+
+    // Records the latency of a primary request, and periodically updates the
+    // hedge delay to the configured percentile of the recent latencies.
+    void _addSample(const Clock::time_point& start) const
+    {
+        if (_percentile <= 0.)
+            return;
+        const float ms =
+            std::chrono::duration<float, std::milli>(Clock::now() - start)
+                .count();
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _samples[_numSamples % numSamples] = ms;
+        if (++_numSamples % updateInterval != 0 || _numSamples < numSamples)
+            return;
+
+        std::vector<float> sorted(_samples);
+        const size_t nth =
+            std::min(size_t(_percentile / 100. * numSamples), numSamples - 1);
+        std::nth_element(sorted.begin(), sorted.begin() + nth, sorted.end());
+        _adaptiveDelay = sorted[nth];
+    }
+};
+}
@@ -0,0 +1,302 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "MmapFormat.h"
+
+#include <keyv/Plugin.h>
+
+#include <lunchbox/log.h>
+#include <lunchbox/pluginRegisterer.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace keyv
+{
+class Mmap;
+
+namespace
+{
+lunchbox::PluginRegisterer<Mmap> registerer;
+const size_t batchSize = 64; // values per getBatch() and takeBatch() callback
+
+void _throw(const std::string& reason, const std::string& filename)
+{
+    LBTHROW(std::runtime_error(reason + " " + filename + ": " +
+                               ::strerror(errno)));
+}
+}
+
+/**
+ * Read-only backend serving values straight from a memory-mapped snapshot
+ * file written by MmapWriter. The page cache shares the file between all
+ * processes mapping it.
+ */
+class Mmap : public Plugin
+{
+public:
+    explicit Mmap(const servus::URI& uri)
+        : _filename(uri.getHost() + uri.getPath())
+        , _data(nullptr)
+        , _size(0)
+    {
+        const int fd = ::open(_filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            _throw("Can't open", _filename);
+
+        struct stat info;
+        if (::fstat(fd, &info) != 0)
+        {
+            ::close(fd);
+            _throw("Can't stat", _filename);
+        }
+        _size = info.st_size;
+        if (_size < sizeof(mmapFormat::Header))
+        {
+            ::close(fd);
+            LBTHROW(std::runtime_error(_filename + " is not a keyv snapshot"));
+        }
+
+        void* data = ::mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED)
+            _throw("Can't map", _filename);
+        _data = static_cast<const char*>(data);
+
+        const auto& header = _getHeader();
+        if (::memcmp(header.magic, mmapFormat::magic, sizeof(header.magic)) !=
+                0 ||
+            header.version != mmapFormat::version ||
+            header.byteOrder != mmapFormat::byteOrder ||
+            header.fileSize != _size)
+        {
+            ::munmap(const_cast<char*>(_data), _size);
+            LBTHROW(std::runtime_error(_filename +
+                                       " is not a compatible keyv snapshot"));
+        }
+        if (!_isValid(header))
+        {
+            ::munmap(const_cast<char*>(_data), _size);
+            LBTHROW(std::runtime_error(_filename +
+                                       " is a corrupt keyv snapshot"));
+        }
+
+        // the index is searched for each lookup, keep it resident
+        ::madvise(const_cast<char*>(_data), header.valuesOffset, MADV_WILLNEED);
+        _begin = reinterpret_cast<const mmapFormat::Entry*>(_data +
+                                                             sizeof(header));
+        _end = _begin + header.numEntries;
+    }
+
+    virtual ~Mmap() { ::munmap(const_cast<char*>(_data), _size); }
+    static bool handles(const servus::URI& uri)
+    {
+        return uri.getScheme() == "mmap";
+    }
+
+    static std::string getDescription() { return "mmap://path_to_snapshot"; }
+    bool insert(const std::string&, const void*, size_t) final
+    {
+        LBWARN << "Insert into read-only " << _filename << std::endl;
+        return false;
+    }
+
+    void erase(const std::string&) final
+    {
+        LBWARN << "Erase from read-only " << _filename << std::endl;
+    }
+
+    void clear() final
+    {
+        LBWARN << "Clear of read-only " << _filename << std::endl;
+    }
+
+    void erasePrefix(const std::string&) final
+    {
+        LBWARN << "Erase from read-only " << _filename << std::endl;
+    }
+
+    bool flush() final { return true; }
+    std::string operator[](const std::string& key) const final
+    {
+        const mmapFormat::Entry* entry = _find(key);
+        if (!entry)
+            return std::string();
+        const char* data = _data + entry->valueOffset;
+        return std::string(data, data + entry->valueSize);
+    }
+
+    Strings getRanges(const std::string& key, const Ranges& ranges) const final
+    {
+        Strings result(ranges.size());
+        const mmapFormat::Entry* entry = _find(key);
+        if (!entry)
+            return result;
+        for (size_t i = 0; i < ranges.size(); ++i)
+            result[i] = slice(_data + entry->valueOffset, entry->valueSize,
+                              ranges[i]);
+        return result;
+    }
+
+    void getValues(const Strings& keys, const ConstValueFunc& func) const final
+    {
+        for (const auto& key : keys)
+        {
+            const mmapFormat::Entry* entry = _find(key);
+            if (entry)
+                func(key, _data + entry->valueOffset, entry->valueSize);
+        }
+    }
+
+    void takeValues(const Strings& keys, const ValueFunc& func) const final
+    {
+        for (const auto& key : keys)
+        {
+            const mmapFormat::Entry* entry = _find(key);
+            if (!entry)
+                continue;
+            char* copy = (char*)malloc(entry->valueSize);
+            if (!copy)
+                throw std::bad_alloc();
+            ::memcpy(copy, _data + entry->valueOffset, entry->valueSize);
+            func(key, copy, entry->valueSize);
+        }
+    }
+
+    void getSizes(const Strings& keys, const SizeFunc& func) const final
+    {
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            const mmapFormat::Entry* entry = _find(keys[i]);
+            if (entry)
+                func(i, entry->valueSize);
+        }
+    }
+
+    void getBatch(const Strings& keys, const ConstBatchFunc func) const final
+    {
+        ConstValue values[batchSize];
+        size_t size = 0;
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            const mmapFormat::Entry* entry = _find(keys[i]);
+            if (!entry)
+                continue;
+
+            values[size] = {i, _data + entry->valueOffset, entry->valueSize};
+            if (++size == batchSize)
+            {
+                func(values, size);
+                size = 0;
+            }
+        }
+        if (size > 0)
+            func(values, size);
+    }
+
+    // enumerates in index order, i.e., by key hash
+    Strings getKeys(const std::string& after, const size_t maxKeys) const final
+    {
+        const mmapFormat::Entry* entry = _begin;
+        if (!after.empty())
+        {
+            entry = _find(after);
+            if (!entry)
+                LBTHROW(std::runtime_error("Unknown key to continue after"));
+            ++entry;
+        }
+
+        Strings keys;
+        for (; entry != _end && keys.size() < maxKeys; ++entry)
+            keys.emplace_back(_data + entry->keyOffset, entry->keySize);
+        return keys;
+    }
+
+private:
+    const std::string _filename;
+    const char* _data;
+    size_t _size;
+    const mmapFormat::Entry* _begin;
+    const mmapFormat::Entry* _end;
+
+    const mmapFormat::Header& _getHeader() const
+    {
+        return *reinterpret_cast<const mmapFormat::Header*>(_data);
+    }
+
+    // @return true if all sections and index entries lie within the file
+    bool _isValid(const mmapFormat::Header& header) const
+    {
+        const uint64_t maxEntries =
+            (_size - sizeof(header)) / sizeof(mmapFormat::Entry);
+        if (header.numEntries > maxEntries ||
+            header.keysOffset !=
+                sizeof(header) +
+                    header.numEntries * sizeof(mmapFormat::Entry) ||
+            header.valuesOffset < header.keysOffset ||
+            header.valuesOffset > _size)
+        {
+            return false;
+        }
+
+        const auto* entries = reinterpret_cast<const mmapFormat::Entry*>(
+            _data + sizeof(header));
+        for (uint64_t i = 0; i < header.numEntries; ++i)
+        {
+            const mmapFormat::Entry& entry = entries[i];
+            if (entry.keyOffset < header.keysOffset ||
+                entry.keyOffset > header.valuesOffset ||
+                entry.keySize > header.valuesOffset - entry.keyOffset ||
+                entry.valueOffset < header.valuesOffset ||
+                entry.valueOffset > _size ||
+                entry.valueSize > _size - entry.valueOffset)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const mmapFormat::Entry* _find(const std::string& key) const
+    {
+        const uint64_t hash = mmapFormat::hash(key);
+        const mmapFormat::Entry* entry = std::lower_bound(
+            _begin, _end, hash,
+            [](const mmapFormat::Entry& a, const uint64_t b) {
+                return a.hash < b;
+            });
+
+        for (; entry != _end && entry->hash == hash; ++entry)
+        {
+            if (entry->keySize == key.size() &&
+                ::memcmp(_data + entry->keyOffset, key.data(), key.size()) ==
+                    0)
+            {
+                return entry;
+            }
+        }
+        return nullptr;
+    }
+};
+}
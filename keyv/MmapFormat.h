@@ -0,0 +1,79 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <lunchbox/uint128_t.h>
+
+#include <cstdint>
+#include <string>
+
+namespace keyv
+{
+/**
+ * @internal File layout of immutable snapshots, written by MmapWriter and
+ * served by the mmap:// plugin:
+ *
+ * | MmapHeader | MmapEntry[numEntries] | keys | padding | values |
+ *
+ * Entries are sorted by key hash, and then by key. The value section starts
+ * on a page boundary. Values of at least one page are page-aligned, smaller
+ * values are aligned to valueAlignment. All offsets are from the start of
+ * the file, and all integers are in host byte order.
+ */
+namespace mmapFormat
+{
+const char magic[8] = {'K', 'E', 'Y', 'V', 'M', 'A', 'P', '\0'};
+const uint32_t version = 1;
+const uint32_t byteOrder = 0x01020304;
+const size_t pageSize = 4096;
+const size_t valueAlignment = 16;
+
+struct Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t numEntries;
+    uint64_t keysOffset;
+    uint64_t valuesOffset;
+    uint64_t fileSize;
+};
+
+struct Entry
+{
+    uint64_t hash;
+    uint64_t keyOffset;
+    uint64_t keySize;
+    uint64_t valueOffset;
+    uint64_t valueSize;
+};
+
+inline uint64_t hash(const std::string& key)
+{
+    return lunchbox::make_uint128(key).low();
+}
+
+inline uint64_t align(const uint64_t offset, const uint64_t size)
+{
+    const uint64_t alignment = size >= pageSize ? pageSize : valueAlignment;
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+}
+}
@@ -0,0 +1,284 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "MmapWriter.h"
+
+#include "Map.h"
+#include "MmapFormat.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace keyv
+{
+namespace
+{
+const size_t fetchSize = 1024; // keys per Map::fetch() in insert( map, keys )
+const char zeros[mmapFormat::pageSize] = {};
+const size_t copySize = 1 << 20; // bytes per read when compacting values
+
+// Flushes a file, or a directory entry, to disk. std::ofstream can't.
+bool _sync(const std::string& name)
+{
+    const int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    const bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+}
+
+std::string _getDirectory(const std::string& filename)
+{
+    const size_t slash = filename.rfind('/');
+    if (slash == std::string::npos)
+        return ".";
+    return slash == 0 ? "/" : filename.substr(0, slash);
+}
+}
+
+class MmapWriter::Impl
+{
+public:
+    struct Value
+    {
+        uint64_t offset; // in values section
+        uint64_t size;
+    };
+    using Moved = std::pair<uint64_t, Value*>; // old offset, new layout
+
+
+    explicit Impl(const std::string& filename_)
+        : filename(filename_)
+        , valuesName(filename_ + ".values.tmp")
+        , values(valuesName, std::ios::binary | std::ios::trunc)
+        , size(0)
+        , started(false)
+        , committed(false)
+    {
+        if (!values)
+            throw std::runtime_error("Can't create " + valuesName);
+    }
+
+    ~Impl()
+    {
+        values.close();
+        ::remove(valuesName.c_str());
+    }
+
+    void insert(const std::string& key, const void* data, const uint64_t size_)
+    {
+        if (started)
+            throw std::runtime_error("Insert into committed " + filename);
+
+        const uint64_t offset = mmapFormat::align(size, size_);
+        values.write(zeros, offset - size);
+        values.write(static_cast<const char*>(data), size_);
+        if (!values)
+            throw std::runtime_error("Write to " + valuesName + " failed");
+
+        size = offset + size_;
+        entries[key] = Value{offset, size_};
+    }
+
+    void commit()
+    {
+        if (committed)
+            return;
+        // the layout below is computed in place, a failed commit can't be
+        // retried
+        if (started)
+            throw std::runtime_error("Earlier commit of " + filename +
+                                     " failed");
+        started = true;
+        values.close();
+
+        // sort by hash and key, compute layout
+        using Sorted = std::pair<uint64_t, const std::string*>;
+        std::vector<Sorted> sorted;
+        sorted.reserve(entries.size());
+        uint64_t keysSize = 0;
+        for (const auto& entry : entries)
+        {
+            sorted.emplace_back(mmapFormat::hash(entry.first), &entry.first);
+            keysSize += entry.first.size();
+        }
+        std::sort(sorted.begin(), sorted.end(),
+                  [](const Sorted& a, const Sorted& b) {
+                      return a.first < b.first ||
+                             (a.first == b.first && *a.second < *b.second);
+                  });
+
+        mmapFormat::Header header;
+        ::memcpy(header.magic, mmapFormat::magic, sizeof(header.magic));
+        header.version = mmapFormat::version;
+        header.byteOrder = mmapFormat::byteOrder;
+        header.numEntries = sorted.size();
+        header.keysOffset =
+            sizeof(header) + sorted.size() * sizeof(mmapFormat::Entry);
+        header.valuesOffset =
+            (header.keysOffset + keysSize + mmapFormat::pageSize - 1) &
+            ~uint64_t(mmapFormat::pageSize - 1);
+
+        // values of re-inserted keys are dropped, the others are packed in
+        // their insertion order
+        std::vector<Moved> moved;
+        moved.reserve(entries.size());
+        for (auto& entry : entries)
+            moved.emplace_back(entry.second.offset, &entry.second);
+        std::sort(moved.begin(), moved.end(),
+                  [](const Moved& a, const Moved& b) {
+                      return a.first < b.first;
+                  });
+        uint64_t valuesSize = 0;
+        bool relocated = false;
+        for (const auto& i : moved)
+        {
+            i.second->offset = mmapFormat::align(valuesSize, i.second->size);
+            valuesSize = i.second->offset + i.second->size;
+            relocated = relocated || i.second->offset != i.first;
+        }
+        header.fileSize = header.valuesOffset + valuesSize;
+
+        // write header, index, keys and values to a temporary file
+        const std::string tmpName = filename + ".tmp";
+        std::ofstream file(tmpName, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        uint64_t keyOffset = header.keysOffset;
+        for (const auto& i : sorted)
+        {
+            const Value& value = entries[*i.second];
+            const mmapFormat::Entry entry{i.first, keyOffset, i.second->size(),
+                                          header.valuesOffset + value.offset,
+                                          value.size};
+            file.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+            keyOffset += i.second->size();
+        }
+        for (const auto& i : sorted)
+            file.write(i.second->data(), i.second->size());
+        file.write(zeros, header.valuesOffset - keyOffset);
+
+        if (!relocated)
+        {
+            if (size > 0)
+            {
+                std::ifstream input(valuesName, std::ios::binary);
+                file << input.rdbuf();
+            }
+        }
+        else
+            _copyValues(moved, file);
+        file.close();
+        if (!file || !_sync(tmpName))
+        {
+            ::remove(tmpName.c_str());
+            throw std::runtime_error("Write of " + tmpName + " failed");
+        }
+
+        if (::rename(tmpName.c_str(), filename.c_str()) != 0)
+        {
+            ::remove(tmpName.c_str());
+            throw std::runtime_error("Can't rename " + tmpName + " to " +
+                                     filename + ": " + ::strerror(errno));
+        }
+        committed = true;
+        if (!_sync(_getDirectory(filename)))
+            throw std::runtime_error("Can't sync the directory of " +
+                                     filename + ": " + ::strerror(errno));
+    }
+
+    void _copyValues(const std::vector<Moved>& moved, std::ofstream& file)
+    {
+        std::ifstream input(valuesName, std::ios::binary);
+        std::vector<char> buffer(copySize);
+        uint64_t written = 0;
+        for (const auto& i : moved)
+        {
+            const Value& value = *i.second;
+            file.write(zeros, value.offset - written);
+            input.seekg(i.first);
+            for (uint64_t done = 0; done < value.size;)
+            {
+                const size_t chunk = std::min(value.size - done,
+                                              uint64_t(buffer.size()));
+                input.read(buffer.data(), chunk);
+                file.write(buffer.data(), chunk);
+                done += chunk;
+            }
+            written = value.offset + value.size;
+        }
+        if (!input)
+            file.setstate(std::ios::failbit);
+    }
+
+    const std::string filename;
+    const std::string valuesName;
+    std::ofstream values;
+    uint64_t size; // of values section
+    std::unordered_map<std::string, Value> entries;
+    bool started;   // by commit(), no more inserts
+    bool committed; // the snapshot is in place
+};
+
+MmapWriter::MmapWriter(const std::string& filename)
+    : _impl(new Impl(filename))
+{
+}
+
+MmapWriter::~MmapWriter()
+{
+}
+
+void MmapWriter::insert(const std::string& key, const void* data,
+                        const size_t size)
+{
+    _impl->insert(key, data, size);
+}
+
+size_t MmapWriter::insert(const Map& map, const Strings& keys)
+{
+    size_t numValues = 0;
+    for (size_t i = 0; i < keys.size(); i += fetchSize)
+    {
+        const size_t end = std::min(i + fetchSize, keys.size());
+        const Strings batch(keys.begin() + i, keys.begin() + end);
+        const Values& values = map.fetch(batch);
+        for (size_t j = 0; j < values.size(); ++j)
+        {
+            if (!values.isFound(j))
+                continue;
+            _impl->insert(batch[j], values[j].data, values[j].size);
+            ++numValues;
+        }
+    }
+    return numValues;
+}
+
+void MmapWriter::commit()
+{
+    _impl->commit();
+}
+}
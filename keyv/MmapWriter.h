@@ -0,0 +1,102 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KEYV_MMAPWRITER_H
+#define KEYV_MMAPWRITER_H
+
+#include <keyv/api.h>
+#include <keyv/types.h>
+
+#include <memory>
+#include <string>
+
+namespace keyv
+{
+/**
+ * Writes an immutable snapshot file served by the mmap:// backend.
+ *
+ * Values are streamed to a temporary file while inserting, and the final file
+ * with its sorted index is written by commit(). The file is replaced
+ * atomically, so that readers never see a partially written snapshot.
+ *
+ * Example:
+ * @code
+ * keyv::MmapWriter writer("/data/volume.keyv");
+ * writer.insert(keyv::Map(servus::URI("leveldb:///volume")), keys);
+ * writer.commit();
+ * keyv::Map snapshot(servus::URI("mmap:///data/volume.keyv"));
+ * @endcode
+ */
+class MmapWriter
+{
+public:
+    /**
+     * Start writing a new snapshot.
+     *
+     * @param filename the destination of the snapshot file.
+     * @throw std::runtime_error if the temporary files can't be created.
+     * @version 1.2
+     */
+    KEYV_API explicit MmapWriter(const std::string& filename);
+
+    /** Discard all uncommitted values. @version 1.2 */
+    KEYV_API ~MmapWriter();
+
+    /**
+     * Insert or update a value in the snapshot.
+     *
+     * The previous value of an updated key stays in the temporary file until
+     * commit(), which only writes the latest values.
+     * @throw std::runtime_error if the value can't be written.
+     * @version 1.2
+     */
+    KEYV_API void insert(const std::string& key, const void* data,
+                         size_t size);
+
+    /**
+     * Insert the values of the given keys from a map.
+     *
+     * @param map the source store.
+     * @param keys the keys to copy, missing keys are ignored.
+     * @return the number of copied values.
+     * @version 1.2
+     */
+    KEYV_API size_t insert(const Map& map, const Strings& keys);
+
+    /**
+     * Write the snapshot file.
+     *
+     * The file is synced to disk before it replaces an existing snapshot.
+     * Further calls after a successful commit() do nothing.
+     * @throw std::runtime_error if the file can't be written, also by all
+     *        further calls after a failed commit().
+     * @version 1.2
+     */
+    KEYV_API void commit();
+
+private:
+    MmapWriter(const MmapWriter&) = delete;
+    MmapWriter& operator=(const MmapWriter&) = delete;
+
+    class Impl;
+    std::unique_ptr<Impl> _impl;
+};
+}
+
+#endif // KEYV_MMAPWRITER_H
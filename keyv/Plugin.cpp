@@ -0,0 +1,212 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Plugin.h"
+#include "Counter.h"
+
+#include <lunchbox/debug.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace keyv
+{
+namespace
+{
+const size_t numStripes = 64; // locks for the default read-modify-writes
+const size_t erasesPerBatch = 1024; // keys enumerated by erasePrefix()
+
+// Maps a key passed to a value callback back to its index in keys. Plugins
+// passing a reference into keys are resolved without a lookup.
+class KeyIndex
+{
+public:
+    explicit KeyIndex(const Strings& keys)
+        : _keys(keys)
+    {
+    }
+
+    size_t operator()(const std::string& key)
+    {
+        const std::less<const std::string*> less;
+        const std::string* const begin = _keys.data();
+        if (!less(&key, begin) && less(&key, begin + _keys.size()))
+            return &key - begin;
+
+        if (_index.empty())
+            for (size_t i = 0; i < _keys.size(); ++i)
+                _index.emplace(_keys[i], i);
+        const auto i = _index.find(key);
+        if (i == _index.end())
+            throw std::runtime_error("Plugin returned value for unknown key " +
+                                     key);
+        return i->second;
+    }
+
+private:
+    const Strings& _keys;
+    std::unordered_map<std::string, size_t> _index;
+};
+}
+
+Strings Plugin::getKeys(const std::string&, size_t) const
+{
+    throw std::runtime_error(lunchbox::className(*this) +
+                             " can't enumerate keys");
+}
+
+void Plugin::getBatch(const Strings& keys, ConstBatchFunc func) const
+{
+    KeyIndex index(keys);
+    getValues(keys, [&](const std::string& key, const char* data,
+                        const size_t size) {
+        const ConstValue value{index(key), data, size};
+        func(&value, 1);
+    });
+}
+
+void Plugin::takeBatch(const Strings& keys, BatchFunc func) const
+{
+    KeyIndex index(keys);
+    takeValues(keys, [&](const std::string& key, char* data,
+                         const size_t size) {
+        size_t i = 0;
+        try
+        {
+            i = index(key);
+        }
+        catch (...)
+        {
+            ::free(data);
+            throw;
+        }
+        const Value value{i, data, size};
+        func(&value, 1);
+    });
+}
+
+void Plugin::clear()
+{
+    erasePrefix(std::string());
+}
+
+void Plugin::erasePrefix(const std::string& prefix)
+{
+    // getKeys() skips the prefix itself, which therefore is erased separately
+    erase(prefix);
+    std::string after = prefix;
+    for (;;)
+    {
+        const Strings& keys = getKeys(after, erasesPerBatch);
+        if (keys.empty())
+            return;
+        for (const auto& key : keys)
+        {
+            if (key.compare(0, prefix.size(), prefix) != 0)
+                return;
+            erase(key);
+        }
+        after = keys.back();
+    }
+}
+
+bool Plugin::insertParts(const std::string& key, const Spans& parts)
+{
+    std::string value;
+    for (const auto& part : parts)
+        value.append(static_cast<const char*>(part.data), part.size);
+    return insert(key, value.data(), value.size());
+}
+
+Strings Plugin::getRanges(const std::string& key, const Ranges& ranges) const
+{
+    const std::string& value = (*this)[key];
+    Strings result;
+    result.reserve(ranges.size());
+    for (const auto& range : ranges)
+        result.push_back(slice(value.data(), value.size(), range));
+    return result;
+}
+
+void Plugin::getSizes(const Strings& keys, const SizeFunc& func) const
+{
+    getBatch(keys, [&func](const ConstValue* values, const size_t size) {
+        for (size_t i = 0; i < size; ++i)
+            func(values[i].index, values[i].size);
+    });
+}
+
+std::string Plugin::slice(const char* data, const size_t size,
+                          const Range& range)
+{
+    if (range.offset >= size)
+        return std::string();
+    const char* begin = data + range.offset;
+    return std::string(begin, begin + std::min(uint64_t(range.size),
+                                               size - range.offset));
+}
+
+std::mutex& Plugin::getLock(const std::string& key)
+{
+    static std::mutex stripes[numStripes];
+    const size_t hash =
+        std::hash<std::string>()(key) ^ std::hash<const void*>()(this);
+    return stripes[hash % numStripes];
+}
+
+bool Plugin::compareAndSwap(const std::string& key, const void* expected,
+                            const size_t expectedSize, const void* data,
+                            const size_t size)
+{
+    std::lock_guard<std::mutex> lock(getLock(key));
+    const std::string& value = (*this)[key];
+    if (value.size() != expectedSize ||
+        (expectedSize > 0 &&
+         ::memcmp(value.data(), expected, expectedSize) != 0))
+    {
+        return false;
+    }
+    return insert(key, data, size);
+}
+
+uint64_t Plugin::increment(const std::string& key, const uint64_t delta)
+{
+    std::lock_guard<std::mutex> lock(getLock(key));
+    const std::string& value = (*this)[key];
+    const uint64_t result =
+        counter::parse(key, value.data(), value.size()) + delta;
+    const std::string& string = std::to_string(result);
+    if (!insert(key, string.data(), string.size()))
+        throw std::runtime_error("Increment of " + key + " failed");
+    return result;
+}
+
+bool Plugin::append(const std::string& key, const void* data,
+                    const size_t size)
+{
+    std::lock_guard<std::mutex> lock(getLock(key));
+    std::string value = (*this)[key];
+    value.append(static_cast<const char*>(data), size);
+    return insert(key, value.data(), value.size());
+}
+}
@@ -19,12 +19,15 @@
 
 #pragma once
 
+#include <keyv/api.h>
 #include <keyv/types.h>
 
 #include <servus/uri.h>
 
 #include <lunchbox/compiler.h>
 
+#include <mutex>
+
 namespace keyv
 {
 /** Interface for all Map plugins */
@@ -45,12 +48,44 @@ public:
     virtual bool insert(const std::string& key, const void* data,
                         size_t size) = 0;
 
+    /**
+     * @copydoc Map::insert(const std::string&,const Spans&)
+     *
+     * The default implementation concatenates the parts.
+     */
+    KEYV_API virtual bool insertParts(const std::string& key,
+                                      const Spans& parts);
+
     /** @copydoc Map::erase */
     virtual void erase(const std::string& key) = 0;
 
+    /**
+     * @copydoc Map::clear
+     *
+     * The default implementation calls erasePrefix() with an empty prefix.
+     */
+    KEYV_API virtual void clear();
+
+    /**
+     * @copydoc Map::erasePrefix
+     *
+     * The default implementation erases the keys returned by getKeys(), which
+     * have to be enumerated in key order.
+     */
+    KEYV_API virtual void erasePrefix(const std::string& prefix);
+
     /** @copydoc Map::flush */
     virtual bool flush() = 0;
 
+    /** @copydoc Map::compact */
+    virtual void compact() {}
+
+    /** @copydoc Map::getProperty */
+    virtual std::string getProperty(const std::string& name LB_UNUSED) const
+    {
+        return std::string();
+    }
+
     /** @copydoc Map::operator[] */
     virtual std::string operator[](const std::string& key) const = 0;
 
@@ -62,6 +97,92 @@ public:
     virtual void takeValues(const Strings& keys,
                             const ValueFunc& func) const = 0;
 
+    /**
+     * @copydoc Map::compareAndSwap
+     *
+     * The default implementation reads, compares and inserts the value under
+     * getLock().
+     */
+    KEYV_API virtual bool compareAndSwap(const std::string& key,
+                                         const void* expected,
+                                         size_t expectedSize, const void* data,
+                                         size_t size);
+
+    /**
+     * @copydoc Map::increment
+     *
+     * The default implementation reads, increments and inserts the value
+     * under getLock().
+     */
+    KEYV_API virtual uint64_t increment(const std::string& key,
+                                        uint64_t delta);
+
+    /**
+     * @copydoc Map::append
+     *
+     * The default implementation reads, extends and inserts the value under
+     * getLock().
+     */
+    KEYV_API virtual bool append(const std::string& key, const void* data,
+                                 size_t size);
+
+    /**
+     * @copydoc Map::getKeys
+     *
+     * The default implementation throws std::runtime_error.
+     */
+    KEYV_API virtual Strings getKeys(const std::string& after,
+                                     size_t maxKeys) const;
+
+    /**
+     * Retrieve values and call back with batches of found values.
+     *
+     * Each value is identified by the index of its key in keys. The data is
+     * only valid during the callback. The default implementation uses
+     * getValues() and calls back once per value.
+     */
+    KEYV_API virtual void getBatch(const Strings& keys,
+                                   ConstBatchFunc func) const;
+
+    /**
+     * Retrieve values and call back with batches of found values.
+     *
+     * Each value is identified by the index of its key in keys. The ownership
+     * of the data is transferred, it has to be free'd by the caller. The
+     * default implementation uses takeValues() and calls back once per value.
+     */
+    KEYV_API virtual void takeBatch(const Strings& keys, BatchFunc func) const;
+
+    /**
+     * @copydoc Map::getRanges
+     *
+     * The default implementation reads the full value and slices it.
+     */
+    KEYV_API virtual Strings getRanges(const std::string& key,
+                                       const Ranges& ranges) const;
+
+    /**
+     * @copydoc Map::sizes
+     *
+     * The default implementation uses getBatch(), i.e., reads the values.
+     */
+    KEYV_API virtual void getSizes(const Strings& keys,
+                                   const SizeFunc& func) const;
+
+    /**
+     * @return the process-local lock serializing read-modify-writes of the
+     *         key, e.g., by the default compareAndSwap(). Plugins sharing a
+     *         store between instances return a lock of the store, so that
+     *         all maps on it exclude each other. The default implementation
+     *         returns a lock of this instance.
+     */
+    KEYV_API virtual std::mutex& getLock(const std::string& key);
+
+protected:
+    /** @return the part of the value in range, clamped to the value. */
+    KEYV_API static std::string slice(const char* data, size_t size,
+                                      const Range& range);
+
 private:
     Plugin(const Plugin&) = delete;
     Plugin(Plugin&&) = delete;
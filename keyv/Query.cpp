@@ -0,0 +1,103 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Query.h"
+
+#include <lunchbox/log.h>
+
+#include <stdexcept>
+
+namespace keyv
+{
+namespace query
+{
+namespace
+{
+void _throw(const servus::URI& uri, const std::string& name,
+            const std::string& value)
+{
+    LBTHROW(std::runtime_error("Invalid value '" + value + "' for " + name +
+                               " in " + std::to_string(uri)));
+}
+
+// @return the value parsed by parse(value, end), which sets end to the end
+// of the parsed characters
+template <class T, class F>
+T _get(const servus::URI& uri, const std::string& name, const T def,
+       const F& parse)
+{
+    const auto i = uri.findQuery(name);
+    if (i == uri.queryEnd())
+        return def;
+
+    const std::string& value = i->second;
+    if (value.empty() || value[0] == '-')
+        _throw(uri, name, value);
+    try
+    {
+        size_t end = 0;
+        const T result = parse(value, end);
+        if (end == value.size())
+            return result;
+    }
+    catch (const std::logic_error&)
+    {
+    }
+    _throw(uri, name, value);
+    return def;
+}
+}
+
+uint64_t getUInt(const servus::URI& uri, const std::string& name,
+                 const uint64_t def)
+{
+    return _get(uri, name, def, [](const std::string& value, size_t& end) {
+        return uint64_t(std::stoull(value, &end));
+    });
+}
+
+double getDouble(const servus::URI& uri, const std::string& name,
+                 const double def)
+{
+    return _get(uri, name, def, [](const std::string& value, size_t& end) {
+        return std::stod(value, &end);
+    });
+}
+
+uint64_t getSize(const servus::URI& uri, const std::string& name,
+                 const uint64_t def)
+{
+    return _get(uri, name, def, [](const std::string& value, size_t& end) {
+        const uint64_t size = std::stoull(value, &end);
+        const std::string unit = value.substr(end);
+        const char* const units[] = {"B", "KB", "MB", "GB", "TB"};
+        const char* const shortUnits[] = {"", "K", "M", "G", "T"};
+        for (size_t i = 0; i < 5; ++i)
+        {
+            if (unit == units[i] || unit == shortUnits[i])
+            {
+                end = value.size();
+                return size << (10 * i);
+            }
+        }
+        return size; // end points to the unknown unit
+    });
+}
+}
+}
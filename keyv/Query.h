@@ -0,0 +1,51 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <servus/uri.h>
+
+#include <cstdint>
+#include <string>
+
+namespace keyv
+{
+/**
+ * @internal Parsing of numeric URI query values for the plugins.
+ *
+ * All functions return the given default if the query is not set, and throw
+ * std::runtime_error if its value is invalid.
+ */
+namespace query
+{
+/** @return the non-negative integer value of the given query. */
+uint64_t getUInt(const servus::URI& uri, const std::string& name,
+                 uint64_t def);
+
+/** @return the non-negative floating point value of the given query. */
+double getDouble(const servus::URI& uri, const std::string& name, double def);
+
+/**
+ * @return the size in bytes of the given query, with an optional B, KB, MB,
+ *         GB or TB suffix.
+ */
+uint64_t getSize(const servus::URI& uri, const std::string& name,
+                 uint64_t def);
+}
+}
@@ -0,0 +1,392 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "ChildList.h"
+#include "Deadline.h"
+
+#include <keyv/Plugin.h>
+
+#include <lunchbox/log.h>
+#include <lunchbox/pluginFactory.h>
+#include <lunchbox/pluginRegisterer.h>
+#include <lunchbox/threadPool.h>
+#include <servus/uint128_t.h>
+
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <mutex>
+
+namespace keyv
+{
+class Shard;
+
+namespace
+{
+lunchbox::PluginRegisterer<Shard> registerer;
+using PluginFactory = lunchbox::PluginFactory<Plugin>;
+const size_t virtualNodes = 128; // hash ring points per unit of weight
+
+uint64_t _hash(const std::string& string)
+{
+    return servus::make_uint128(string).low();
+}
+}
+
+/**
+ * Partitions the keys over a set of child stores.
+ *
+ * The children are listed in the file given by the URI. Keys are routed by
+ * consistent hashing on a ring of virtual nodes, so that changing the set of
+ * children only moves the keys of the changed children. Reads of many keys
+ * fan out to all involved children in parallel.
+ */
+class Shard : public Plugin
+{
+public:
+    explicit Shard(const servus::URI& uri)
+    {
+        const std::string filename = uri.getHost() + uri.getPath();
+        for (const auto& child : childList::read(filename))
+        {
+            _children.emplace_back(
+                PluginFactory::getInstance().create(servus::URI(child.uri)));
+
+            // The ring points are derived from the child URI, not its
+            // position, so reordering the list does not move any keys.
+            const size_t points =
+                std::max(size_t(1), size_t(child.weight * virtualNodes + .5));
+            for (size_t i = 0; i < points; ++i)
+                _ring.emplace_back(_hash(child.uri + "#" + std::to_string(i)),
+                                   _children.size() - 1);
+        }
+        std::sort(_ring.begin(), _ring.end());
+
+        if (_children.size() > 1)
+            _pool.reset(new lunchbox::ThreadPool(_children.size()));
+    }
+
+    static bool handles(const servus::URI& uri)
+    {
+        return uri.getScheme() == "shard";
+    }
+
+    static std::string getDescription()
+    {
+        return "shard://path/to/shard_list with one 'uri [weight]' per line";
+    }
+
+    // Each write goes to one child, which queues it if it supports queueing
+    size_t setQueueDepth(const size_t depth) final
+    {
+        size_t result = 0;
+        for (const auto& child : _children)
+            result = std::max(result, child->setQueueDepth(depth));
+        return result;
+    }
+
+    bool insert(const std::string& key, const void* data,
+                const size_t size) final
+    {
+        return _route(key).insert(key, data, size);
+    }
+
+    bool insertParts(const std::string& key, const Spans& parts) final
+    {
+        return _route(key).insertParts(key, parts);
+    }
+
+    bool compareAndSwap(const std::string& key, const void* expected,
+                        const size_t expectedSize, const void* data,
+                        const size_t size) final
+    {
+        return _route(key).compareAndSwap(key, expected, expectedSize, data,
+                                          size);
+    }
+
+    uint64_t increment(const std::string& key, const uint64_t delta) final
+    {
+        return _route(key).increment(key, delta);
+    }
+
+    bool append(const std::string& key, const void* data,
+                const size_t size) final
+    {
+        return _route(key).append(key, data, size);
+    }
+
+    void erase(const std::string& key) final { _route(key).erase(key); }
+    void clear() final
+    {
+        _fanOut(_all(), [&](const size_t i) { _children[i]->clear(); });
+    }
+
+    void erasePrefix(const std::string& prefix) final
+    {
+        _fanOut(_all(),
+                [&](const size_t i) { _children[i]->erasePrefix(prefix); });
+    }
+
+    bool flush() final
+    {
+        std::vector<char> results(_children.size(), false);
+        _fanOut(_all(),
+                [&](const size_t i) { results[i] = _children[i]->flush(); });
+        return std::find(results.begin(), results.end(), false) ==
+               results.end();
+    }
+
+    void compact() final
+    {
+        _fanOut(_all(), [&](const size_t i) { _children[i]->compact(); });
+    }
+
+    std::string getProperty(const std::string& name) const final
+    {
+        std::string properties;
+        for (const auto& child : _children)
+        {
+            const std::string& property = child->getProperty(name);
+            if (!property.empty())
+                properties += property + "\n";
+        }
+        return properties;
+    }
+
+    std::string operator[](const std::string& key) const final
+    {
+        return _route(key)[key];
+    }
+
+    Strings getRanges(const std::string& key, const Ranges& ranges) const final
+    {
+        return _route(key).getRanges(key, ranges);
+    }
+
+    void getValues(const Strings& keys, const ConstValueFunc& func) const final
+    {
+        const Parts parts = _partition(keys);
+        std::mutex mutex; // serializes the callbacks from the children
+        _fanOut(_used(parts), [&](const size_t i) {
+            _children[i]->getValues(parts[i].keys,
+                                    [&](const std::string& key,
+                                        const char* data, const size_t size) {
+                                        std::lock_guard<std::mutex> lock(mutex);
+                                        func(key, data, size);
+                                    });
+        });
+    }
+
+    void takeValues(const Strings& keys, const ValueFunc& func) const final
+    {
+        const Parts parts = _partition(keys);
+        std::mutex mutex;
+        _fanOut(_used(parts), [&](const size_t i) {
+            _children[i]->takeValues(parts[i].keys,
+                                     [&](const std::string& key, char* data,
+                                         const size_t size) {
+                                         std::lock_guard<std::mutex> lock(
+                                             mutex);
+                                         func(key, data, size);
+                                     });
+        });
+    }
+
+    void getSizes(const Strings& keys, const SizeFunc& func) const final
+    {
+        const Parts parts = _partition(keys);
+        std::mutex mutex;
+        _fanOut(_used(parts), [&](const size_t i) {
+            _children[i]->getSizes(parts[i].keys, [&](const size_t index,
+                                                      const size_t size) {
+                std::lock_guard<std::mutex> lock(mutex);
+                func(parts[i].indices[index], size);
+            });
+        });
+    }
+
+    void getBatch(const Strings& keys, const ConstBatchFunc func) const final
+    {
+        const Parts parts = _partition(keys);
+        std::mutex mutex;
+        _fanOut(_used(parts), [&](const size_t i) {
+            std::vector<ConstValue> mapped;
+            _children[i]->getBatch(parts[i].keys, [&](const ConstValue* values,
+                                                      const size_t size) {
+                _map(parts[i], values, size, mapped);
+                std::lock_guard<std::mutex> lock(mutex);
+                func(mapped.data(), size);
+            });
+        });
+    }
+
+    void takeBatch(const Strings& keys, const BatchFunc func) const final
+    {
+        const Parts parts = _partition(keys);
+        std::mutex mutex;
+        _fanOut(_used(parts), [&](const size_t i) {
+            std::vector<Value> mapped;
+            _children[i]->takeBatch(parts[i].keys, [&](const Value* values,
+                                                       const size_t size) {
+                _map(parts[i], values, size, mapped);
+                std::lock_guard<std::mutex> lock(mutex);
+                func(mapped.data(), size);
+            });
+        });
+    }
+
+    // Merges the next keys of all children. Only meaningful if all children
+    // enumerate in key order, as leveldb and ceph do.
+    Strings getKeys(const std::string& after, const size_t maxKeys) const final
+    {
+        std::vector<Strings> results(_children.size());
+        _fanOut(_all(), [&](const size_t i) {
+            results[i] = _children[i]->getKeys(after, maxKeys);
+        });
+
+        Strings keys;
+        for (auto& result : results)
+            keys.insert(keys.end(), std::make_move_iterator(result.begin()),
+                        std::make_move_iterator(result.end()));
+        std::sort(keys.begin(), keys.end());
+        if (keys.size() > maxKeys)
+            keys.resize(maxKeys);
+        return keys;
+    }
+
+private:
+    // The keys routed to one child, and their indices in the request
+    struct Part
+    {
+        Strings keys;
+        std::vector<size_t> indices;
+    };
+    using Parts = std::vector<Part>;
+
+    std::vector<std::unique_ptr<Plugin>> _children;
+    std::vector<std::pair<uint64_t, size_t>> _ring; // point, child
+    std::unique_ptr<lunchbox::ThreadPool> _pool;    // null for one child
+
+    size_t _getChild(const std::string& key) const
+    {
+        const auto i =
+            std::lower_bound(_ring.begin(), _ring.end(),
+                             std::make_pair(_hash(key), size_t(0)));
+        return i == _ring.end() ? _ring.front().second : i->second;
+    }
+
+    Plugin& _route(const std::string& key) const
+    {
+        return *_children[_getChild(key)];
+    }
+
+    Parts _partition(const Strings& keys) const
+    {
+        Parts parts(_children.size());
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            Part& part = parts[_getChild(keys[i])];
+            part.keys.push_back(keys[i]);
+            part.indices.push_back(i);
+        }
+        return parts;
+    }
+
+    std::vector<size_t> _all() const
+    {
+        std::vector<size_t> children(_children.size());
+        for (size_t i = 0; i < children.size(); ++i)
+            children[i] = i;
+        return children;
+    }
+
+    static std::vector<size_t> _used(const Parts& parts)
+    {
+        std::vector<size_t> children;
+        for (size_t i = 0; i < parts.size(); ++i)
+            if (!parts[i].keys.empty())
+                children.push_back(i);
+        return children;
+    }
+
+    // translate the child-local indices of values to request indices
+    template <class V>
+    static void _map(const Part& part, const V* values, const size_t size,
+                     std::vector<V>& mapped)
+    {
+        mapped.assign(values, values + size);
+        for (auto& value : mapped)
+            value.index = part.indices[value.index];
+    }
+
+    // Runs task(child) for the given children, all but the first one in the
+    // thread pool. Waits for all tasks before rethrowing the first exception,
+    // since the tasks reference the caller's stack.
+    void _fanOut(const std::vector<size_t>& children,
+                 const std::function<void(size_t)>& task) const
+    {
+        if (children.empty())
+            return;
+        if (children.size() == 1)
+        {
+            task(children.front());
+            return;
+        }
+
+        // the tasks continue the deadline of the calling operation
+        const Deadline::Clock::time_point deadline = Deadline::get();
+        std::vector<std::future<void>> futures;
+        futures.reserve(children.size() - 1);
+        for (size_t i = 1; i < children.size(); ++i)
+        {
+            const size_t child = children[i];
+            futures.push_back(_pool->post([&task, child, deadline] {
+                const Deadline scope(deadline);
+                task(child);
+            }));
+        }
+
+        std::exception_ptr error;
+        try
+        {
+            task(children.front());
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        for (auto& future : futures)
+            future.wait();
+        for (auto& future : futures)
+        {
+            try
+            {
+                future.get();
+            }
+            catch (...)
+            {
+                if (!error)
+                    error = std::current_exception();
+            }
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+}
@@ -0,0 +1,98 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Tuner.h"
+
+#include <algorithm>
+
+namespace keyv
+{
+namespace
+{
+const std::chrono::milliseconds windowTime(100);
+const size_t minOperations = 4; // per window
+const double tolerance = 0.05;  // of throughput changes treated as noise
+}
+
+Tuner::Tuner(const size_t initial, const size_t min, const size_t max,
+             const size_t step, const bool queued)
+    : _min(min)
+    , _max(std::max(min, max))
+    , _step(step)
+    , _queued(queued)
+    , _size(std::min(std::max(initial, _min), _max))
+    , _low(1.)
+    , _high(100.)
+    , _throughput(0.)
+    , _start(Clock::now())
+    , _operations(0)
+    , _items(0)
+    , _latency(0.)
+{
+}
+
+void Tuner::setBounds(const double low, const double high)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _low = low;
+    _high = std::max(low, high);
+}
+
+bool Tuner::update(const size_t items, const double latency)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_operations;
+    _items += items;
+    _latency += latency;
+
+    const Clock::time_point now = Clock::now();
+    const auto elapsed = now - _start;
+    if (elapsed < windowTime || _operations < minOperations)
+        return false;
+
+    const double seconds =
+        std::chrono::duration_cast<std::chrono::duration<double>>(elapsed)
+            .count();
+    const double throughput = _items / seconds;
+    const double windowLatency = _queued
+                                     ? _size * 1000. * seconds / _operations
+                                     : _latency / _operations;
+    _start = now;
+    _operations = 0;
+    _items = 0;
+    _latency = 0.;
+    return _adapt(throughput, windowLatency);
+}
+
+bool Tuner::_adapt(const double throughput, const double latency)
+{
+    const size_t size = _size;
+    size_t next = size;
+    if (latency > _high)
+        next = std::max(_min, size / 2);
+    else if (latency < _low || throughput > _throughput * (1. + tolerance))
+        next = std::min(_max, size + _step);
+    else if (throughput < _throughput * (1. - tolerance))
+        next = size > _min + _step ? size - _step : _min;
+
+    _throughput = throughput;
+    _size = next;
+    return next != size;
+}
+}
@@ -0,0 +1,85 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+
+namespace keyv
+{
+/**
+ * @internal Adapts a size, e.g., a queue depth or batch size, to the measured
+ * throughput and latency of the operations using it.
+ *
+ * Measurements are aggregated over windows of at least 100ms. After each
+ * window, the size is halved if the latency exceeds the upper bound. It
+ * grows by one step while the latency is below the lower bound or the
+ * throughput improved, and shrinks by one step if the throughput dropped.
+ * Thread-safe.
+ */
+class Tuner
+{
+public:
+    /**
+     * @param queued true if the size is a queue depth, whose latency is
+     *        estimated from the throughput: a queued operation completes
+     *        after all operations before it (Little's law).
+     */
+    Tuner(size_t initial, size_t min, size_t max, size_t step, bool queued);
+
+    /** Set the latency bounds in milliseconds. */
+    void setBounds(double low, double high);
+
+    /** @return the current size. */
+    size_t get() const { return _size; }
+
+    /**
+     * Add the measurement of one operation.
+     *
+     * @param items the number of items processed by the operation.
+     * @param latency the duration of the operation in milliseconds, unused
+     *        for queue depths.
+     * @return true if the size changed.
+     */
+    bool update(size_t items, double latency);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    const size_t _min;
+    const size_t _max;
+    const size_t _step;
+    const bool _queued;
+    std::atomic<size_t> _size;
+
+    std::mutex _mutex; // protects the following
+    double _low;
+    double _high;
+    double _throughput; // items/s of the last window
+    Clock::time_point _start;
+    size_t _operations;
+    size_t _items;
+    double _latency; // sum of the window
+
+    bool _adapt(double throughput, double latency);
+};
+}
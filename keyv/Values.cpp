@@ -0,0 +1,139 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Values.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace keyv
+{
+namespace
+{
+// Block sizes double from the minimum to the maximum. Values larger than the
+// current block size get a block of their own size.
+const size_t minBlockSize = 64 * 1024;
+const size_t maxBlockSize = 16 * 1024 * 1024;
+const size_t alignment = 16;
+
+size_t _align(const size_t size)
+{
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+}
+
+Values::Values()
+    : _numValues(0)
+    , _next(nullptr)
+    , _free(0)
+{
+}
+
+Values::Values(const size_t numKeys)
+    : _values(numKeys, ConstValue{0, nullptr, 0})
+    , _numValues(0)
+    , _next(nullptr)
+    , _free(0)
+{
+    for (size_t i = 0; i < numKeys; ++i)
+        _values[i].index = i;
+}
+
+Values::Values(Values&& from)
+    : _values(std::move(from._values))
+    , _numValues(from._numValues)
+    , _blocks(std::move(from._blocks))
+    , _next(from._next)
+    , _free(from._free)
+{
+    from._numValues = 0;
+    from._next = nullptr;
+    from._free = 0;
+}
+
+Values& Values::operator=(Values&& from)
+{
+    if (this == &from)
+        return *this;
+
+    _values = std::move(from._values);
+    _numValues = from._numValues;
+    _blocks = std::move(from._blocks);
+    _next = from._next;
+    _free = from._free;
+
+    from._numValues = 0;
+    from._next = nullptr;
+    from._free = 0;
+    return *this;
+}
+
+Values::~Values()
+{
+}
+
+void Values::set(const ConstValue* values, const size_t size)
+{
+    // allocate at most one block for the batch
+    size_t total = 0;
+    for (size_t i = 0; i < size; ++i)
+        total += _align(values[i].size);
+    _reserve(total);
+
+    for (size_t i = 0; i < size; ++i)
+        _set(values[i]);
+}
+
+void Values::_reserve(const size_t size)
+{
+    if (size <= _free)
+        return;
+
+    const size_t shift = std::min(_blocks.size(), size_t(8));
+    const size_t blockSize =
+        std::max(_align(size), std::min(minBlockSize << shift, maxBlockSize));
+    _blocks.emplace_back(new char[blockSize]);
+    _next = _blocks.back().get();
+    _free = blockSize;
+}
+
+void Values::_set(const ConstValue& from)
+{
+    const size_t size = from.size;
+    ConstValue& value = _values[from.index];
+    if (value.data)
+        return; // duplicate key, keep first value
+
+    ++_numValues;
+    if (size == 0)
+    {
+        static const char empty = 0;
+        value.data = &empty;
+        return;
+    }
+
+    const size_t aligned = _align(size);
+    _reserve(aligned);
+    ::memcpy(_next, from.data, size);
+    value.data = _next;
+    value.size = size;
+    _next += aligned;
+    _free -= aligned;
+}
+}
@@ -0,0 +1,93 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KEYV_VALUES_H
+#define KEYV_VALUES_H
+
+#include <keyv/api.h>
+#include <keyv/types.h>
+
+#include <memory>
+#include <vector>
+
+namespace keyv
+{
+/**
+ * The result of a batch read, see Map::fetch().
+ *
+ * All values are packed into a few large memory blocks, which are owned by
+ * this object and released together. Values are accessed by the index of
+ * their key in the request.
+ */
+class Values
+{
+public:
+    /** Construct an empty result. @version 1.2 */
+    KEYV_API Values();
+
+    /** Construct an empty result for the given number of keys. @internal */
+    KEYV_API explicit Values(size_t numKeys);
+
+    KEYV_API Values(Values&& from);
+    KEYV_API Values& operator=(Values&& from);
+    KEYV_API ~Values();
+
+    /** @return the number of requested keys. @version 1.2 */
+    size_t size() const { return _values.size(); }
+    /** @return true if no key was requested. @version 1.2 */
+    bool empty() const { return _values.empty(); }
+    /** @return the number of found values. @version 1.2 */
+    size_t getNumValues() const { return _numValues; }
+    /**
+     * @return the value of the key at the given index, with a null data
+     *         pointer if the key was not found. The data is valid for the
+     *         lifetime of this object.
+     * @version 1.2
+     */
+    const ConstValue& operator[](const size_t index) const
+    {
+        return _values[index];
+    }
+
+    /** @return true if the key at the given index was found. @version 1.2 */
+    bool isFound(const size_t index) const
+    {
+        return _values[index].data != nullptr;
+    }
+
+    /** Copy a batch of values into this object. @internal */
+    KEYV_API void set(const ConstValue* values, size_t size);
+
+private:
+    Values(const Values&) = delete;
+    Values& operator=(const Values&) = delete;
+
+    std::vector<ConstValue> _values;
+    size_t _numValues;
+
+    std::vector<std::unique_ptr<char[]>> _blocks;
+    char* _next;  // next free byte in the last block
+    size_t _free; // free bytes in the last block
+
+    void _reserve(size_t size);
+    void _set(const ConstValue& value);
+};
+}
+
+#endif // KEYV_VALUES_H
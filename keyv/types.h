@@ -35,16 +35,20 @@
 #define KEYV_TYPES_H
 
 #include <functional>
+#include <keyv/FunctionRef.h>
 #include <keyv/defines.h>
 #include <lunchbox/types.h>
 #include <memory>
+#include <vector>
 
 namespace keyv
 {
 using lunchbox::Strings;
 
+class CompletionQueue;
 class Map;
 class Plugin;
+class Values;
 
 /**
  * Callback for Map::takeValues(), providing the key, pointer and size
@@ -59,6 +63,50 @@ using ValueFunc = std::function<void(const std::string&, char*, size_t)>;
 using ConstValueFunc =
     std::function<void(const std::string&, const char*, size_t)>;
 
+/**
+ * Callback for Map::sizes(), providing the index of the key and the size of
+ * its value.
+ */
+using SizeFunc = std::function<void(size_t, size_t)>;
+
+/** A value read by a batch operation, identified by the index of its key. */
+struct ConstValue
+{
+    size_t index; //!< position of the key in the requested keys
+    const char* data;
+    size_t size;
+};
+
+/** A value taken by a batch operation, data has to be free'd by the caller. */
+struct Value
+{
+    size_t index; //!< position of the key in the requested keys
+    char* data;
+    size_t size;
+};
+
+/** Batch callback for Plugin::getBatch(), providing an array of values. */
+using ConstBatchFunc = FunctionRef<void(const ConstValue*, size_t)>;
+
+/** Batch callback for Plugin::takeBatch(), providing an array of values. */
+using BatchFunc = FunctionRef<void(const Value*, size_t)>;
+
+/** A part of a value for the scatter/gather Map::insert(). */
+struct Span
+{
+    const void* data;
+    size_t size;
+};
+using Spans = std::vector<Span>;
+
+/** A byte range of a value for Map::getRanges(). */
+struct Range
+{
+    uint64_t offset; //!< position of the first byte in the value
+    size_t size;     //!< maximum number of bytes
+};
+using Ranges = std::vector<Range>;
+
 typedef std::shared_ptr<Map> MapPtr;
 }
 
@@ -30,7 +30,12 @@
 
 #define TEST_RUNTIME 600 // seconds
 
+#include <keyv/CompletionQueue.h>
 #include <keyv/Map.h>
+#ifndef _WIN32
+#include <keyv/MmapWriter.h>
+#include <unistd.h>
+#endif
 
 #include <lunchbox/clock.h>
 #include <lunchbox/os.h>
@@ -43,6 +48,12 @@
 #endif
 #include <boost/format.hpp>
 
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <set>
 #include <stdexcept>
 
 #define MAX_SIZE (1024 * 256)
@@ -206,6 +217,40 @@ void setup(const std::string& uriStr)
     });
     TEST(numResults == keys.size());
 
+    std::vector<bool> found(keys.size(), false);
+    map.getIndexedValues(keys, [&](const size_t index, const char* data,
+                                   const size_t size) {
+        TESTINFO(index < keys.size(), index);
+        TEST(!found[index]);
+        TEST(data);
+        TESTINFO(size == map[keys[index]].size(), keys[index] << " in "
+                                                              << uriStr);
+        found[index] = true;
+    });
+    TEST(std::find(found.begin(), found.end(), false) == found.end());
+
+    found.assign(keys.size(), false);
+    map.takeIndexedValues(keys, [&](const size_t index, char* data,
+                                    const size_t size) {
+        TESTINFO(index < keys.size(), index);
+        TEST(!found[index]);
+        TEST(data);
+        TEST(size > 0);
+        found[index] = true;
+        free(data);
+    });
+    TEST(std::find(found.begin(), found.end(), false) == found.end());
+
+    const lunchbox::Strings fetchKeys = {"hans", "nothere", "foo", "iValue"};
+    const keyv::Values values = map.fetch(fetchKeys);
+    TEST(values.size() == fetchKeys.size());
+    TESTINFO(values.getNumValues() == 3, values.getNumValues());
+    TEST(!values.isFound(1));
+    TEST(std::string(values[0].data, values[0].size) == "dampf");
+    TEST(std::string(values[2].data, values[2].size) == "bar");
+    TEST(values[3].size == sizeof(int));
+    TEST(*reinterpret_cast<const int*>(values[3].data) == 42);
+
     const std::string random = servus::make_UUID().getString();
     TEST(map.insert(random, "foobar"));
     TESTINFO(map[random] == "foobar", map[random]);
@@ -292,16 +337,18 @@ void benchmark(const std::string& uriStr, const uint64_t queueDepth,
 }
 
 void benchmarkMultithreaded(const std::string& uriStr, const size_t threadCount,
-                            const size_t valueSize)
+                            const size_t valueSize, const bool shared)
 {
     std::vector<Map> maps;
 
     const servus::URI uri(uriStr);
 
-    for (size_t i = 0; i < threadCount; ++i)
+    lunchbox::Clock clock;
+    for (size_t i = 0; i < (shared ? 1 : threadCount); ++i)
     {
         maps.emplace_back(uri);
     }
+    const float openTime = clock.getTimef() / 1000.f;
 
     std::string value(valueSize, '*');
 
@@ -317,8 +364,9 @@ void benchmarkMultithreaded(const std::string& uriStr, const size_t threadCount,
         key.second = valueSize;
         std::string keyStr;
         keyStr.assign(reinterpret_cast<char*>(&key), sizeof(key));
-        maps[id].insert(keyStr, value);
-        maps[id].flush();
+        Map& map = maps[shared ? 0 : id];
+        map.insert(keyStr, value);
+        map.flush();
     };
 
     auto readTask = [&](size_t id) {
@@ -328,15 +376,16 @@ void benchmarkMultithreaded(const std::string& uriStr, const size_t threadCount,
         key.second = valueSize;
         std::string keyStr;
         keyStr.assign(reinterpret_cast<char*>(&key), sizeof(key));
-        maps[id][keyStr];
+        Map& map = maps[shared ? 0 : id];
+        map[keyStr];
 
-        maps[id].flush();
+        map.flush();
     };
 
     lunchbox::ThreadPool threadPool{threadCount};
 
     std::vector<std::future<void>> status;
-    lunchbox::Clock clock;
+    clock.reset();
 
     for (size_t i = 0; i < threadCount; ++i)
     {
@@ -363,26 +412,540 @@ void benchmarkMultithreaded(const std::string& uriStr, const size_t threadCount,
 
     float dataSizeMB = valueSize / 1024.f / 1024.f;
 
-    // threads,     size,  writes/s,     MB/s,  reads/s,      MB/s
-    std::cout << boost::format("%6i, %8i,%9.2f, %9.2f,%9.2f, %9.2f") %
-                     threadCount % valueSize % (threadCount / writeTime) %
+    //   maps, threads,     size,  writes/s,     MB/s,  reads/s,      MB/s,
+    //   open ms
+    std::cout << boost::format(
+                     "%6s, %6i, %8i,%9.2f, %9.2f,%9.2f, %9.2f, %8.2f") %
+                     (shared ? "shared" : "thread") % threadCount % valueSize %
+                     (threadCount / writeTime) %
                      (dataSizeMB * threadCount / writeTime) %
                      (threadCount / readTime) %
-                     (dataSizeMB * threadCount / readTime)
+                     (dataSizeMB * threadCount / readTime) %
+                     (openTime * 1000.f)
               << std::endl;
 }
 
-void testGenericFailures()
+void testConcurrent(const std::string& uriStr)
 {
+    const servus::URI uri(uriStr);
+    Map map(uri);
+
+    const size_t numThreads = 8;
+    const size_t numKeys = 100;
+    const auto key = [](const size_t thread, const size_t i) {
+        return "concurrent" + std::to_string(thread) + "." + std::to_string(i);
+    };
+
+    lunchbox::ThreadPool threadPool{numThreads};
+    std::vector<std::future<void>> status;
+    for (size_t i = 0; i < numThreads; ++i)
+        status.push_back(threadPool.post([&, i] {
+            for (size_t j = 0; j < numKeys; ++j)
+                TEST(map.insert(key(i, j), key(i, j)));
+            map.flush();
+        }));
+    for (auto& f : status)
+        f.get();
+    status.clear();
+    map.flush();
+
+    for (size_t i = 0; i < numThreads; ++i)
+        status.push_back(threadPool.post([&, i] {
+            for (size_t j = 0; j < numKeys; ++j)
+                TESTINFO(map[key(i, j)] == key(i, j), key(i, j) << " in "
+                                                                << uriStr);
+        }));
+    for (auto& f : status)
+        f.get();
+}
+
+void testAtomic(const std::string& uriStr)
+{
+    Map map{servus::URI(uriStr)};
+    const std::string suffix = servus::make_UUID().getString();
+    const std::string counter = "atomicCounter" + suffix;
+    const std::string log = "atomicLog" + suffix;
+    const std::string cas = "atomicCAS" + suffix;
+
+    // concurrent increments do not lose updates
+    const size_t numThreads = 4;
+    const size_t numIncrements = 50;
+    lunchbox::ThreadPool threadPool{numThreads};
+    std::vector<std::future<void>> status;
+    for (size_t i = 0; i < numThreads; ++i)
+        status.push_back(threadPool.post([&] {
+            for (size_t j = 0; j < numIncrements; ++j)
+                map.increment(counter);
+        }));
+    for (auto& f : status)
+        f.get();
+    const uint64_t total = numThreads * numIncrements;
+    TESTINFO(map.increment(counter, 0) == total, uriStr);
+    TESTINFO(map[counter] == std::to_string(total), uriStr);
+
+    TEST(map.append(log, std::string("a")));
+    TEST(map.append(log, std::string("bc")));
+    TESTINFO(map[log] == "abc", uriStr);
+
+    TEST(map.compareAndSwap(cas, "", "first"));
+    TEST(!map.compareAndSwap(cas, "", "second"));
+    TEST(!map.compareAndSwap(cas, "wrong", "second"));
+    TEST(map.compareAndSwap(cas, "first", "second"));
+    TESTINFO(map[cas] == "second", uriStr);
+
     try
     {
-        setup("foobar://");
+        map.increment(cas);
+        TESTINFO(false, "Missing exception in " << uriStr);
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+}
+
+void testInsertParts(const std::string& uriStr)
+{
+    Map map{servus::URI(uriStr)};
+    const std::string header = "header";
+    const std::string payload(4096, 'p');
+    const uint32_t index = 42;
+    TEST(map.insert("parts", {{header.data(), header.size()},
+                              {payload.data(), payload.size()},
+                              {&index, sizeof(index)}}));
+    map.flush();
+
+    const std::string& value = map["parts"];
+    TESTINFO(value.size() == header.size() + payload.size() + sizeof(index),
+             uriStr);
+    TEST(value == header + payload + std::string((const char*)&index,
+                                                 sizeof(index)));
+}
+
+void testGetRanges(const std::string& uriStr)
+{
+    Map map{servus::URI(uriStr)};
+    TEST(map.insert("ranges", std::string("0123456789")));
+    map.flush();
+
+    TESTINFO(map.getRange("ranges", 2, 3) == "234", uriStr);
+    TEST(map.getRange("ranges", 8, 10) == "89");
+    TEST(map.getRange("ranges", 10, 1).empty());
+    TEST(map.getRange("missing ranges", 0, 1).empty());
+
+    const keyv::Strings parts =
+        map.getRanges("ranges", {{9, 1}, {0, 2}, {20, 2}});
+    TESTINFO(parts.size() == 3, uriStr);
+    TEST(parts[0] == "9" && parts[1] == "01" && parts[2].empty());
+}
+
+void testSizes(const std::string& uriStr)
+{
+    Map map{servus::URI(uriStr)};
+    TEST(map.insert("sizes/small", std::string("abc")));
+    TEST(map.insert("sizes/large", std::string(100000, 'l')));
+    map.flush();
+
+    const keyv::Strings keys = {"sizes/large", "sizes/missing", "sizes/small"};
+    std::map<size_t, size_t> sizes;
+    map.sizes(keys, [&](const size_t index, const size_t size) {
+        TEST(sizes.emplace(index, size).second);
+    });
+    TESTINFO(sizes.size() == 2, uriStr);
+    TEST(sizes[0] == 100000);
+    TEST(sizes[2] == 3);
+
+    const std::vector<bool> found = map.contains(keys);
+    TEST(found.size() == 3 && found[0] && !found[1] && found[2]);
+}
+
+void testAutoQueueDepth(const std::string& uriStr)
+{
+    Map map{servus::URI(uriStr)};
+    const size_t depth = map.setQueueDepth(Map::AUTO);
+    map.setLatencyBounds(0.1, 10.);
+
+    // more keys than the initial read batch size, read in several batches
+    const size_t numKeys = 1000;
+    keyv::Strings keys;
+    for (size_t i = 0; i < numKeys; ++i)
+    {
+        keys.push_back("auto/" + std::to_string(i));
+        TEST(map.insert(keys.back(), i));
+    }
+    TESTINFO(map.flush(), uriStr);
+
+    std::vector<size_t> values(numKeys, 0);
+    map.getIndexedValues(keys, [&](const size_t index, const char* data,
+                                   const size_t size) {
+        TEST(size == sizeof(size_t));
+        values[index] = *reinterpret_cast<const size_t*>(data);
+    });
+    for (size_t i = 0; i < numKeys; ++i)
+        TESTINFO(values[i] == i, uriStr << " depth " << depth);
+
+    size_t found = 0;
+    map.sizes(keys, [&](const size_t index, const size_t size) {
+        TEST(index < numKeys && size == sizeof(size_t));
+        ++found;
+    });
+    TEST(found == numKeys);
+    TEST(map.setQueueDepth(0) == 0);
+}
+
+void testTimeout(const std::string& uriStr)
+{
+    const std::chrono::milliseconds timeout(10000);
+    Map map{servus::URI(uriStr)};
+    map.setTimeout(timeout);
+    TEST(map.insert("timeout/a", "a", 1, timeout));
+    TEST(map.insert("timeout/b", std::string("b")));
+    map.flush();
+    TESTINFO(map.get("timeout/a", timeout) == "a", uriStr);
+
+    const keyv::Strings keys = {"timeout/a", "timeout/missing", "timeout/b"};
+    size_t found = 0;
+    keyv::Strings missing =
+        map.getValues(keys,
+                      [&](const std::string&, const char*, size_t) {
+                          ++found;
+                      },
+                      timeout);
+    TEST(found == 2);
+    TESTINFO(missing == keyv::Strings{"timeout/missing"}, uriStr);
+
+    missing = map.takeValues(keys,
+                             [&](const std::string& key, char* data,
+                                 const size_t size) {
+                                 TEST(key.substr(8) == std::string(data, size));
+                                 free(data);
+                             },
+                             timeout);
+    TEST(missing == keyv::Strings{"timeout/missing"});
+}
+
+void testCompletionQueue(const std::string& uriStr)
+{
+    Map map{servus::URI(uriStr)};
+    keyv::CompletionQueue queue;
+    TEST(queue.poll() == 0);
+
+    const size_t numKeys = 16;
+    keyv::Strings keys;
+    size_t inserted = 0;
+    for (size_t i = 0; i < numKeys; ++i)
+    {
+        keys.push_back("queue/" + std::to_string(i));
+        map.insert(queue, keys.back(), keys.back(),
+                   [&](const bool ok) { inserted += ok; });
+    }
+    TEST(queue.getPending() == numKeys);
+    TEST(queue.drain() == numKeys);
+    TESTINFO(inserted == numKeys, uriStr);
+
+    bool flushed = false;
+    map.flush(queue, [&](const bool ok) { flushed = ok; });
+    TEST(queue.drain() == 1 && flushed);
+
+    std::string value;
+    map.get(queue, keys.front(), [&](std::string result) {
+        value = std::move(result);
+        // handlers may submit further operations
+        map.fetch(queue, keys, [&](keyv::Values values) {
+            TEST(values.getNumValues() == numKeys);
+            for (size_t i = 0; i < numKeys; ++i)
+                TEST(std::string(values[i].data, values[i].size) == keys[i]);
+        });
+    });
+    TEST(queue.drain() == 2);
+    TESTINFO(value == keys.front(), uriStr);
+    TEST(queue.getPending() == 0);
+}
+
+void testClear(const std::string& uriStr)
+{
+    Map map{servus::URI(uriStr)};
+    for (size_t i = 0; i < 10; ++i)
+    {
+        TEST(map.insert("clear/a/" + std::to_string(i), i));
+        TEST(map.insert("clear/b/" + std::to_string(i), i));
+    }
+    TEST(map.insert("clear/a", std::string("prefix")));
+    TEST(map.insert("clear/c", std::string("other")));
+    map.flush();
+
+    try
+    {
+        map.erasePrefix("clear/a");
+        for (size_t i = 0; i < 10; ++i)
+        {
+            TESTINFO(map["clear/a/" + std::to_string(i)].empty(), uriStr);
+            TEST(map.get<size_t>("clear/b/" + std::to_string(i)) == i);
+        }
+        TEST(map["clear/a"].empty());
+        TEST(map["clear/c"] == "other");
+    }
+    catch (const std::runtime_error&)
+    {
+        TESTINFO(servus::URI(uriStr).getScheme() == "memcached", uriStr);
+    }
+
+    map.clear();
+    TESTINFO(map["clear/c"].empty(), uriStr);
+    for (size_t i = 0; i < 10; ++i)
+        TEST(map["clear/b/" + std::to_string(i)].empty());
+
+    TEST(map.insert("clear/c", std::string("again")));
+    map.flush();
+    TEST(map["clear/c"] == "again");
+}
+
+void testOpen(const std::string& uriStr)
+{
+    const servus::URI uri(uriStr);
+    std::future<Map> future = Map::open(uri);
+    Map lazy = Map::openLazy(uri); // not opened until first use
+    {
+        Map map = future.get();
+        TEST(map.insert("open", "future"));
+        map.flush();
+    }
+    TEST(lazy["open"] == "future");
+}
+
+void testGetKeys(const std::string& uriStr)
+{
+    Map map{servus::URI(uriStr)};
+    const size_t numKeys = 10;
+    for (size_t i = 0; i < numKeys; ++i)
+        TEST(map.insert("getKeys" + std::to_string(i), i));
+    map.flush();
+
+    std::set<std::string> keys;
+    try
+    {
+        // page through all keys with a small batch size
+        std::string after;
+        for (;;)
+        {
+            const keyv::Strings batch = map.getKeys(after, 3);
+            if (batch.empty())
+                break;
+            TEST(batch.size() <= 3);
+            for (const auto& key : batch)
+                TESTINFO(keys.insert(key).second, key << " in " << uriStr);
+            after = batch.back();
+        }
+    }
+    catch (const std::runtime_error&)
+    {
+        TESTINFO(servus::URI(uriStr).getScheme() == "memcached", uriStr);
+        return;
+    }
+
+    for (size_t i = 0; i < numKeys; ++i)
+        TESTINFO(keys.count("getKeys" + std::to_string(i)) == 1,
+                 i << " in " << uriStr);
+}
+
+void testDedup()
+{
+#ifdef KEYV_USE_LEVELDB
+    Map map{servus::URI("leveldb:///dedupTest?store=keyvDedupTest.leveldb&"
+                        "dedup=1&dedup_min_size=16")};
+    map.clear();
+    const std::string value(1024, 'd');
+    TEST(map.insert("dedup1", value));
+    TEST(map.insert("dedup2", value));
+    TEST(map.insert("dedup3", value));
+    TEST(map.insert("small", std::string("inline")));
+
+    // the shared blob and its reference count are not enumerated
+    const keyv::Strings keys = map.getKeys(std::string(), 10);
+    TESTINFO(keys.size() == 4, keys.size());
+
+    map.erase("dedup1");
+    const std::string other = "overwritten, and long enough";
+    TEST(map.insert("dedup2", other));
+    TEST(map["dedup1"].empty());
+    TEST(map["dedup2"] == other);
+    TEST(map["dedup3"] == value);
+    TEST(map["small"] == "inline");
+
+    size_t found = 0;
+    map.takeValues({"dedup1", "dedup2", "dedup3", "small"},
+                   [&](const std::string& key, char* data, const size_t size) {
+                       TEST(map[key] == std::string(data, size));
+                       ::free(data);
+                       ++found;
+                   });
+    TEST(found == 3);
+
+    map.erase("dedup2");
+    map.erase("dedup3");
+    map.erase("small");
+    TEST(map.getKeys(std::string(), 10).empty());
+#endif
+}
+
+void testDictionary()
+{
+#if defined(KEYV_USE_LIBMEMCACHED) && defined(KEYV_USE_ZSTD)
+    // a fresh namespace, to train a new dictionary
+    const std::string uri = "memcached:///dictionary" +
+                            std::to_string(::getpid()) +
+                            "?dictionary=1&dictionary_samples=500&"
+                            "dictionary_size=4KB&generation_refresh=0";
+    if (!testAvailable(uri))
+        return;
+
+    const auto value = [](const size_t i) {
+        return "{\"brick\": " + std::to_string(i) + ", \"lod\": " +
+               std::to_string(i % 4) + ", \"format\": \"uint8\"}";
+    };
+    keyv::Strings keys;
+    Map writer{servus::URI(uri)};
+    for (size_t i = 0; i < 1000; ++i)
+    {
+        keys.push_back("brick" + std::to_string(i));
+        TEST(writer.insert(keys.back(), value(i)));
+    }
+    writer.flush();
+
+    // a new client loads the dictionary of the values on first use
+    Map reader{servus::URI(uri)};
+    size_t found = 0;
+    reader.getIndexedValues(keys, [&](const size_t index, const char* data,
+                                      const size_t size) {
+        TESTINFO(std::string(data, size) == value(index), index);
+        ++found;
+    });
+    TESTINFO(found == keys.size(), found);
+    TEST(reader[keys.back()] == value(keys.size() - 1));
+    reader.sizes({keys.front()}, [&](const size_t, const size_t size) {
+        TEST(size == value(0).size());
+    });
+#endif
+}
+
+void testMmap()
+{
+#ifndef _WIN32
+    char cwd[4096];
+    TEST(::getcwd(cwd, sizeof(cwd)));
+    const std::string filename = std::string(cwd) + "/keyvMap.mmap";
+    {
+        keyv::MmapWriter writer(filename);
+        writer.insert("foo", "bar", 3);
+        writer.insert("foo", "baz", 3);
+        const int iValue = 42;
+        writer.insert("iValue", &iValue, sizeof(iValue));
+        const std::vector<uint16_t> vector(LB_128KB, 17);
+        writer.insert("vector", vector.data(), vector.size() * 2);
+#ifdef KEYV_USE_LEVELDB
+        const Map source(servus::URI("leveldb://"));
+        TEST(writer.insert(source, {"hans", "nothere"}) == 1);
+#endif
+        writer.commit();
+    }
+
+    Map map(servus::URI("mmap://" + filename));
+    TEST(map["foo"] == "baz");
+    TEST(map["bar"].empty());
+    TEST(map.get<int>("iValue") == 42);
+    TEST(map.getVector<uint16_t>("vector").size() == LB_128KB);
+    TEST(!map.insert("bar", "foo"));
+#ifdef KEYV_USE_LEVELDB
+    TEST(map["hans"] == "dampf");
+#endif
+    const keyv::Strings keys = map.getKeys(std::string(), 10);
+#ifdef KEYV_USE_LEVELDB
+    TESTINFO(keys.size() == 4, keys.size());
+#else
+    TESTINFO(keys.size() == 3, keys.size());
+#endif
+    TEST(std::find(keys.begin(), keys.end(), "vector") != keys.end());
+    TEST(map.getKeys(keys[1], 10).size() == keys.size() - 2);
+
+    const keyv::Values values = map.fetch({"nothere", "iValue", "foo"});
+    TEST(values.getNumValues() == 2);
+    TEST(!values.isFound(0));
+    TEST(std::string(values[2].data, values[2].size) == "baz");
+
+    TEST(map.getRange("foo", 1, 5) == "az");
+    const keyv::Strings ranges = map.getRanges("vector", {{0, 2}, {LB_1MB, 2}});
+    TEST(ranges.size() == 2 && ranges[0].size() == 2 && ranges[1].empty());
+
+    // the replaced value of foo is not written
+    std::string contents;
+    {
+        std::ifstream file(filename, std::ios::binary);
+        contents.assign(std::istreambuf_iterator<char>(file),
+                        std::istreambuf_iterator<char>());
+    }
+    TEST(contents.find("bar") == std::string::npos);
+
+    // valueSize of the first index entry, behind the 48 byte header
+    {
+        std::fstream file(filename,
+                          std::ios::binary | std::ios::in | std::ios::out);
+        const uint64_t corrupt = std::numeric_limits<uint64_t>::max();
+        file.seekp(48 + 4 * sizeof(uint64_t));
+        file.write(reinterpret_cast<const char*>(&corrupt), sizeof(corrupt));
+    }
+    bool rejected = false;
+    try
+    {
+        Map corrupt(servus::URI("mmap://" + filename));
+    }
+    catch (const std::runtime_error&)
+    {
+        rejected = true;
+    }
+    TESTINFO(rejected, "Missing exception for corrupt index");
+
+    ::remove(filename.c_str());
+    try
+    {
+        Map missing(servus::URI("mmap://" + filename));
     }
     catch (const std::runtime_error&)
     {
         return;
     }
     TESTINFO(false, "Missing exception");
+#endif
+}
+
+void testGenericFailures()
+{
+    const servus::URI uri("foobar://");
+    try
+    {
+        setup("foobar://");
+        TESTINFO(false, "Missing exception");
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+
+    std::future<Map> future = Map::open(uri);
+    try
+    {
+        future.get();
+        TESTINFO(false, "Missing exception");
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+
+    try
+    {
+        Map::openLazy(uri);
+        TESTINFO(false, "Missing exception");
+    }
+    catch (const std::runtime_error&)
+    {
+    }
 }
 
 void testLevelDBFailures()
@@ -400,6 +963,148 @@ void testLevelDBFailures()
 #endif
 }
 
+void testLevelDBBulk()
+{
+#ifdef KEYV_USE_LEVELDB
+    Map map{servus::URI("leveldb:///bulk?store=keyvBulk.leveldb&profile=bulk")};
+    const std::string value(4096, 'b');
+    for (size_t i = 0; i < 1000; ++i)
+        TEST(map.insert("bulk" + std::to_string(i), value));
+
+    // flush does not compact, compact() moves the values out of level 0
+    TEST(map.flush());
+    map.compact();
+    TESTINFO(map.getProperty("leveldb.num-files-at-level0") == "0",
+             map.getProperty("leveldb.stats"));
+    TEST(!map.getProperty("leveldb.stats").empty());
+    TEST(map.getProperty("leveldb.unknown").empty());
+    TEST(map["bulk42"] == value);
+
+    map.erasePrefix("bulk");
+    map.compact();
+    TEST(map["bulk42"].empty());
+
+    try
+    {
+        setup("leveldb://?store=keyvBulk.leveldb&profile=fast");
+    }
+    catch (const std::runtime_error&)
+    {
+        return;
+    }
+    TESTINFO(false, "Missing exception");
+#endif
+}
+
+void testLevelDBShared()
+{
+#ifdef KEYV_USE_LEVELDB
+    // namespaces of one store share its handle, which leveldb locks
+    Map a{servus::URI("leveldb:///a?store=keyvShared.leveldb")};
+    Map b{servus::URI("leveldb:///b?store=keyvShared.leveldb&max_size=1GB")};
+    TEST(a.insert("key", std::string("a")));
+    TEST(b.insert("key", std::string("b")));
+    TEST(a["key"] == "a");
+    TEST(b["key"] == "b");
+
+    const Map c{servus::URI("leveldb:///a?store=./keyvShared.leveldb")};
+    TEST(c["key"] == "a");
+
+    // read-modify-writes of maps on the same namespace exclude each other
+    Map d{servus::URI("leveldb:///a?store=keyvShared.leveldb")};
+    const size_t numIncrements = 200;
+    lunchbox::ThreadPool threadPool{2};
+    std::vector<std::future<void>> status;
+    for (Map* map : {&a, &d})
+        status.push_back(threadPool.post([map] {
+            for (size_t i = 0; i < numIncrements; ++i)
+                map->increment("counter");
+        }));
+    for (auto& f : status)
+        f.get();
+    TEST(c["counter"] == std::to_string(2 * numIncrements));
+
+    // the root namespace contains all namespaces of the store
+    Map root{servus::URI("leveldb://?store=keyvShared.leveldb")};
+    root.clear();
+    TEST(a["key"].empty());
+    TEST(b["key"].empty());
+#endif
+}
+
+void testLMDBShared()
+{
+#ifdef KEYV_USE_LMDB
+    // lmdb can't open the same environment twice in one process
+    Map a{servus::URI("lmdb:///a?store=keyvShared.lmdb")};
+    Map b{servus::URI("lmdb:///b?store=keyvShared.lmdb")};
+    TEST(a.insert("key", std::string("a")));
+    TEST(b.insert("key", std::string("b")));
+    TEST(a["key"] == "a");
+    TEST(b["key"] == "b");
+
+    const Map c{servus::URI("lmdb:///a?store=./keyvShared.lmdb")};
+    TEST(c["key"] == "a");
+#endif
+}
+
+void testLevelDBCacheFailures()
+{
+#ifdef KEYV_USE_LEVELDB
+    try
+    {
+        setup("leveldb://?store=keyvCache.leveldb&max_size=1GB&policy=mru");
+    }
+    catch (const std::runtime_error&)
+    {
+        return;
+    }
+    TESTINFO(false, "Missing exception");
+#endif
+}
+
+void testMemcachedFailures()
+{
+#ifdef KEYV_USE_LIBMEMCACHED
+    for (const auto& uri : {"memcached://?replicas=0",
+                            "memcached://?replicas=two",
+                            "memcached://?poll_timeout=-1"})
+    {
+        try
+        {
+            setup(uri);
+            TESTINFO(false, "Missing exception for " << uri);
+        }
+        catch (const std::runtime_error&)
+        {
+        }
+    }
+#endif
+}
+
+void testCompositeFailures()
+{
+    {
+        std::ofstream shards("keyvShardFailure.txt");
+        shards << "leveldb:// -1\n";
+    }
+    for (const auto& uri :
+         {"shard://doesnotexist/shards.txt", "shard://keyvShardFailure.txt",
+          "mirror://keyvShardFailure.txt", "mirror://keyvMirror.txt?delay=-1",
+          "mirror://keyvMirror.txt?percentile=101"})
+    {
+        try
+        {
+            setup(uri);
+            TESTINFO(false, "Missing exception for " << uri);
+        }
+        catch (const std::runtime_error&)
+        {
+        }
+    }
+    ::remove("keyvShardFailure.txt");
+}
+
 void testCephFailures()
 {
 #ifdef KEYV_USE_RADOS
@@ -480,10 +1185,44 @@ int main(const int argc, char* argv[])
     tests.push_back(TestSpec("", 0, MAX_SIZE));
     tests.push_back(TestSpec("leveldb://", 0, MAX_SIZE));
     tests.push_back(TestSpec("leveldb://?store=keyvMap2.leveldb", 0, MAX_SIZE));
+    tests.push_back(TestSpec(
+        "leveldb:///cache?store=keyvCache.leveldb&max_size=1GB&policy=lru", 0,
+        MAX_SIZE));
+    tests.push_back(
+        TestSpec("leveldb:///dedup?store=keyvDedup.leveldb&dedup=1", 0,
+                 MAX_SIZE));
+    {
+        std::ofstream shards("keyvShard.txt");
+        shards << "# two stores, the second one with twice the keys\n"
+               << "leveldb://?store=keyvShard1.leveldb\n"
+               << "leveldb://?store=keyvShard2.leveldb 2\n";
+    }
+    tests.push_back(TestSpec("shard://keyvShard.txt", 0, MAX_SIZE));
+    {
+        std::ofstream mirrors("keyvMirror.txt");
+        mirrors << "leveldb://?store=keyvMirror1.leveldb\n"
+                << "leveldb:///mirror?store=keyvMirror2.leveldb\n";
+    }
+    tests.push_back(TestSpec("mirror://keyvMirror.txt?delay=1", 0, MAX_SIZE));
+    tests.push_back(
+        TestSpec("mirror://keyvMirror.txt?percentile=95", 0, MAX_SIZE));
+#endif
+#ifdef KEYV_USE_LMDB
+    tests.push_back(TestSpec("lmdb://", 0, MAX_SIZE));
+    tests.push_back(TestSpec("lmdb:///namespace?store=keyvMap2.lmdb", 0,
+                             MAX_SIZE));
 #endif
 #ifdef KEYV_USE_LIBMEMCACHED
     if (testAvailable("memcached://"))
+    {
         tests.push_back(TestSpec("memcached://", 65536, MAX_SIZE));
+        tests.push_back(TestSpec("memcached:///replicated?replicas=2", 0,
+                                 MAX_SIZE));
+        tests.push_back(TestSpec(
+            "memcached:///timeouts?connect_timeout=100&poll_timeout=100&"
+            "retry_timeout=1000&failure_limit=1",
+            0, MAX_SIZE));
+    }
 #endif
 #ifdef KEYV_USE_RADOS
     std::string config =
@@ -550,6 +1289,17 @@ int main(const int argc, char* argv[])
 
             setup(test.uri);
             read(test.uri);
+            testConcurrent(test.uri);
+            testGetKeys(test.uri);
+            testAtomic(test.uri);
+            testGetRanges(test.uri);
+            testInsertParts(test.uri);
+            testSizes(test.uri);
+            testAutoQueueDepth(test.uri);
+            testTimeout(test.uri);
+            testCompletionQueue(test.uri);
+            testOpen(test.uri);
+            testClear(test.uri);
             if (perfTest)
             {
                 for (size_t i = 1; i <= test.size; i = i << 2)
@@ -559,10 +1309,18 @@ int main(const int argc, char* argv[])
 
                 if (test.threadCount > 1)
                 {
+                    std::cout << "  maps,  #thr ,     size,  writes/s,     "
+                                 "MB/s,  reads/s,      MB/s,  open ms"
+                              << std::endl;
                     for (size_t threadCount = 1;
                          threadCount <= test.threadCount; ++threadCount)
                         for (size_t s = 1; s <= test.size; s = s << 2)
-                            benchmarkMultithreaded(test.uri, threadCount, s);
+                        {
+                            benchmarkMultithreaded(test.uri, threadCount, s,
+                                                   false);
+                            benchmarkMultithreaded(test.uri, threadCount, s,
+                                                   true);
+                        }
                 }
             }
         }
@@ -578,8 +1336,17 @@ int main(const int argc, char* argv[])
         TESTINFO(!"exception", error.what());
     }
 
+    testDedup();
+    testDictionary();
+    testMmap();
     testGenericFailures();
     testLevelDBFailures();
+    testLevelDBCacheFailures();
+    testLevelDBBulk();
+    testLevelDBShared();
+    testLMDBShared();
+    testMemcachedFailures();
+    testCompositeFailures();
     testCephFailures();
 
     return EXIT_SUCCESS;
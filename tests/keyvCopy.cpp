@@ -0,0 +1,132 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Runs the keyv-copy application between leveldb stores and into a snapshot.
+
+#include <keyv/Map.h>
+
+#include <lunchbox/test.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#ifdef KEYV_USE_LEVELDB
+using keyv::Map;
+
+namespace
+{
+const size_t numKeys = 1000;
+const std::string source = "leveldb:///source?store=keyvCopySource.leveldb";
+
+std::string _key(const size_t i)
+{
+    return "key" + std::to_string(i);
+}
+
+int _copy(const std::string& from, const std::string& to,
+          const std::string& options = std::string())
+{
+    const std::string command = std::string(KEYV_COPY) + " " + options +
+                                " '" + from + "' '" + to + "'";
+    return std::system(command.c_str());
+}
+
+// the stores are closed before keyv-copy opens them in its own process
+void testCopy()
+{
+    const std::string destination =
+        "leveldb:///destination?store=keyvCopyDestination.leveldb";
+    {
+        Map map{servus::URI(destination)};
+        map.clear();
+    }
+    TEST(_copy(source, destination, "-t 3 -b 64") == EXIT_SUCCESS);
+
+    Map map{servus::URI(destination)};
+    for (size_t i = 0; i < numKeys; ++i)
+        TEST(map[_key(i)] == std::to_string(i));
+}
+
+void testResume()
+{
+    const std::string destination =
+        "leveldb:///resumed?store=keyvCopyDestination.leveldb";
+    const std::string checkpoint = "keyvCopy.checkpoint";
+    std::string lastKey;
+    {
+        Map from{servus::URI(source)};
+        lastKey = from.getKeys(std::string(), numKeys / 2).back();
+        Map map{servus::URI(destination)};
+        map.clear();
+    }
+    {
+        std::ofstream file(checkpoint, std::ios::binary);
+        file << lastKey;
+    }
+    TEST(_copy(source, destination, "-c " + checkpoint) == EXIT_SUCCESS);
+    TEST(!std::ifstream(checkpoint)); // removed after a complete copy
+
+    Map map{servus::URI(destination)};
+    size_t numCopied = 0;
+    for (size_t i = 0; i < numKeys; ++i)
+    {
+        const std::string& key = _key(i);
+        const std::string& value = map[key];
+        TEST(key <= lastKey ? value.empty() : value == std::to_string(i));
+        numCopied += !value.empty();
+    }
+    TEST(numCopied == numKeys - numKeys / 2);
+}
+
+void testSnapshot()
+{
+#ifndef _WIN32
+    const std::string filename = "keyvCopy.mmap";
+    const std::string destination = "mmap://" + filename;
+    TEST(_copy(source, destination, "-c keyvCopy.checkpoint") !=
+         EXIT_SUCCESS);
+    TEST(_copy(source, destination) == EXIT_SUCCESS);
+    {
+        Map map{servus::URI(destination)};
+        for (size_t i = 0; i < numKeys; ++i)
+            TEST(map[_key(i)] == std::to_string(i));
+    }
+    ::remove(filename.c_str());
+#endif
+}
+}
+#endif
+
+int main(int, char**)
+{
+#ifdef KEYV_USE_LEVELDB
+    {
+        Map map{servus::URI(source)};
+        map.clear();
+        for (size_t i = 0; i < numKeys; ++i)
+            TEST(map.insert(_key(i), std::to_string(i)));
+    }
+    testCopy();
+    testResume();
+    testSnapshot();
+#endif
+    return EXIT_SUCCESS;
+}
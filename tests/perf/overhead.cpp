@@ -0,0 +1,234 @@
+
+/* Copyright (c) 2018, EPFL/Blue Brain Project
+ *
+ * This file is part of Keyv <https://github.com/BlueBrain/Keyv>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 2.1 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Measures the CPU cost of the keyv frontend, independent of any backend I/O.
+// All benchmarks run against an in-process stub plugin which does no work.
+//
+// Usage: perf-overhead [results.csv]
+//
+// Results are written to the given file (default keyvOverhead.csv). If the
+// file already exists, the previous results are read first and the relative
+// change is reported, which allows comparing two builds or commits.
+
+#include <keyv/Map.h>
+#include <keyv/MemcachedHash.h>
+#include <keyv/Plugin.h>
+
+#include <lunchbox/clock.h>
+#include <lunchbox/pluginRegisterer.h>
+#include <lunchbox/test.h>
+#include <lunchbox/uint128_t.h>
+
+#include <boost/format.hpp>
+
+#include <fstream>
+#include <limits>
+#include <map>
+
+namespace
+{
+const int64_t loopTime = 500; // ms per benchmark
+const size_t numKeys = 1024;
+const size_t numElems = 256; // elements in vector/set values
+
+/** Plugin doing no work, so that only the frontend overhead is measured. */
+class Stub : public keyv::Plugin
+{
+public:
+    explicit Stub(const servus::URI&)
+        : _value(_makeValue())
+    {
+    }
+
+    static bool handles(const servus::URI& uri)
+    {
+        return uri.getScheme() == "keyvstub";
+    }
+    static std::string getDescription() { return "keyvstub://"; }
+    bool insert(const std::string&, const void*, size_t) final
+    {
+        ++_inserts;
+        return true;
+    }
+
+    void erase(const std::string&) final {}
+    bool flush() final { return true; }
+    std::string operator[](const std::string&) const final { return _value; }
+    void getValues(const keyv::Strings& keys,
+                   const keyv::ConstValueFunc& func) const final
+    {
+        for (const auto& key : keys)
+            func(key, _value.data(), _value.size());
+    }
+
+    // does not transfer ownership, the benchmark does not free() the values
+    void takeValues(const keyv::Strings& keys,
+                    const keyv::ValueFunc& func) const final
+    {
+        for (const auto& key : keys)
+            func(key, const_cast<char*>(_value.data()), _value.size());
+    }
+
+    size_t getInserts() const { return _inserts; }
+private:
+    const std::string _value;
+    size_t _inserts = 0;
+
+    static std::string _makeValue()
+    {
+        std::string value(numElems * sizeof(uint32_t), '\0');
+        uint32_t* elems = reinterpret_cast<uint32_t*>(&value[0]);
+        for (size_t i = 0; i < numElems; ++i)
+            elems[i] = uint32_t(i);
+        return value;
+    }
+};
+
+lunchbox::PluginRegisterer<Stub> registerer;
+
+using Results = std::map<std::string, double>; // name -> ns/op
+Results results;
+
+/** Run func in batches until loopTime passed, record and print ns/op. */
+template <class F>
+void measure(const std::string& name, const size_t opsPerCall, const F& func)
+{
+    lunchbox::Clock clock;
+    size_t ops = 0;
+    while (clock.getTime64() < loopTime)
+    {
+        for (size_t i = 0; i < 1024; ++i)
+            func();
+        ops += 1024 * opsPerCall;
+    }
+    const double nsPerOp = clock.getTimed() * 1000000. / double(ops);
+    results[name] = nsPerOp;
+    std::cout << boost::format("%-24s, %12.2f, %10.2f") % name %
+                     (1000000000. / nsPerOp) % nsPerOp
+              << std::flush;
+}
+
+Results load(const std::string& filename)
+{
+    Results previous;
+    std::ifstream file(filename);
+    std::string name;
+    double value;
+    while (std::getline(file, name, ',') && file >> value)
+    {
+        previous[name] = value;
+        file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+    return previous;
+}
+
+void save(const std::string& filename)
+{
+    std::ofstream file(filename);
+    for (const auto& result : results)
+        file << result.first << "," << result.second << std::endl;
+}
+}
+
+int main(const int argc, char* argv[])
+{
+    const std::string filename = argc > 1 ? argv[1] : "keyvOverhead.csv";
+    const Results previous = load(filename);
+
+    keyv::Map map(servus::URI("keyvstub://"));
+    Stub stub(servus::URI("keyvstub://"));
+
+    keyv::Strings keys;
+    for (size_t i = 0; i < numKeys; ++i)
+        keys.push_back("key" + std::to_string(i));
+    const std::string key = keys.front();
+    const std::string value(64, '*');
+
+    std::cout << "benchmark               ,        ops/s,      ns/op,  change"
+              << std::endl;
+    const auto report = [&](const std::string& name) {
+        const auto i = previous.find(name);
+        if (i == previous.end() || i->second <= 0.)
+            std::cout << std::endl;
+        else
+            std::cout << boost::format(", %+6.1f%%") %
+                             ((results[name] / i->second - 1.) * 100.)
+                      << std::endl;
+    };
+
+    // Writes
+    measure("plugin insert", 1, [&] { stub.insert(key, value.data(), 64); });
+    report("plugin insert");
+    measure("map insert", 1, [&] { map.insert(key, value.data(), 64); });
+    report("map insert");
+    measure("map insert<int>", 1, [&] { map.insert(key, 42); });
+    report("map insert<int>");
+    measure("map insert<string>", 1, [&] { map.insert(key, value); });
+    report("map insert<string>");
+
+    // Reads
+    size_t bytes = 0;
+    measure("map operator[]", 1, [&] { bytes += map[key].size(); });
+    report("map operator[]");
+    measure("map getValues", numKeys, [&] {
+        map.getValues(keys, [&](const std::string&, const char*,
+                                const size_t size) { bytes += size; });
+    });
+    report("map getValues");
+    measure("map takeValues", numKeys, [&] {
+        map.takeValues(keys, [&](const std::string&, char*,
+                                 const size_t size) { bytes += size; });
+    });
+    report("map takeValues");
+    measure("map getIndexedValues", numKeys, [&] {
+        map.getIndexedValues(keys, [&](size_t, const char*,
+                                       const size_t size) { bytes += size; });
+    });
+    report("map getIndexedValues");
+    measure("map fetch", numKeys, [&] { bytes += map.fetch(keys).size(); });
+    report("map fetch");
+
+    // Conversions
+    measure("map getVector<uint32_t>", 1,
+            [&] { bytes += map.getVector<uint32_t>(key).size(); });
+    report("map getVector<uint32_t>");
+    measure("map getSet<uint32_t>", 1,
+            [&] { bytes += map.getSet<uint32_t>(key).size(); });
+    report("map getSet<uint32_t>");
+
+    map.setByteswap(true);
+    measure("byteswap getVector", 1,
+            [&] { bytes += map.getVector<uint32_t>(key).size(); });
+    report("byteswap getVector");
+    map.setByteswap(false);
+
+    // Key hashing
+    const lunchbox::uint128_t ns = lunchbox::make_uint128("/namespace");
+    size_t i = 0;
+    measure("memcached hash", 1, [&] {
+        bytes += keyv::memcachedHash::hash(ns, 0, keys[++i % numKeys], "")
+                     .size();
+    });
+    report("memcached hash");
+
+    TEST(bytes > 0);
+    TEST(stub.getInserts() > 0);
+    save(filename);
+    return EXIT_SUCCESS;
+}